@@ -0,0 +1,57 @@
+#ifndef GRAVASTAR_ATOMIC_OPS_H
+#define GRAVASTAR_ATOMIC_OPS_H
+
+// Thin wrappers over the GCC/Clang __atomic builtins; C++98 has no <atomic>.
+
+namespace gravastar {
+
+template <typename T>
+inline T AtomicLoad(const T *ptr) {
+    return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
+
+template <typename T>
+inline T AtomicLoadRelaxed(const T *ptr) {
+    return __atomic_load_n(ptr, __ATOMIC_RELAXED);
+}
+
+template <typename T>
+inline void AtomicStore(T *ptr, T value) {
+    __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+}
+
+template <typename T>
+inline void AtomicStoreRelaxed(T *ptr, T value) {
+    __atomic_store_n(ptr, value, __ATOMIC_RELAXED);
+}
+
+template <typename T>
+inline T AtomicFetchAdd(T *ptr, T delta) {
+    return __atomic_fetch_add(ptr, delta, __ATOMIC_SEQ_CST);
+}
+
+template <typename T>
+inline T AtomicFetchAddRelaxed(T *ptr, T delta) {
+    return __atomic_fetch_add(ptr, delta, __ATOMIC_RELAXED);
+}
+
+template <typename T>
+inline T AtomicFetchSub(T *ptr, T delta) {
+    return __atomic_fetch_sub(ptr, delta, __ATOMIC_SEQ_CST);
+}
+
+// Weak CAS: may fail spuriously, so always call it in a retry loop. On
+// failure *expected is refreshed with the current value.
+template <typename T>
+inline bool AtomicCompareExchange(T *ptr, T *expected, T desired) {
+    return __atomic_compare_exchange_n(ptr, expected, desired, true,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+inline void AtomicFence() {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+} // namespace gravastar
+
+#endif // GRAVASTAR_ATOMIC_OPS_H
@@ -1,10 +1,74 @@
 #include "blocklist.h"
 
-#include "util.h"
+#include "atomic_ops.h"
 
 namespace gravastar {
 
-Blocklist::Blocklist() {
+namespace {
+
+const uint64_t kHashSeed = 14695981039346656037ULL;
+// Domains are stored by 32-bit offset.
+const size_t kMaxNameBytes = 0xffffffffu;
+
+char Lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+// Extends the hash of a suffix by the label name[start, end) to its left.
+uint64_t HashLabel(uint64_t hash, const char *name, size_t start, size_t end) {
+    for (size_t i = start; i < end; ++i) {
+        hash = (hash ^ static_cast<unsigned char>(Lower(name[i]))) *
+               1099511628211ULL;
+    }
+    return (hash ^ '.') * 1099511628211ULL;
+}
+
+// FNV leaves the low bits poorly spread for names that differ only near
+// their start.
+uint64_t MixHash(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// `start` of the label ending at `end`.
+size_t LabelStart(const char *name, size_t end) {
+    while (end > 0 && name[end - 1] != '.') {
+        --end;
+    }
+    return end;
+}
+
+uint64_t NameHash(const char *name, size_t len) {
+    uint64_t hash = kHashSeed;
+    size_t end = len;
+    for (;;) {
+        size_t start = LabelStart(name, end);
+        hash = HashLabel(hash, name, start, end);
+        if (start == 0) {
+            return hash;
+        }
+        end = start - 1;
+    }
+}
+
+// `stored` is lowercased and NUL-terminated.
+bool SameName(const char *stored, const char *name, size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+        if (stored[i] != Lower(name[i])) {
+            return false;
+        }
+    }
+    return stored[len] == '\0';
+}
+
+} // namespace
+
+Blocklist::Blocklist() : generation_(0) {
+    index_.count = 0;
     pthread_rwlock_init(&lock_, NULL);
 }
 
@@ -12,44 +76,127 @@ Blocklist::~Blocklist() {
     pthread_rwlock_destroy(&lock_);
 }
 
-void Blocklist::SetDomains(const std::set<std::string> &domains) {
-    pthread_rwlock_wrlock(&lock_);
-    domains_ = domains;
-    pthread_rwlock_unlock(&lock_);
+bool Blocklist::Contains(const Index &index, uint64_t hash, const char *name,
+                         size_t len) {
+    if (index.count == 0) {
+        return false;
+    }
+    uint64_t mixed = MixHash(hash);
+    uint32_t tag = static_cast<uint32_t>(mixed >> 32);
+    size_t mask = index.slots.size() - 1;
+    for (size_t pos = static_cast<size_t>(mixed) & mask;;
+         pos = (pos + 1) & mask) {
+        const Slot &slot = index.slots[pos];
+        if (slot.offset == 0) {
+            return false;
+        }
+        if (slot.tag == tag &&
+            SameName(&index.names[slot.offset - 1], name, len)) {
+            return true;
+        }
+    }
 }
 
-bool Blocklist::IsBlocked(const std::string &name) const {
-    pthread_rwlock_rdlock(&lock_);
-    if (domains_.empty()) {
-        pthread_rwlock_unlock(&lock_);
+bool Blocklist::Insert(const std::string &domain, Index *index) {
+    uint64_t hash = NameHash(domain.data(), domain.size());
+    if (domain.empty() ||
+        index->names.size() + domain.size() + 1 > kMaxNameBytes ||
+        Contains(*index, hash, domain.data(), domain.size())) {
         return false;
     }
-    std::string canon = ToLower(name);
-    if (!canon.empty() && canon[canon.size() - 1] == '.') {
-        canon.resize(canon.size() - 1);
+    uint64_t mixed = MixHash(hash);
+    size_t mask = index->slots.size() - 1;
+    size_t pos = static_cast<size_t>(mixed) & mask;
+    while (index->slots[pos].offset != 0) {
+        pos = (pos + 1) & mask;
     }
-    if (domains_.find(canon) != domains_.end()) {
-        pthread_rwlock_unlock(&lock_);
-        return true;
+    index->slots[pos].tag = static_cast<uint32_t>(mixed >> 32);
+    index->slots[pos].offset = static_cast<uint32_t>(index->names.size() + 1);
+    for (size_t i = 0; i < domain.size(); ++i) {
+        index->names.push_back(Lower(domain[i]));
     }
-    std::vector<std::string> labels = Split(canon, '.');
-    if (labels.size() < 2) {
-        pthread_rwlock_unlock(&lock_);
-        return false;
+    index->names.push_back('\0');
+    index->count++;
+    return true;
+}
+
+void Blocklist::SetDomains(const std::set<std::string> &domains) {
+    // Built outside the lock; queries only wait for the swap.
+    Index index;
+    index.count = 0;
+    size_t name_bytes = 0;
+    for (std::set<std::string>::const_iterator it = domains.begin();
+         it != domains.end(); ++it) {
+        name_bytes += it->size() + 1;
     }
-    for (size_t i = 1; i < labels.size(); ++i) {
-        std::string suffix = labels[i];
-        for (size_t j = i + 1; j < labels.size(); ++j) {
-            suffix.append(".");
-            suffix.append(labels[j]);
-        }
-        if (domains_.find(suffix) != domains_.end()) {
-            pthread_rwlock_unlock(&lock_);
-            return true;
+    // At most three quarters full, so probes stay short.
+    size_t slots = 16;
+    while (slots / 4 * 3 < domains.size()) {
+        slots <<= 1;
+    }
+    Slot empty = {0, 0};
+    index.slots.assign(slots, empty);
+    index.names.reserve(name_bytes < kMaxNameBytes ? name_bytes
+                                                   : kMaxNameBytes);
+    for (std::set<std::string>::const_iterator it = domains.begin();
+         it != domains.end(); ++it) {
+        Insert(*it, &index);
+    }
+    pthread_rwlock_wrlock(&lock_);
+    index_.names.swap(index.names);
+    index_.slots.swap(index.slots);
+    index_.count = index.count;
+    AtomicStore(&generation_, generation_ + 1);
+    pthread_rwlock_unlock(&lock_);
+}
+
+uint32_t Blocklist::generation() const {
+    return AtomicLoad(&generation_);
+}
+
+size_t Blocklist::size() const {
+    pthread_rwlock_rdlock(&lock_);
+    size_t count = index_.count;
+    pthread_rwlock_unlock(&lock_);
+    return count;
+}
+
+size_t Blocklist::memory_bytes() const {
+    pthread_rwlock_rdlock(&lock_);
+    size_t bytes = index_.names.capacity() +
+                   index_.slots.capacity() * sizeof(Slot);
+    pthread_rwlock_unlock(&lock_);
+    return bytes;
+}
+
+bool Blocklist::IsBlocked(const std::string &name) const {
+    const char *data = name.data();
+    size_t len = name.size();
+    if (len > 0 && data[len - 1] == '.') {
+        --len;
+    }
+    pthread_rwlock_rdlock(&lock_);
+    bool blocked = false;
+    if (index_.count > 0) {
+        // From the TLD down to the full name, one label at a time, each hash
+        // extending the last.
+        uint64_t hash = kHashSeed;
+        size_t end = len;
+        for (;;) {
+            size_t start = LabelStart(data, end);
+            hash = HashLabel(hash, data, start, end);
+            if (Contains(index_, hash, data + start, len - start)) {
+                blocked = true;
+                break;
+            }
+            if (start == 0) {
+                break;
+            }
+            end = start - 1;
         }
     }
     pthread_rwlock_unlock(&lock_);
-    return false;
+    return blocked;
 }
 
 } // namespace gravastar
@@ -2,23 +2,56 @@
 #define GRAVASTAR_BLOCKLIST_H
 
 #include <set>
+#include <stdint.h>
 #include <string>
+#include <vector>
 #include <pthread.h>
 
 namespace gravastar {
 
+// Blocks a domain and every name under it. The domains are kept lowercased
+// back to back in one buffer and found through an open-addressing table
+// keyed by a hash built label by label from the right, so IsBlocked() tries
+// the name and each of its parents in a single right-to-left pass, without
+// allocating.
 class Blocklist {
 public:
     Blocklist();
     ~Blocklist();
     void SetDomains(const std::set<std::string> &domains);
     bool IsBlocked(const std::string &name) const;
+    // Bumped by every SetDomains(), after the new domains are in place.
+    uint32_t generation() const;
+
+    size_t size() const;
+    // The name buffer and the table.
+    size_t memory_bytes() const;
 
 private:
     Blocklist(const Blocklist &);
     Blocklist &operator=(const Blocklist &);
 
-    std::set<std::string> domains_;
+    // `offset` is one past the domain's start in `names_`; 0 marks an empty
+    // slot. `tag` holds other bits of the hash, so most mismatches are
+    // settled without reading the name.
+    struct Slot {
+        uint32_t tag;
+        uint32_t offset;
+    };
+
+    struct Index {
+        // Each domain followed by a NUL.
+        std::vector<char> names;
+        std::vector<Slot> slots;
+        size_t count;
+    };
+
+    static bool Insert(const std::string &domain, Index *index);
+    static bool Contains(const Index &index, uint64_t hash, const char *name,
+                         size_t len);
+
+    Index index_;
+    uint32_t generation_;
     mutable pthread_rwlock_t lock_;
 };
 
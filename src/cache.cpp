@@ -1,79 +1,1325 @@
 #include "cache.h"
 
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "atomic_ops.h"
+#include "dns_packet.h"
+
 namespace gravastar {
 
+namespace {
+
+const uint32_t kNil = 0xffffffffu;
+const size_t kInitialSlots = 1024;
+const size_t kWheelSlots = 4096;
+
+// Slabs are carved into equal chunks of one size class. Classes grow by
+// about a quarter so no chunk wastes more than a fifth of itself; anything
+// larger than the last class gets an allocation of its own.
+const size_t kSlabBytes = 16 * 1024;
+const size_t kClassSizes[] = {
+    64, 80, 96, 112, 128, 160, 192, 240, 304, 384, 480, 608, 768, 960,
+    1200, 1504, 1888, 2368, 2960, 3712, 4096};
+const size_t kClassCount = sizeof(kClassSizes) / sizeof(kClassSizes[0]);
+const unsigned char kOversize = 0xff;
+
+// A shard needs a partly used slab for every size class in use; below this
+// many slabs most of its budget would go to their free chunks, so the cache
+// is split into fewer shards.
+const size_t kMinSlabsPerShard = 32;
+
+// S3-FIFO gives new entries a tenth of the budget to prove themselves in.
+const size_t kSmallQueuePercent = 10;
+// Hits an entry can bank against eviction.
+const unsigned char kMaxFreq = 3;
+// Sizes the frequency sketch and the ghost table: one counter and one
+// ghost slot per this many bytes of budget.
+const size_t kBytesPerTrackedKey = 256;
+
+enum {
+    kMainQueue = 0,
+    kSmallQueue = 1
+};
+
+// A snapshot starts with a SnapshotHeader, followed by one SnapshotRecord
+// per entry, each followed by the entry's payload exactly as it sits in its
+// chunk. Fields are in host byte order; `byte_order` catches a snapshot
+// carried over from a machine with the other one. `config_tag` is the
+// caller's digest of the configuration the answers were built under.
+const char kSnapshotMagic[8] = {'G', 'R', 'V', 'C', 'A', 'C', 'H', 'E'};
+const uint32_t kSnapshotVersion = 2;
+const uint32_t kSnapshotByteOrder = 0x01020304u;
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t config_tag;
+};
+
+struct SnapshotRecord {
+    int64_t stored;
+    int64_t expiry;
+    uint32_t hash;
+    uint32_t response_size;
+    uint16_t key_size;
+    uint16_t ttl_count;
+    unsigned char queue;
+    unsigned char pad[3];
+};
+
+unsigned char ClassFor(size_t bytes) {
+    for (size_t i = 0; i < kClassCount; ++i) {
+        if (bytes <= kClassSizes[i]) {
+            return static_cast<unsigned char>(i);
+        }
+    }
+    return kOversize;
+}
+
+// A count-min sketch of how often each key hash was seen: four rows of
+// saturating 8-bit counters, all halved once there have been ten samples
+// per counter so that old popularity fades (TinyLFU). Counters are bumped under the
+// shard's read lock, so they are relaxed atomics; a lost increment only
+// makes an estimate a little low.
+class FrequencySketch {
+public:
+    FrequencySketch() : mask_(0), samples_(0) {}
+
+    size_t bytes() const { return counters_.size(); }
+    size_t width() const { return counters_.empty() ? 0 : mask_ + 1; }
+
+    // `width` must be a power of two; 0 turns the sketch off.
+    void Resize(size_t width) {
+        std::vector<unsigned char>(width * kRows, 0).swap(counters_);
+        mask_ = width ? width - 1 : 0;
+        samples_ = 0;
+    }
+
+    void Increment(uint32_t hash) {
+        if (counters_.empty()) {
+            return;
+        }
+        for (size_t row = 0; row < kRows; ++row) {
+            unsigned char *counter = &counters_[Index(hash, row)];
+            unsigned char value = AtomicLoadRelaxed(counter);
+            if (value < 255) {
+                AtomicStoreRelaxed(counter,
+                                   static_cast<unsigned char>(value + 1));
+            }
+        }
+        AtomicFetchAddRelaxed(&samples_, static_cast<size_t>(1));
+    }
+
+    unsigned int Estimate(uint32_t hash) const {
+        if (counters_.empty()) {
+            return 0;
+        }
+        unsigned int least = 255;
+        for (size_t row = 0; row < kRows; ++row) {
+            unsigned int value = AtomicLoadRelaxed(&counters_[Index(hash, row)]);
+            if (value < least) {
+                least = value;
+            }
+        }
+        return least;
+    }
+
+    // Only with the shard's write lock held.
+    void AgeIfDue() {
+        if (samples_ < (mask_ + 1) * 10) {
+            return;
+        }
+        for (size_t i = 0; i < counters_.size(); ++i) {
+            counters_[i] = static_cast<unsigned char>(counters_[i] >> 1);
+        }
+        samples_ /= 2;
+    }
+
+private:
+    static const size_t kRows = 4;
+
+    size_t Index(uint32_t hash, size_t row) const {
+        static const uint32_t kSeeds[kRows] = {
+            0x9e3779b1u, 0x85ebca77u, 0xc2b2ae3du, 0x27d4eb2fu};
+        uint32_t mixed = (hash ^ (hash >> 15)) * kSeeds[row];
+        return row * (mask_ + 1) + ((mixed ^ (mixed >> 13)) & mask_);
+    }
+
+    std::vector<unsigned char> counters_;
+    size_t mask_;
+    size_t samples_;
+};
+
+size_t PowerOfTwoAtLeast(size_t n) {
+    size_t width = 64;
+    while (width < n) {
+        width *= 2;
+    }
+    return width;
+}
+
+} // namespace
+
+// One independently locked slice of the cache. Lookups run under the read
+// lock and touch nothing but the atomic `hits` and `freq` fields and the
+// frequency sketch; everything else changes under the write lock.
+//
+// An entry's key, TTL offsets and response share one chunk from the
+// shard's slabs, so the only other memory it costs is its Entry and its
+// share of the slot table. All of that is charged to the shard's budget,
+// along with the unused tail of every chunk and slab.
+class DnsCache::Shard {
+public:
+    struct Entry {
+        // The TTL offsets (uint16_t each), then the key, then the response.
+        unsigned char *data;
+        time_t stored;
+        time_t expiry;
+        // When the timing wheel drops the entry: expiry plus the stale window.
+        time_t drop;
+        uint32_t hash;
+        uint32_t slab;
+        uint32_t response_size;
+        uint16_t key_size;
+        uint16_t ttl_count;
+        unsigned int hits;
+        // Hits since eviction last looked at the entry, up to kMaxFreq.
+        unsigned char freq;
+        unsigned char size_class;
+        unsigned char queue;
+        uint32_t queue_prev;
+        uint32_t queue_next;
+        uint32_t wheel_prev;
+        uint32_t wheel_next;
+
+        const uint16_t *ttl_offsets() const {
+            return reinterpret_cast<const uint16_t *>(data);
+        }
+        const unsigned char *key() const {
+            return data + ttl_count * sizeof(uint16_t);
+        }
+        const unsigned char *response() const { return key() + key_size; }
+        size_t payload() const {
+            return ttl_count * sizeof(uint16_t) + key_size + response_size;
+        }
+        // Copies the response out with its TTLs set to `ttl`.
+        void CopyOut(uint32_t ttl, std::vector<unsigned char> *out) const;
+    };
+
+    // Bookkeeping charged per entry on top of its chunk: the Entry and the
+    // two table slots it keeps the table at most half full with.
+    static const size_t kEntryOverhead = sizeof(Entry) + 2 * sizeof(uint32_t);
+
+    Shard()
+        : max_bytes(0), count(0), slab_bytes(0), chunk_bytes(0),
+          payload_bytes(0), oversize_bytes(0), rejected(0),
+          slots_(kInitialSlots, kNil),
+          slot_mask_(kInitialSlots - 1), partial_(kClassCount, kNil),
+          policy_(CACHE_POLICY_CLOCK), small_bytes_(0), newest_(kNil),
+          wheel_(kWheelSlots, kNil), wheel_time_(0) {
+        queue_head_[kMainQueue] = queue_tail_[kMainQueue] = kNil;
+        queue_head_[kSmallQueue] = queue_tail_[kSmallQueue] = kNil;
+        pthread_rwlock_init(&lock, NULL);
+    }
+
+    ~Shard();
+
+    uint32_t Lookup(const std::string &key, uint32_t hash) const {
+        size_t pos = 0;
+        return FindSlot(reinterpret_cast<const unsigned char *>(key.data()),
+                        key.size(), hash, &pos)
+                   ? slots_[pos]
+                   : kNil;
+    }
+
+    Entry &At(uint32_t index) { return entries_[index]; }
+    const Entry &At(uint32_t index) const { return entries_[index]; }
+    // Where `queue` is next evicted from; follow queue_next to its tail.
+    uint32_t QueueHead(unsigned char queue) const { return queue_head_[queue]; }
+
+    size_t charged_bytes() const {
+        return slab_bytes + oversize_bytes + count * kEntryOverhead +
+               policy_bytes();
+    }
+    // The frequency sketch and ghost table.
+    size_t policy_bytes() const {
+        return sketch_.bytes() + ghosts_.size() * sizeof(uint32_t);
+    }
+
+    void SetPolicy(CachePolicy policy);
+    void SetMaxBytes(size_t bytes);
+    // Counts a lookup of `hash` for the admission filter. Safe under the
+    // read lock.
+    void RecordAccess(uint32_t hash) { sketch_.Increment(hash); }
+    // Only with the write lock held.
+    void AgeSketch() { sketch_.AgeIfDue(); }
+
+    // `keep_main` puts the entry straight into the main queue.
+    void Insert(const std::string &key, uint32_t hash,
+                const std::vector<unsigned char> &response,
+                const std::vector<size_t> &ttl_offsets, time_t now,
+                time_t expiry, time_t drop, bool keep_main);
+    // Adds an entry from a snapshot, `payload` laid out as in a chunk.
+    // Returns false if its key is already cached.
+    bool Restore(const SnapshotRecord &record, const unsigned char *payload,
+                 time_t drop);
+    void Remove(uint32_t index);
+    void Advance(time_t now);
+    void EvictIfNeeded();
+
+    pthread_rwlock_t lock;
+    size_t max_bytes;
+    size_t count;
+    size_t slab_bytes;
+    // Chunks handed out, and the part of them entries actually use.
+    size_t chunk_bytes;
+    size_t payload_bytes;
+    size_t oversize_bytes;
+    size_t rejected;
+
+private:
+    struct Slab {
+        unsigned char *memory;
+        // Chunks past `carved` have never been used; freed ones are chained
+        // through their first four bytes from `free_head`.
+        uint32_t free_head;
+        uint32_t carved;
+        uint32_t used;
+        unsigned char size_class;
+        uint32_t partial_prev;
+        uint32_t partial_next;
+    };
+
+    Shard(const Shard &);
+    Shard &operator=(const Shard &);
+
+    // Sets `*pos` to the table position holding `key` and returns true, or
+    // to the empty position it would go in and returns false.
+    bool FindSlot(const unsigned char *key, size_t key_size, uint32_t hash,
+                  size_t *pos) const;
+    void Grow();
+    // Takes a chunk for an entry of this shape and returns the entry's
+    // index; the caller fills the chunk in and then calls Link().
+    uint32_t NewEntry(size_t ttl_count, size_t key_size, size_t response_size,
+                      uint32_t hash, time_t stored, time_t expiry,
+                      time_t drop);
+    void Link(uint32_t index, bool main);
+    unsigned char *Allocate(size_t bytes, unsigned char *size_class,
+                            uint32_t *slab);
+    unsigned char *TakeChunk(unsigned char size_class, uint32_t *slab);
+    void FreeChunk(unsigned char size_class, uint32_t slab,
+                   unsigned char *chunk);
+    uint32_t NewSlab(unsigned char size_class);
+    void LinkPartial(uint32_t slab);
+    void UnlinkPartial(uint32_t slab);
+    bool HasRoom(size_t bytes) const;
+    bool Admit(uint32_t hash);
+    bool EvictOne();
+    bool EvictClock();
+    bool EvictS3Fifo();
+    uint32_t NextVictim() const;
+    void RememberGhost(uint32_t hash);
+    bool TakeGhost(uint32_t hash);
+    size_t Cost(const Entry &entry) const;
+    void LinkQueue(uint32_t index, unsigned char queue);
+    void UnlinkQueue(uint32_t index);
+    void LinkWheel(uint32_t index);
+    void UnlinkWheel(uint32_t index);
+
+    // A deque, so growing it never moves existing entries.
+    std::deque<Entry> entries_;
+    std::vector<uint32_t> free_;
+    std::vector<uint32_t> slots_;
+    size_t slot_mask_;
+    std::vector<Slab> slabs_;
+    std::vector<uint32_t> free_slabs_;
+    // Per size class, the slabs that still have a free chunk.
+    std::vector<uint32_t> partial_;
+    CachePolicy policy_;
+    // kMainQueue holds everything under CLOCK. S3-FIFO inserts into
+    // kSmallQueue, and moves entries hit there into kMainQueue.
+    uint32_t queue_head_[2];  // next eviction candidates
+    uint32_t queue_tail_[2];
+    size_t small_bytes_;
+    uint32_t newest_;
+    FrequencySketch sketch_;
+    // Hashes of keys S3-FIFO recently evicted unhit from the small queue,
+    // one per slot; a key found here goes straight to the main queue when
+    // it comes back.
+    std::vector<uint32_t> ghosts_;
+    std::vector<uint32_t> wheel_;
+    time_t wheel_time_;
+};
+
+void DnsCache::Shard::Entry::CopyOut(uint32_t ttl,
+                                     std::vector<unsigned char> *out) const {
+    out->assign(response(), response() + response_size);
+    const uint16_t *offsets = ttl_offsets();
+    for (size_t i = 0; i < ttl_count; ++i) {
+        unsigned char *field = &(*out)[offsets[i]];
+        field[0] = static_cast<unsigned char>((ttl >> 24) & 0xff);
+        field[1] = static_cast<unsigned char>((ttl >> 16) & 0xff);
+        field[2] = static_cast<unsigned char>((ttl >> 8) & 0xff);
+        field[3] = static_cast<unsigned char>(ttl & 0xff);
+    }
+}
+
+DnsCache::Shard::~Shard() {
+    for (size_t i = 0; i < slabs_.size(); ++i) {
+        delete[] slabs_[i].memory;
+    }
+    for (size_t i = 0; i < entries_.size(); ++i) {
+        if (entries_[i].data && entries_[i].size_class == kOversize) {
+            delete[] entries_[i].data;
+        }
+    }
+    pthread_rwlock_destroy(&lock);
+}
+
+void DnsCache::Shard::Insert(const std::string &key, uint32_t hash,
+                             const std::vector<unsigned char> &response,
+                             const std::vector<size_t> &ttl_offsets,
+                             time_t now, time_t expiry, time_t drop,
+                             bool keep_main) {
+    uint32_t index = NewEntry(ttl_offsets.size(), key.size(), response.size(),
+                              hash, now, expiry, drop);
+    unsigned char *data = entries_[index].data;
+    uint16_t *offsets = reinterpret_cast<uint16_t *>(data);
+    for (size_t i = 0; i < ttl_offsets.size(); ++i) {
+        offsets[i] = static_cast<uint16_t>(ttl_offsets[i]);
+    }
+    std::memcpy(data + ttl_offsets.size() * sizeof(uint16_t), key.data(),
+                key.size());
+    if (!response.empty()) {
+        std::memcpy(data + ttl_offsets.size() * sizeof(uint16_t) + key.size(),
+                    &response[0], response.size());
+    }
+    Link(index, policy_ == CACHE_POLICY_CLOCK || keep_main ||
+                    (TakeGhost(hash) && Admit(hash)));
+}
+
+bool DnsCache::Shard::Restore(const SnapshotRecord &record,
+                              const unsigned char *payload, time_t drop) {
+    size_t pos = 0;
+    if (FindSlot(payload + record.ttl_count * sizeof(uint16_t),
+                 record.key_size, record.hash, &pos)) {
+        return false;
+    }
+    uint32_t index =
+        NewEntry(record.ttl_count, record.key_size, record.response_size,
+                 record.hash, static_cast<time_t>(record.stored),
+                 static_cast<time_t>(record.expiry), drop);
+    std::memcpy(entries_[index].data, payload, entries_[index].payload());
+    Link(index, policy_ == CACHE_POLICY_CLOCK || record.queue == kMainQueue);
+    return true;
+}
+
+uint32_t DnsCache::Shard::NewEntry(size_t ttl_count, size_t key_size,
+                                   size_t response_size, uint32_t hash,
+                                   time_t stored, time_t expiry,
+                                   time_t drop) {
+    size_t bytes = ttl_count * sizeof(uint16_t) + key_size + response_size;
+    unsigned char size_class = 0;
+    uint32_t slab = kNil;
+    unsigned char *data = Allocate(bytes, &size_class, &slab);
+    if ((count + 1) * 2 > slots_.size()) {
+        Grow();
+    }
+    uint32_t index;
+    if (!free_.empty()) {
+        index = free_.back();
+        free_.pop_back();
+    } else {
+        index = static_cast<uint32_t>(entries_.size());
+        entries_.push_back(Entry());
+    }
+    Entry &entry = entries_[index];
+    entry.data = data;
+    entry.stored = stored;
+    entry.expiry = expiry;
+    entry.drop = drop;
+    entry.hash = hash;
+    entry.slab = slab;
+    entry.response_size = static_cast<uint32_t>(response_size);
+    entry.key_size = static_cast<uint16_t>(key_size);
+    entry.ttl_count = static_cast<uint16_t>(ttl_count);
+    entry.hits = 0;
+    entry.freq = 0;
+    entry.size_class = size_class;
+    return index;
+}
+
+void DnsCache::Shard::Link(uint32_t index, bool main) {
+    Entry &entry = entries_[index];
+    size_t pos = 0;
+    FindSlot(entry.key(), entry.key_size, entry.hash, &pos);
+    slots_[pos] = index;
+    ++count;
+    payload_bytes += entry.payload();
+    LinkQueue(index, main ? kMainQueue : kSmallQueue);
+    LinkWheel(index);
+    newest_ = index;
+}
+
+bool DnsCache::Shard::FindSlot(const unsigned char *key, size_t key_size,
+                               uint32_t hash, size_t *pos) const {
+    size_t at = hash & slot_mask_;
+    while (slots_[at] != kNil) {
+        const Entry &entry = entries_[slots_[at]];
+        if (entry.hash == hash && entry.key_size == key_size &&
+            std::memcmp(entry.key(), key, key_size) == 0) {
+            *pos = at;
+            return true;
+        }
+        at = (at + 1) & slot_mask_;
+    }
+    *pos = at;
+    return false;
+}
+
+void DnsCache::Shard::Grow() {
+    std::vector<uint32_t> old;
+    old.swap(slots_);
+    slots_.assign(old.size() * 2, kNil);
+    slot_mask_ = slots_.size() - 1;
+    for (size_t i = 0; i < old.size(); ++i) {
+        if (old[i] == kNil) {
+            continue;
+        }
+        size_t pos = entries_[old[i]].hash & slot_mask_;
+        while (slots_[pos] != kNil) {
+            pos = (pos + 1) & slot_mask_;
+        }
+        slots_[pos] = old[i];
+    }
+}
+
+void DnsCache::Shard::Remove(uint32_t index) {
+    Entry &entry = entries_[index];
+    size_t hole = entry.hash & slot_mask_;
+    while (slots_[hole] != kNil && slots_[hole] != index) {
+        hole = (hole + 1) & slot_mask_;
+    }
+    if (slots_[hole] == index) {
+        // Shift back every later entry of the probe run that may not skip
+        // over the hole, so lookups never need tombstones.
+        size_t pos = hole;
+        for (;;) {
+            pos = (pos + 1) & slot_mask_;
+            if (slots_[pos] == kNil) {
+                break;
+            }
+            size_t home = entries_[slots_[pos]].hash & slot_mask_;
+            bool movable = hole <= pos ? (home <= hole || home > pos)
+                                       : (home <= hole && home > pos);
+            if (movable) {
+                slots_[hole] = slots_[pos];
+                hole = pos;
+            }
+        }
+        slots_[hole] = kNil;
+    }
+    UnlinkQueue(index);
+    UnlinkWheel(index);
+    payload_bytes -= entry.payload();
+    --count;
+    if (entry.size_class == kOversize) {
+        oversize_bytes -= entry.payload();
+        delete[] entry.data;
+    } else {
+        FreeChunk(entry.size_class, entry.slab, entry.data);
+    }
+    entry.data = NULL;
+    free_.push_back(index);
+}
+
+// Finds room for `bytes`, evicting entries while a new slab would go over
+// budget. A shard always has room for one entry, however small its budget.
+unsigned char *DnsCache::Shard::Allocate(size_t bytes,
+                                         unsigned char *size_class,
+                                         uint32_t *slab) {
+    *size_class = ClassFor(bytes);
+    if (*size_class == kOversize) {
+        // Counted in payload_bytes as well, once the entry is in.
+        oversize_bytes += bytes;
+        *slab = kNil;
+        return new unsigned char[bytes];
+    }
+    for (;;) {
+        unsigned char *chunk = TakeChunk(*size_class, slab);
+        if (chunk) {
+            return chunk;
+        }
+        if (count == 0 || HasRoom(bytes) || !EvictOne()) {
+            *slab = NewSlab(*size_class);
+        }
+    }
+}
+
+// A chunk from a slab of `size_class` that has one free, or NULL.
+unsigned char *DnsCache::Shard::TakeChunk(unsigned char size_class,
+                                          uint32_t *slab) {
+    uint32_t at = partial_[size_class];
+    if (at == kNil) {
+        return NULL;
+    }
+    Slab &s = slabs_[at];
+    size_t chunk_size = kClassSizes[size_class];
+    unsigned char *chunk;
+    if (s.free_head != kNil) {
+        chunk = s.memory + s.free_head * chunk_size;
+        std::memcpy(&s.free_head, chunk, sizeof(s.free_head));
+    } else {
+        chunk = s.memory + s.carved * chunk_size;
+        ++s.carved;
+    }
+    ++s.used;
+    if (s.used == kSlabBytes / chunk_size) {
+        UnlinkPartial(at);
+    }
+    chunk_bytes += chunk_size;
+    *slab = at;
+    return chunk;
+}
+
+// Empty slabs go straight back to the system, so memory held by a size
+// class that fell out of use is not kept from the others.
+void DnsCache::Shard::FreeChunk(unsigned char size_class, uint32_t slab,
+                                unsigned char *chunk) {
+    Slab &s = slabs_[slab];
+    size_t chunk_size = kClassSizes[size_class];
+    bool was_full = s.used == kSlabBytes / chunk_size;
+    uint32_t chunk_index =
+        static_cast<uint32_t>((chunk - s.memory) / chunk_size);
+    std::memcpy(chunk, &s.free_head, sizeof(s.free_head));
+    s.free_head = chunk_index;
+    --s.used;
+    chunk_bytes -= chunk_size;
+    if (s.used == 0) {
+        if (!was_full) {
+            UnlinkPartial(slab);
+        }
+        delete[] s.memory;
+        s.memory = NULL;
+        slab_bytes -= kSlabBytes;
+        free_slabs_.push_back(slab);
+    } else if (was_full) {
+        LinkPartial(slab);
+    }
+}
+
+uint32_t DnsCache::Shard::NewSlab(unsigned char size_class) {
+    uint32_t at;
+    if (!free_slabs_.empty()) {
+        at = free_slabs_.back();
+        free_slabs_.pop_back();
+    } else {
+        at = static_cast<uint32_t>(slabs_.size());
+        slabs_.push_back(Slab());
+    }
+    Slab &s = slabs_[at];
+    s.memory = new unsigned char[kSlabBytes];
+    s.free_head = kNil;
+    s.carved = 0;
+    s.used = 0;
+    s.size_class = size_class;
+    slab_bytes += kSlabBytes;
+    LinkPartial(at);
+    return at;
+}
+
+void DnsCache::Shard::LinkPartial(uint32_t slab) {
+    Slab &s = slabs_[slab];
+    uint32_t &head = partial_[s.size_class];
+    s.partial_prev = kNil;
+    s.partial_next = head;
+    if (head != kNil) {
+        slabs_[head].partial_prev = slab;
+    }
+    head = slab;
+}
+
+void DnsCache::Shard::UnlinkPartial(uint32_t slab) {
+    Slab &s = slabs_[slab];
+    if (s.partial_prev != kNil) {
+        slabs_[s.partial_prev].partial_next = s.partial_next;
+    } else {
+        partial_[s.size_class] = s.partial_next;
+    }
+    if (s.partial_next != kNil) {
+        slabs_[s.partial_next].partial_prev = s.partial_prev;
+    }
+}
+
+void DnsCache::Shard::LinkQueue(uint32_t index, unsigned char queue) {
+    Entry &entry = entries_[index];
+    entry.queue = queue;
+    entry.queue_prev = queue_tail_[queue];
+    entry.queue_next = kNil;
+    if (queue_tail_[queue] != kNil) {
+        entries_[queue_tail_[queue]].queue_next = index;
+    } else {
+        queue_head_[queue] = index;
+    }
+    queue_tail_[queue] = index;
+    if (queue == kSmallQueue) {
+        small_bytes_ += Cost(entry);
+    }
+}
+
+void DnsCache::Shard::UnlinkQueue(uint32_t index) {
+    Entry &entry = entries_[index];
+    unsigned char queue = entry.queue;
+    if (entry.queue_prev != kNil) {
+        entries_[entry.queue_prev].queue_next = entry.queue_next;
+    } else {
+        queue_head_[queue] = entry.queue_next;
+    }
+    if (entry.queue_next != kNil) {
+        entries_[entry.queue_next].queue_prev = entry.queue_prev;
+    } else {
+        queue_tail_[queue] = entry.queue_prev;
+    }
+    if (queue == kSmallQueue) {
+        small_bytes_ -= Cost(entry);
+    }
+}
+
+void DnsCache::Shard::LinkWheel(uint32_t index) {
+    Entry &entry = entries_[index];
+    uint32_t &head = wheel_[static_cast<size_t>(entry.drop) % kWheelSlots];
+    entry.wheel_prev = kNil;
+    entry.wheel_next = head;
+    if (head != kNil) {
+        entries_[head].wheel_prev = index;
+    }
+    head = index;
+}
+
+void DnsCache::Shard::UnlinkWheel(uint32_t index) {
+    Entry &entry = entries_[index];
+    if (entry.wheel_prev != kNil) {
+        entries_[entry.wheel_prev].wheel_next = entry.wheel_next;
+    } else {
+        wheel_[static_cast<size_t>(entry.drop) % kWheelSlots] = entry.wheel_next;
+    }
+    if (entry.wheel_next != kNil) {
+        entries_[entry.wheel_next].wheel_prev = entry.wheel_prev;
+    }
+}
+
+// Drops everything whose stale window has closed by `now`. Each second is
+// visited once; a slot also holds entries due whole turns of the wheel
+// later, which stay put.
+void DnsCache::Shard::Advance(time_t now) {
+    if (wheel_time_ == 0 || now <= wheel_time_) {
+        if (wheel_time_ == 0) {
+            wheel_time_ = now;
+        }
+        return;
+    }
+    time_t ticks = now - wheel_time_;
+    if (ticks > static_cast<time_t>(kWheelSlots)) {
+        ticks = static_cast<time_t>(kWheelSlots);
+    }
+    for (time_t t = now - ticks + 1; t <= now; ++t) {
+        uint32_t index = wheel_[static_cast<size_t>(t) % kWheelSlots];
+        while (index != kNil) {
+            uint32_t next = entries_[index].wheel_next;
+            if (entries_[index].drop <= now) {
+                Remove(index);
+            }
+            index = next;
+        }
+    }
+    wheel_time_ = now;
+}
+
+// What an entry is charged for its storage, not counting kEntryOverhead.
+size_t DnsCache::Shard::Cost(const Entry &entry) const {
+    return entry.size_class == kOversize ? entry.payload()
+                                         : kClassSizes[entry.size_class];
+}
+
+// Whether `bytes` more of payload fit without evicting anything.
+bool DnsCache::Shard::HasRoom(size_t bytes) const {
+    unsigned char size_class = ClassFor(bytes);
+    size_t extra = kEntryOverhead;
+    if (size_class == kOversize) {
+        extra += bytes;
+    } else if (partial_[size_class] == kNil) {
+        extra += kSlabBytes;
+    }
+    return charged_bytes() + extra <= max_bytes;
+}
+
+void DnsCache::Shard::SetPolicy(CachePolicy policy) {
+    policy_ = policy;
+    if (policy == CACHE_POLICY_CLOCK) {
+        while (queue_head_[kSmallQueue] != kNil) {
+            uint32_t index = queue_head_[kSmallQueue];
+            UnlinkQueue(index);
+            LinkQueue(index, kMainQueue);
+        }
+    }
+    SetMaxBytes(max_bytes);
+}
+
+void DnsCache::Shard::SetMaxBytes(size_t bytes) {
+    max_bytes = bytes;
+    size_t tracked = PowerOfTwoAtLeast(bytes / kBytesPerTrackedKey);
+    size_t sketch = policy_ == CACHE_POLICY_TINYLFU ? tracked : 0;
+    size_t ghosts = policy_ != CACHE_POLICY_CLOCK ? tracked : 0;
+    if (sketch != sketch_.width()) {
+        sketch_.Resize(sketch);
+    }
+    if (ghosts != ghosts_.size()) {
+        std::vector<uint32_t>(ghosts, 0).swap(ghosts_);
+    }
+    EvictIfNeeded();
+}
+
+// TinyLFU: a key coming back from the ghost table only takes a place in
+// the main queue if it has been looked up more often than the entry that
+// queue would give up next; otherwise it starts over in the small queue.
+bool DnsCache::Shard::Admit(uint32_t hash) {
+    uint32_t victim = queue_head_[kMainQueue];
+    if (policy_ != CACHE_POLICY_TINYLFU || victim == kNil ||
+        sketch_.Estimate(hash) > sketch_.Estimate(entries_[victim].hash)) {
+        return true;
+    }
+    ++rejected;
+    return false;
+}
+
+// The entry S3-FIFO looks at first: the small queue's head while that
+// queue is over its share, else the main queue's.
+uint32_t DnsCache::Shard::NextVictim() const {
+    bool small = queue_head_[kSmallQueue] != kNil &&
+                 (small_bytes_ * 100 >= max_bytes * kSmallQueuePercent ||
+                  queue_head_[kMainQueue] == kNil);
+    return queue_head_[small ? kSmallQueue : kMainQueue];
+}
+
+void DnsCache::Shard::RememberGhost(uint32_t hash) {
+    if (!ghosts_.empty()) {
+        ghosts_[hash & (ghosts_.size() - 1)] = hash;
+    }
+}
+
+bool DnsCache::Shard::TakeGhost(uint32_t hash) {
+    if (ghosts_.empty()) {
+        return false;
+    }
+    uint32_t &slot = ghosts_[hash & (ghosts_.size() - 1)];
+    if (slot != hash || hash == 0) {
+        return false;
+    }
+    slot = 0;
+    return true;
+}
+
+// The newest entry is never evicted. Returns false when there was nothing
+// else to evict.
+bool DnsCache::Shard::EvictOne() {
+    return policy_ == CACHE_POLICY_CLOCK ? EvictClock() : EvictS3Fifo();
+}
+
+// Second chance: an entry hit since it last reached the head goes round
+// again with its count cleared; the first one that was not is evicted.
+bool DnsCache::Shard::EvictClock() {
+    uint32_t *head = &queue_head_[kMainQueue];
+    while (*head != kNil) {
+        uint32_t index = *head;
+        Entry &entry = entries_[index];
+        if (index == newest_) {
+            // Rotations move it off the tail, so it is skipped by identity.
+            if (entry.queue_next == kNil) {
+                return false;
+            }
+            UnlinkQueue(index);
+            LinkQueue(index, kMainQueue);
+            continue;
+        }
+        if (entry.freq) {
+            entry.freq = 0;
+            UnlinkQueue(index);
+            LinkQueue(index, kMainQueue);
+            continue;
+        }
+        Remove(index);
+        return true;
+    }
+    return false;
+}
+
+// S3-FIFO: an entry not hit during its time in the small queue is evicted
+// from there, leaving a ghost, so a scan of one-off names only ever churns
+// that queue. Hit ones move to the main queue, which is a CLOCK whose
+// entries can bank up to kMaxFreq passes.
+bool DnsCache::Shard::EvictS3Fifo() {
+    for (;;) {
+        uint32_t index = NextVictim();
+        if (index == newest_) {
+            unsigned char other = entries_[index].queue == kSmallQueue
+                                      ? kMainQueue
+                                      : kSmallQueue;
+            index = queue_head_[other];
+        }
+        if (index == kNil || index == newest_) {
+            return false;
+        }
+        Entry &entry = entries_[index];
+        if (entry.freq == 0) {
+            if (entry.queue == kSmallQueue) {
+                RememberGhost(entry.hash);
+            }
+            Remove(index);
+            return true;
+        }
+        entry.freq = entry.queue == kSmallQueue
+                         ? 0
+                         : static_cast<unsigned char>(entry.freq - 1);
+        UnlinkQueue(index);
+        LinkQueue(index, kMainQueue);
+    }
+}
+
+void DnsCache::Shard::EvictIfNeeded() {
+    while (charged_bytes() > max_bytes && EvictOne()) {
+    }
+}
+
 DnsCache::DnsCache(size_t max_bytes, unsigned int ttl_sec)
-    : max_bytes_(max_bytes), ttl_sec_(ttl_sec), current_bytes_(0) {}
+    : max_bytes_(max_bytes), ttl_sec_(ttl_sec), min_ttl_(0),
+      max_ttl_(ttl_sec), max_negative_ttl_(ttl_sec), prefetch_percent_(0),
+      prefetch_min_hits_(0), stale_sec_(0) {
+    Init(1);
+}
+
+DnsCache::DnsCache(size_t max_bytes, unsigned int ttl_sec, size_t shards)
+    : max_bytes_(max_bytes), ttl_sec_(ttl_sec), min_ttl_(0),
+      max_ttl_(ttl_sec), max_negative_ttl_(ttl_sec), prefetch_percent_(0),
+      prefetch_min_hits_(0), stale_sec_(0) {
+    Init(shards);
+}
+
+DnsCache::~DnsCache() {
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        delete shards_[i];
+    }
+}
+
+void DnsCache::Init(size_t shards) {
+    size_t most = max_bytes_ / (kMinSlabsPerShard * kSlabBytes);
+    if (shards > most) {
+        shards = most;
+    }
+    if (shards == 0) {
+        shards = 1;
+    }
+    for (size_t i = 0; i < shards; ++i) {
+        shards_.push_back(new Shard());
+    }
+    SetLimits(max_bytes_, ttl_sec_);
+}
+
+// The table uses the low bits of the hash, so the shard is picked from the
+// high ones.
+DnsCache::Shard &DnsCache::ShardFor(uint32_t hash) {
+    return *shards_[(hash >> 16) % shards_.size()];
+}
 
 void DnsCache::SetLimits(size_t max_bytes, unsigned int ttl_sec) {
     max_bytes_ = max_bytes;
     ttl_sec_ = ttl_sec;
-    EvictIfNeeded();
+    size_t per_shard = max_bytes / shards_.size();
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        Shard &shard = *shards_[i];
+        pthread_rwlock_wrlock(&shard.lock);
+        shard.SetMaxBytes(per_shard +
+                          (i < max_bytes % shards_.size() ? 1 : 0));
+        pthread_rwlock_unlock(&shard.lock);
+    }
+}
+
+void DnsCache::SetTtlClamp(unsigned int min_ttl, unsigned int max_ttl) {
+    min_ttl_ = min_ttl;
+    max_ttl_ = max_ttl;
+}
+
+void DnsCache::SetNegativeTtlCap(unsigned int max_ttl) {
+    max_negative_ttl_ = max_ttl;
+}
+
+void DnsCache::SetPrefetch(unsigned int percent, unsigned int min_hits) {
+    prefetch_percent_ = percent;
+    prefetch_min_hits_ = min_hits;
+}
+
+void DnsCache::SetStaleWindow(unsigned int window_sec) {
+    stale_sec_ = window_sec;
 }
 
-bool DnsCache::Get(const std::string &key, std::vector<unsigned char> *out) {
-    EvictExpired();
-    std::map<std::string, Entry>::iterator it = entries_.find(key);
-    if (it == entries_.end()) {
+void DnsCache::SetPolicy(CachePolicy policy) {
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        pthread_rwlock_wrlock(&shards_[i]->lock);
+        shards_[i]->SetPolicy(policy);
+        pthread_rwlock_unlock(&shards_[i]->lock);
+    }
+}
+
+bool DnsCache::ParsePolicy(const std::string &name, CachePolicy *out) {
+    CachePolicy policy;
+    if (name == "clock") {
+        policy = CACHE_POLICY_CLOCK;
+    } else if (name == "s3fifo") {
+        policy = CACHE_POLICY_S3FIFO;
+    } else if (name == "tinylfu") {
+        policy = CACHE_POLICY_TINYLFU;
+    } else {
         return false;
     }
-    lru_.erase(it->second.lru_it);
-    lru_.push_back(key);
-    it->second.lru_it = --lru_.end();
     if (out) {
-        *out = it->second.response;
+        *out = policy;
     }
     return true;
 }
 
-void DnsCache::Put(const std::string &key, const std::vector<unsigned char> &response) {
-    EvictExpired();
-    std::map<std::string, Entry>::iterator it = entries_.find(key);
-    if (it != entries_.end()) {
-        current_bytes_ -= it->second.size;
-        lru_.erase(it->second.lru_it);
-        entries_.erase(it);
-    }
-    Entry entry;
-    entry.response = response;
-    entry.size = response.size();
-    entry.expiry = std::time(NULL) + ttl_sec_;
-    lru_.push_back(key);
-    entry.lru_it = --lru_.end();
-    entries_[key] = entry;
-    current_bytes_ += entry.size;
-    EvictIfNeeded();
+bool DnsCache::Get(const WireKey &key, std::vector<unsigned char> *out) {
+    return Get(key, out, NULL);
 }
 
-void DnsCache::EvictExpired() {
+bool DnsCache::Get(const WireKey &key, std::vector<unsigned char> *out,
+                   bool *prefetch) {
     time_t now = std::time(NULL);
-    std::list<std::string>::iterator it = lru_.begin();
-    while (it != lru_.end()) {
-        std::map<std::string, Entry>::iterator entry_it = entries_.find(*it);
-        if (entry_it == entries_.end()) {
-            it = lru_.erase(it);
-            continue;
+    Shard &shard = ShardFor(key.hash);
+    pthread_rwlock_rdlock(&shard.lock);
+    uint32_t index = shard.Lookup(key.bytes, key.hash);
+    if (index == kNil || shard.At(index).expiry <= now) {
+        pthread_rwlock_unlock(&shard.lock);
+        return false;
+    }
+    Shard::Entry &entry = shard.At(index);
+    unsigned char freq = AtomicLoadRelaxed(&entry.freq);
+    if (freq < kMaxFreq) {
+        AtomicStoreRelaxed(&entry.freq, static_cast<unsigned char>(freq + 1));
+    }
+    shard.RecordAccess(key.hash);
+    unsigned int hits = AtomicLoadRelaxed(&entry.hits);
+    if (hits < prefetch_min_hits_) {
+        hits = AtomicFetchAddRelaxed(&entry.hits, 1u) + 1;
+    }
+    if (prefetch) {
+        *prefetch = prefetch_percent_ > 0 && hits >= prefetch_min_hits_ &&
+                    (entry.expiry - now) * 100 <=
+                        (entry.expiry - entry.stored) *
+                            static_cast<time_t>(prefetch_percent_);
+    }
+    if (out) {
+        entry.CopyOut(static_cast<uint32_t>(entry.expiry - now), out);
+    }
+    pthread_rwlock_unlock(&shard.lock);
+    return true;
+}
+
+bool DnsCache::GetStale(const WireKey &key, unsigned int ttl,
+                        std::vector<unsigned char> *out) {
+    time_t now = std::time(NULL);
+    Shard &shard = ShardFor(key.hash);
+    pthread_rwlock_rdlock(&shard.lock);
+    uint32_t index = shard.Lookup(key.bytes, key.hash);
+    // Reads never advance the wheel, so an entry may outlive its window
+    // until the next Put() into this shard.
+    if (index == kNil || shard.At(index).drop <= now) {
+        pthread_rwlock_unlock(&shard.lock);
+        return false;
+    }
+    Shard::Entry &entry = shard.At(index);
+    unsigned char freq = AtomicLoadRelaxed(&entry.freq);
+    if (freq < kMaxFreq) {
+        AtomicStoreRelaxed(&entry.freq, static_cast<unsigned char>(freq + 1));
+    }
+    if (out) {
+        entry.CopyOut(ttl, out);
+    }
+    pthread_rwlock_unlock(&shard.lock);
+    return true;
+}
+
+void DnsCache::Put(const WireKey &key, const std::vector<unsigned char> &response) {
+    // TTL offsets are kept in 16 bits; no DNS message is longer anyway.
+    if (response.size() > 0xffff) {
+        return;
+    }
+    // Responses without records to take a TTL from live ttl_sec_.
+    std::vector<size_t> ttl_offsets;
+    uint32_t ttl = ttl_sec_;
+    uint32_t negative_ttl = 0;
+    if (!FindResponseTtls(response, &ttl_offsets, &ttl)) {
+        ttl_offsets.clear();
+    } else if (FindNegativeTtl(response, &negative_ttl)) {
+        ttl = negative_ttl < max_negative_ttl_ ? negative_ttl
+                                                : max_negative_ttl_;
+    } else {
+        if (ttl < min_ttl_) {
+            ttl = min_ttl_;
         }
-        if (entry_it->second.expiry <= now) {
-            current_bytes_ -= entry_it->second.size;
-            entries_.erase(entry_it);
-            it = lru_.erase(it);
-        } else {
-            ++it;
+        if (ttl > max_ttl_) {
+            ttl = max_ttl_;
         }
     }
+    time_t now = std::time(NULL);
+    time_t expiry = now + static_cast<time_t>(ttl);
+    time_t drop = expiry + static_cast<time_t>(stale_sec_);
+
+    Shard &shard = ShardFor(key.hash);
+    pthread_rwlock_wrlock(&shard.lock);
+    shard.Advance(now);
+    shard.AgeSketch();
+    uint32_t existing = shard.Lookup(key.bytes, key.hash);
+    // A refreshed entry keeps its place in the main queue.
+    bool keep_main = false;
+    if (existing != kNil) {
+        keep_main = shard.At(existing).queue == kMainQueue;
+        shard.Remove(existing);
+    } else {
+        shard.RecordAccess(key.hash);
+    }
+    if (drop > now) {
+        shard.Insert(key.bytes, key.hash, response, ttl_offsets, now, expiry,
+                     drop, keep_main);
+        shard.EvictIfNeeded();
+    }
+    pthread_rwlock_unlock(&shard.lock);
+}
+
+size_t DnsCache::size_bytes() const {
+    size_t total = 0;
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        pthread_rwlock_rdlock(&shards_[i]->lock);
+        total += shards_[i]->charged_bytes();
+        pthread_rwlock_unlock(&shards_[i]->lock);
+    }
+    return total;
 }
 
-void DnsCache::EvictIfNeeded() {
-    while (current_bytes_ > max_bytes_ && !lru_.empty()) {
-        std::string key = lru_.front();
-        std::map<std::string, Entry>::iterator it = entries_.find(key);
-        if (it != entries_.end()) {
-            current_bytes_ -= it->second.size;
-            entries_.erase(it);
+void DnsCache::GetMemoryStats(CacheMemoryStats *stats) const {
+    std::memset(stats, 0, sizeof(*stats));
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        const Shard &shard = *shards_[i];
+        pthread_rwlock_rdlock(&shards_[i]->lock);
+        stats->slab_bytes += shard.slab_bytes;
+        stats->chunk_bytes += shard.chunk_bytes;
+        stats->payload_bytes += shard.payload_bytes;
+        stats->oversize_bytes += shard.oversize_bytes;
+        stats->overhead_bytes += shard.count * Shard::kEntryOverhead;
+        stats->policy_bytes += shard.policy_bytes();
+        pthread_rwlock_unlock(&shards_[i]->lock);
+    }
+}
+
+unsigned long DnsCache::rejected() const {
+    unsigned long total = 0;
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        pthread_rwlock_rdlock(&shards_[i]->lock);
+        total += shards_[i]->rejected;
+        pthread_rwlock_unlock(&shards_[i]->lock);
+    }
+    return total;
+}
+
+bool DnsCache::Save(const std::string &path, uint64_t config_tag,
+                    size_t *saved, std::string *err) const {
+    std::string tmp_path = path + ".tmp";
+    FILE *file = std::fopen(tmp_path.c_str(), "wb");
+    if (!file) {
+        if (err) {
+            *err = "unable to write file: " + tmp_path;
         }
-        lru_.pop_front();
+        return false;
+    }
+    SnapshotHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, kSnapshotMagic, sizeof(header.magic));
+    header.version = kSnapshotVersion;
+    header.byte_order = kSnapshotByteOrder;
+    header.config_tag = config_tag;
+    std::fwrite(&header, sizeof(header), 1, file);
+
+    time_t now = std::time(NULL);
+    size_t written = 0;
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        const Shard &shard = *shards_[i];
+        pthread_rwlock_rdlock(&shards_[i]->lock);
+        // The main queue first, so that on load the small queue's entries
+        // are the newest, as they were here.
+        for (unsigned char queue = kMainQueue; queue <= kSmallQueue; ++queue) {
+            for (uint32_t index = shard.QueueHead(queue); index != kNil;
+                 index = shard.At(index).queue_next) {
+                const Shard::Entry &entry = shard.At(index);
+                if (entry.drop <= now) {
+                    continue;
+                }
+                SnapshotRecord record;
+                std::memset(&record, 0, sizeof(record));
+                record.stored = static_cast<int64_t>(entry.stored);
+                record.expiry = static_cast<int64_t>(entry.expiry);
+                record.hash = entry.hash;
+                record.response_size = entry.response_size;
+                record.key_size = entry.key_size;
+                record.ttl_count = entry.ttl_count;
+                record.queue = queue;
+                std::fwrite(&record, sizeof(record), 1, file);
+                std::fwrite(entry.data, 1, entry.payload(), file);
+                ++written;
+            }
+        }
+        pthread_rwlock_unlock(&shards_[i]->lock);
+    }
+    bool ok = std::fflush(file) == 0 && !std::ferror(file);
+    ok = std::fclose(file) == 0 && ok;
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        if (err) {
+            *err = "unable to write file: " + path;
+        }
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    if (saved) {
+        *saved = written;
+    }
+    return true;
+}
+
+bool DnsCache::Load(const std::string &path, uint64_t config_tag,
+                    size_t *loaded, std::string *err) {
+    if (loaded) {
+        *loaded = 0;
+    }
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (err) {
+            *err = "unable to read file: " + path;
+        }
+        return false;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    // Mapped, the snapshot is copied once, straight into the slabs; a
+    // filesystem that cannot map it is read into memory instead.
+    std::vector<unsigned char> copy;
+    void *mapped = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)
+                            : MAP_FAILED;
+    const unsigned char *data =
+        static_cast<const unsigned char *>(mapped);
+    if (mapped != MAP_FAILED) {
+        posix_madvise(mapped, size, POSIX_MADV_SEQUENTIAL);
+    } else if (size > 0) {
+        copy.resize(size);
+        size_t got = 0;
+        while (got < size) {
+            ssize_t n = read(fd, &copy[got], size - got);
+            if (n <= 0) {
+                break;
+            }
+            got += static_cast<size_t>(n);
+        }
+        copy.resize(got);
+        size = got;
+        data = copy.empty() ? NULL : &copy[0];
+    }
+    close(fd);
+
+    SnapshotHeader header;
+    bool ok = size >= sizeof(header);
+    if (ok) {
+        std::memcpy(&header, data, sizeof(header));
+        ok = std::memcmp(header.magic, kSnapshotMagic,
+                         sizeof(header.magic)) == 0 &&
+             header.version == kSnapshotVersion &&
+             header.byte_order == kSnapshotByteOrder;
+    }
+    if (ok && header.config_tag != config_tag) {
+        if (mapped != MAP_FAILED) {
+            munmap(mapped, size);
+        }
+        if (err) {
+            *err = "cache snapshot was saved under another config: " + path;
+        }
+        return false;
+    }
+    time_t now = std::time(NULL);
+    size_t at = sizeof(header);
+    size_t restored = 0;
+    while (ok && at < size) {
+        SnapshotRecord record;
+        if (size - at < sizeof(record)) {
+            ok = false;
+            break;
+        }
+        std::memcpy(&record, data + at, sizeof(record));
+        at += sizeof(record);
+        size_t bytes = record.ttl_count * sizeof(uint16_t) + record.key_size +
+                       record.response_size;
+        if (record.key_size == 0 || record.response_size > 0xffff ||
+            record.queue > kSmallQueue || size - at < bytes) {
+            ok = false;
+            break;
+        }
+        const unsigned char *payload = data + at;
+        at += bytes;
+        for (size_t i = 0; i < record.ttl_count && ok; ++i) {
+            uint16_t offset;
+            std::memcpy(&offset, payload + i * sizeof(uint16_t),
+                        sizeof(offset));
+            ok = offset + 4u <= record.response_size;
+        }
+        time_t drop = static_cast<time_t>(record.expiry) +
+                      static_cast<time_t>(stale_sec_);
+        if (!ok || drop <= now) {
+            continue;
+        }
+        Shard &shard = ShardFor(record.hash);
+        pthread_rwlock_wrlock(&shard.lock);
+        shard.Advance(now);
+        if (shard.Restore(record, payload, drop)) {
+            shard.EvictIfNeeded();
+            ++restored;
+        }
+        pthread_rwlock_unlock(&shard.lock);
+    }
+    if (mapped != MAP_FAILED) {
+        munmap(mapped, size);
+    }
+    if (loaded) {
+        *loaded = restored;
+    }
+    if (!ok && err) {
+        *err = "damaged cache snapshot: " + path;
+    }
+    return ok;
+}
+
+size_t DnsCache::entries() const {
+    size_t total = 0;
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        pthread_rwlock_rdlock(&shards_[i]->lock);
+        total += shards_[i]->count;
+        pthread_rwlock_unlock(&shards_[i]->lock);
     }
+    return total;
 }
 
 } // namespace gravastar
@@ -2,40 +2,136 @@
 #define GRAVASTAR_CACHE_H
 
 #include <ctime>
-#include <list>
-#include <map>
+#include <stdint.h>
 #include <string>
 #include <vector>
 
+#include "dns_packet.h"
+
 namespace gravastar {
 
+enum CachePolicy {
+    // Second-chance FIFO.
+    CACHE_POLICY_CLOCK,
+    // New entries start in a small FIFO and only move to the main one when
+    // hit there, so scans of one-off names cannot flush it.
+    CACHE_POLICY_S3FIFO,
+    // S3-FIFO with a frequency sketch deciding which returning keys may
+    // skip the small FIFO: only those looked up more often than the main
+    // FIFO's next victim.
+    CACHE_POLICY_TINYLFU
+};
+
+// Where a cache's memory goes. Everything but `payload_bytes` is charged
+// against its budget.
+struct CacheMemoryStats {
+    // Slab pages held, and the chunks in them given to entries.
+    size_t slab_bytes;
+    size_t chunk_bytes;
+    // Keys, TTL offsets and responses, wherever they are stored.
+    size_t payload_bytes;
+    // Responses too large for any slab class, allocated one by one.
+    size_t oversize_bytes;
+    // Per-entry bookkeeping: the entry itself and its table slots.
+    size_t overhead_bytes;
+    // The eviction policy's frequency sketch and ghost table.
+    size_t policy_bytes;
+};
+
+// Keys are spread by hash over independently locked shards, and every call
+// is safe from any thread. Each shard keeps its entries in a stable arena
+// found through an open-addressing table (linear probing, backward-shift
+// deletion) and drops them at the end of their stale window with a hashed
+// timing wheel of one-second slots, so every operation costs the same
+// however many entries there are. Eviction follows the CachePolicy; under
+// each of them a hit only bumps a counter on the entry, so lookups share
+// the shard's lock and only Put() takes it exclusively. Responses are
+// stored with their keys in size-class chunks of 16 KiB slabs, and the
+// budget covers the slabs, the unused ends of their chunks and each entry's
+// bookkeeping, not just the response bytes.
 class DnsCache {
 public:
+    // A single shard.
     DnsCache(size_t max_bytes, unsigned int ttl_sec);
+    // `max_bytes` is split evenly over `shards` shards, or fewer when each
+    // would get less than a few slabs.
+    DnsCache(size_t max_bytes, unsigned int ttl_sec, size_t shards);
+    ~DnsCache();
+
+    // `ttl_sec` is the lifetime of responses that carry no records to take
+    // one from.
     void SetLimits(size_t max_bytes, unsigned int ttl_sec);
+    // Record TTLs are raised to `min_ttl` and capped at `max_ttl` before they
+    // set an entry's lifetime.
+    void SetTtlClamp(unsigned int min_ttl, unsigned int max_ttl);
+    // NXDOMAIN and NODATA answers with an SOA live for the SOA's negative
+    // TTL (RFC 2308), capped at `max_ttl`.
+    void SetNegativeTtlCap(unsigned int max_ttl);
+    // Entries hit at least `min_hits` times flag themselves for refresh once
+    // they are within the last `percent` of their TTL. 0 turns it off.
+    void SetPrefetch(unsigned int percent, unsigned int min_hits);
+    // Keeps expired entries for `window_sec` more seconds, readable only
+    // through GetStale() (RFC 8767). 0 drops them at expiry.
+    void SetStaleWindow(unsigned int window_sec);
+    // CACHE_POLICY_CLOCK unless set.
+    void SetPolicy(CachePolicy policy);
 
-    bool Get(const std::string &key, std::vector<unsigned char> *out);
-    void Put(const std::string &key, const std::vector<unsigned char> &response);
+    // Copies out the entry with its TTLs counted down to the seconds it has
+    // left.
+    bool Get(const WireKey &key, std::vector<unsigned char> *out);
+    // Same as Get(); `*prefetch` says whether the caller should refresh the
+    // entry ahead of its expiry.
+    bool Get(const WireKey &key, std::vector<unsigned char> *out,
+             bool *prefetch);
+    // Returns the entry for `key` even if it has expired, as long as it is
+    // still within the stale window, with its TTLs set to `ttl`.
+    bool GetStale(const WireKey &key, unsigned int ttl,
+                  std::vector<unsigned char> *out);
+    void Put(const WireKey &key, const std::vector<unsigned char> &response);
 
-    size_t size_bytes() const { return current_bytes_; }
+    // Memory charged against max_bytes().
+    size_t size_bytes() const;
     size_t max_bytes() const { return max_bytes_; }
+    size_t entries() const;
+    size_t shards() const { return shards_.size(); }
+    void GetMemoryStats(CacheMemoryStats *stats) const;
+    // Returning keys the TinyLFU filter kept out of the main queue.
+    unsigned long rejected() const;
+
+    // Writes every entry still within its stale window to `path`, each
+    // shard's queues oldest first, with absolute expiry times. The file is
+    // written beside `path` and renamed over it, tagged with `config_tag`.
+    bool Save(const std::string &path, uint64_t config_tag, size_t *saved,
+              std::string *err) const;
+    // Adds the entries of a snapshot written by Save() in their saved
+    // order, skipping those whose stale window has closed and any key
+    // already cached. A damaged snapshot keeps what was read before the
+    // damage and returns false. A snapshot saved with another `config_tag`
+    // loads nothing and returns false.
+    bool Load(const std::string &path, uint64_t config_tag, size_t *loaded,
+              std::string *err);
+
+    // Accepts "clock", "s3fifo" and "tinylfu"; `out` may be NULL.
+    static bool ParsePolicy(const std::string &name, CachePolicy *out);
 
 private:
-    struct Entry {
-        std::vector<unsigned char> response;
-        time_t expiry;
-        size_t size;
-        std::list<std::string>::iterator lru_it;
-    };
+    DnsCache(const DnsCache &);
+    DnsCache &operator=(const DnsCache &);
+
+    class Shard;
 
-    void EvictExpired();
-    void EvictIfNeeded();
+    void Init(size_t shards);
+    Shard &ShardFor(uint32_t hash);
 
     size_t max_bytes_;
     unsigned int ttl_sec_;
-    size_t current_bytes_;
-    std::list<std::string> lru_;
-    std::map<std::string, Entry> entries_;
+    unsigned int min_ttl_;
+    unsigned int max_ttl_;
+    unsigned int max_negative_ttl_;
+    unsigned int prefetch_percent_;
+    unsigned int prefetch_min_hits_;
+    unsigned int stale_sec_;
+    std::vector<Shard *> shards_;
 };
 
 } // namespace gravastar
@@ -1,7 +1,10 @@
 #include "config.h"
 
+#include "cache.h"
+#include "event_loop.h"
 #include "util.h"
 
+#include <arpa/inet.h>
 #include <cstdlib>
 #include <fstream>
 #include <sstream>
@@ -141,9 +144,52 @@ bool ConfigLoader::LoadMainConfig(const std::string &path, ServerConfig *out, st
     out->listen_addr = "0.0.0.0";
     out->listen_port = 53;
     out->cache_size_bytes = 100 * 1024 * 1024;
+    out->cache_shards = 16;
+    out->cache_policy = "s3fifo";
+    out->cache_snapshot_file = "";
+    out->decision_cache_size = 16384;
     out->cache_ttl_sec = 120;
+    out->cache_min_ttl = 0;
+    out->cache_max_ttl = 86400;
+    out->cache_max_negative_ttl = 3600;
+    out->prefetch_percent = 10;
+    out->prefetch_min_hits = 3;
+    out->prefetch_max_inflight = 16;
+    out->serve_stale_sec = 86400;
+    out->stale_answer_ttl = 30;
+    out->stale_answer_timeout_ms = 1800;
     out->dot_verify = true;
     out->rebind_protection = true;
+    out->block_mode = "null";
+    out->block_ttl = 60;
+    out->block_ipv4 = "0.0.0.0";
+    out->block_ipv6 = "::";
+    out->udp_batch_size = 32;
+    out->listen_shards = 0;
+    out->event_backend = "auto";
+    out->stats_interval_sec = 0;
+    out->packet_pool_buffers = 1024;
+    out->packet_buffer_size = 4096;
+    out->inline_answers = true;
+    out->queue_capacity = 4096;
+    out->queue_full_policy = "servfail";
+    out->queue_target_ms = 1000;
+    out->worker_threads = 0;
+    out->worker_autoscale = true;
+    out->worker_cpu_affinity = false;
+    out->upstream_async = true;
+    out->upstream_sockets = 4;
+    out->upstream_timeout_ms = 2000;
+    out->upstream_max_inflight = 4096;
+    out->ratelimit_qps = 0;
+    out->ratelimit_burst = 0;
+    out->ratelimit_table_size = 65536;
+    out->rrl_responses_per_sec = 0;
+    out->rrl_slip = 2;
+    out->tcp_listen = true;
+    out->tcp_max_connections = 128;
+    out->tcp_idle_timeout_sec = 10;
+    out->tcp_pipeline_depth = 32;
     out->log_level = "debug";
     out->blocklist_file = "blocklist.toml";
     out->local_records_file = "local_records.toml";
@@ -186,6 +232,39 @@ bool ConfigLoader::LoadMainConfig(const std::string &path, ServerConfig *out, st
                 return false;
             }
             out->cache_size_bytes = static_cast<size_t>(v) * 1024 * 1024;
+        } else if (key == "cache_shards") {
+            unsigned long v = 0;
+            if (!ParseInteger(value, &v) || v == 0 || v > 256) {
+                if (err) *err = "invalid cache_shards";
+                return false;
+            }
+            out->cache_shards = static_cast<size_t>(v);
+        } else if (key == "cache_policy") {
+            std::string v;
+            if (!ParseQuotedString(value, &v)) {
+                if (err) *err = "invalid cache_policy";
+                return false;
+            }
+            v = ToLower(v);
+            if (!DnsCache::ParsePolicy(v, NULL)) {
+                if (err) *err = "unsupported cache_policy: " + v;
+                return false;
+            }
+            out->cache_policy = v;
+        } else if (key == "cache_snapshot_file") {
+            std::string v;
+            if (!ParseQuotedString(value, &v)) {
+                if (err) *err = "invalid cache_snapshot_file";
+                return false;
+            }
+            out->cache_snapshot_file = v;
+        } else if (key == "decision_cache_size") {
+            unsigned long v = 0;
+            if (!ParseInteger(value, &v) || v > 16777216) {
+                if (err) *err = "invalid decision_cache_size";
+                return false;
+            }
+            out->decision_cache_size = static_cast<size_t>(v);
         } else if (key == "cache_ttl_sec") {
             unsigned long v = 0;
             if (!ParseInteger(value, &v)) {
@@ -193,6 +272,69 @@ bool ConfigLoader::LoadMainConfig(const std::string &path, ServerConfig *out, st
                 return false;
             }
             out->cache_ttl_sec = static_cast<unsigned int>(v);
+        } else if (key == "cache_min_ttl") {
+            unsigned long v = 0;
+            if (!ParseInteger(value, &v) || v > 604800) {
+                if (err) *err = "invalid cache_min_ttl";
+                return false;
+            }
+            out->cache_min_ttl = static_cast<unsigned int>(v);
+        } else if (key == "cache_max_ttl") {
+            unsigned long v = 0;
+            if (!ParseInteger(value, &v) || v > 604800) {
+                if (err) *err = "invalid cache_max_ttl";
+                return false;
+            }
+            out->cache_max_ttl = static_cast<unsigned int>(v);
+        } else if (key == "cache_max_negative_ttl") {
+            unsigned long v = 0;
+            if (!ParseInteger(value, &v) || v > 604800) {
+                if (err) *err = "invalid cache_max_negative_ttl";
+                return false;
+            }
+            out->cache_max_negative_ttl = static_cast<unsigned int>(v);
+        } else if (key == "prefetch_percent") {
+            unsigned long v = 0;
+            if (!ParseInteger(value, &v) || v > 50) {
+                if (err) *err = "invalid prefetch_percent";
+                return false;
+            }
+            out->prefetch_percent = static_cast<unsigned int>(v);
+        } else if (key == "prefetch_min_hits") {
+            unsigned long v = 0;
+            if (!ParseInteger(value, &v) || v == 0 || v > 1000000) {
+                if (err) *err = "invalid prefetch_min_hits";
+                return false;
+            }
+            out->prefetch_min_hits = static_cast<unsigned int>(v);
+        } else if (key == "prefetch_max_inflight") {
+            unsigned long v = 0;
+            if (!ParseInteger(value, &v) || v == 0 || v > 1024) {
+                if (err) *err = "invalid prefetch_max_inflight";
+                return false;
+            }
+            out->prefetch_max_inflight = static_cast<size_t>(v);
+        } else if (key == "serve_stale_sec") {
+            unsigned long v = 0;
+            if (!ParseInteger(value, &v) || v > 604800) {
+                if (err) *err = "invalid serve_stale_sec";
+                return false;
+            }
+            out->serve_stale_sec = static_cast<unsigned int>(v);
+        } else if (key == "stale_answer_ttl") {
+            unsigned long v = 0;
+            if (!ParseInteger(value, &v) || v == 0 || v > 3600) {
+                if (err) *err = "invalid stale_answer_ttl";
+                return false;
+            }
+            out->stale_answer_ttl = static_cast<unsigned int>(v);
+        } else if (key == "stale_answer_timeout_ms") {
+            unsigned long v = 0;
+            if (!ParseInteger(value, &v) || v > 30000) {
+                if (err) *err = "invalid stale_answer_timeout_ms";
+                return false;
+            }
+            out->stale_answer_timeout_ms = static_cast<unsigned int>(v);
         } else if (key == "dot_verify") {
             bool v = true;
             if (!ParseBool(value, &v)) {
@@ -207,6 +349,239 @@ bool ConfigLoader::LoadMainConfig(const std::string &path, ServerConfig *out, st
                 return false;
             }
             out->rebind_protection = v;
+        } else if (key == "block_mode") {
+            std::string v;
+            if (!ParseQuotedString(value, &v)) {
+                if (err) *err = "invalid block_mode";
+                return false;
+            }
+            v = ToLower(v);
+            if (v != "null" && v != "nxdomain" && v != "nodata" && v != "ip") {
+                if (err) *err = "unsupported block_mode: " + v;
+                return false;
+            }
+            out->block_mode = v;
+        } else if (key == "block_ttl") {
+            unsigned long v = 0;
+            if (!ParseInteger(value, &v) || v > 604800) {
+                if (err) *err = "invalid block_ttl";
+                return false;
+            }
+            out->block_ttl = static_cast<unsigned int>(v);
+        } else if (key == "block_ipv4") {
+            std::string v;
+            unsigned char addr[4];
+            if (!ParseQuotedString(value, &v) ||
+                inet_pton(AF_INET, v.c_str(), addr) != 1) {
+                if (err) *err = "invalid block_ipv4";
+                return false;
+            }
+            out->block_ipv4 = v;
+        } else if (key == "block_ipv6") {
+            std::string v;
+            unsigned char addr[16];
+            if (!ParseQuotedString(value, &v) ||
+                inet_pton(AF_INET6, v.c_str(), addr) != 1) {
+                if (err) *err = "invalid block_ipv6";
+                return false;
+            }
+            out->block_ipv6 = v;
+        } else if (key == "udp_batch_size") {
+            unsigned long v = 0;
+            if (!ParseInteger(value, &v) || v == 0 || v > 1024) {
+                if (err) *err = "invalid udp_batch_size";
+                return false;
+            }
+            out->udp_batch_size = static_cast<size_t>(v);
+        } else if (key == "listen_shards") {
+            unsigned long v = 0;
+            if (!ParseInteger(value, &v) || v > 256) {
+                if (err) *err = "invalid listen_shards";
+                return false;
+            }
+            out->listen_shards = static_cast<size_t>(v);
+        } else if (key == "event_backend") {
+            std::string v;
+            if (!ParseQuotedString(value, &v)) {
+                if (err) *err = "invalid event_backend";
+                return false;
+            }
+            v = ToLower(v);
+            if (!EventLoop::ParseBackend(v, NULL)) {
+                if (err) *err = "unsupported event_backend: " + v;
+                return false;
+            }
+            out->event_backend = v;
+        } else if (key == "stats_interval_sec") {
+            unsigned long v = 0;
+            if (!ParseInteger(value, &v)) {
+                if (err) *err = "invalid stats_interval_sec";
+                return false;
+            }
+            out->stats_interval_sec = static_cast<unsigned int>(v);
+        } else if (key == "packet_pool_buffers") {
+            unsigned long v = 0;
+            if (!ParseInteger(value, &v) || v < 16 || v > 1048576) {
+                if (err) *err = "invalid packet_pool_buffers";
+                return false;
+            }
+            out->packet_pool_buffers = static_cast<size_t>(v);
+        } else if (key == "packet_buffer_size") {
+            unsigned long v = 0;
+            if (!ParseInteger(value, &v) || v < 512 || v > 65535) {
+                if (err) *err = "invalid packet_buffer_size";
+                return false;
+            }
+            out->packet_buffer_size = static_cast<size_t>(v);
+        } else if (key == "inline_answers") {
+            bool v = true;
+            if (!ParseBool(value, &v)) {
+                if (err) *err = "invalid inline_answers";
+                return false;
+            }
+            out->inline_answers = v;
+        } else if (key == "queue_capacity") {
+            unsigned long v = 0;
+            if (!ParseInteger(value, &v) || v < 16 || v > 1048576) {
+                if (err) *err = "invalid queue_capacity";
+                return false;
+            }
+            out->queue_capacity = static_cast<size_t>(v);
+        } else if (key == "queue_full_policy") {
+            std::string v;
+            if (!ParseQuotedString(value, &v)) {
+                if (err) *err = "invalid queue_full_policy";
+                return false;
+            }
+            v = ToLower(v);
+            if (v != "drop" && v != "servfail" && v != "refused") {
+                if (err) *err = "unsupported queue_full_policy: " + v;
+                return false;
+            }
+            out->queue_full_policy = v;
+        } else if (key == "queue_target_ms") {
+            unsigned long v = 0;
+            if (!ParseInteger(value, &v) || v > 60000) {
+                if (err) *err = "invalid queue_target_ms";
+                return false;
+            }
+            out->queue_target_ms = static_cast<unsigned int>(v);
+        } else if (key == "worker_threads") {
+            std::string mode;
+            unsigned long v = 0;
+            if (ParseQuotedString(value, &mode) && ToLower(mode) == "auto") {
+                out->worker_threads = 0;
+            } else if (ParseInteger(value, &v) && v >= 1 && v <= 256) {
+                out->worker_threads = static_cast<size_t>(v);
+            } else {
+                if (err) *err = "invalid worker_threads";
+                return false;
+            }
+        } else if (key == "worker_autoscale") {
+            bool v = false;
+            if (!ParseBool(value, &v)) {
+                if (err) *err = "invalid worker_autoscale";
+                return false;
+            }
+            out->worker_autoscale = v;
+        } else if (key == "worker_cpu_affinity") {
+            bool v = false;
+            if (!ParseBool(value, &v)) {
+                if (err) *err = "invalid worker_cpu_affinity";
+                return false;
+            }
+            out->worker_cpu_affinity = v;
+        } else if (key == "upstream_async") {
+            bool v = false;
+            if (!ParseBool(value, &v)) {
+                if (err) *err = "invalid upstream_async";
+                return false;
+            }
+            out->upstream_async = v;
+        } else if (key == "upstream_sockets") {
+            unsigned long v = 0;
+            if (!ParseInteger(value, &v) || v == 0 || v > 64) {
+                if (err) *err = "invalid upstream_sockets";
+                return false;
+            }
+            out->upstream_sockets = static_cast<size_t>(v);
+        } else if (key == "upstream_timeout_ms") {
+            unsigned long v = 0;
+            if (!ParseInteger(value, &v) || v < 100 || v > 30000) {
+                if (err) *err = "invalid upstream_timeout_ms";
+                return false;
+            }
+            out->upstream_timeout_ms = static_cast<unsigned int>(v);
+        } else if (key == "upstream_max_inflight") {
+            unsigned long v = 0;
+            if (!ParseInteger(value, &v) || v < 16 || v > 60000) {
+                if (err) *err = "invalid upstream_max_inflight";
+                return false;
+            }
+            out->upstream_max_inflight = static_cast<size_t>(v);
+        } else if (key == "ratelimit_qps") {
+            unsigned long v = 0;
+            if (!ParseInteger(value, &v) || v > 1000000) {
+                if (err) *err = "invalid ratelimit_qps";
+                return false;
+            }
+            out->ratelimit_qps = static_cast<unsigned int>(v);
+        } else if (key == "ratelimit_burst") {
+            unsigned long v = 0;
+            if (!ParseInteger(value, &v) || v > 1000000) {
+                if (err) *err = "invalid ratelimit_burst";
+                return false;
+            }
+            out->ratelimit_burst = static_cast<unsigned int>(v);
+        } else if (key == "ratelimit_table_size") {
+            unsigned long v = 0;
+            if (!ParseInteger(value, &v) || v < 64 || v > 16777216) {
+                if (err) *err = "invalid ratelimit_table_size";
+                return false;
+            }
+            out->ratelimit_table_size = static_cast<size_t>(v);
+        } else if (key == "rrl_responses_per_sec") {
+            unsigned long v = 0;
+            if (!ParseInteger(value, &v) || v > 1000000) {
+                if (err) *err = "invalid rrl_responses_per_sec";
+                return false;
+            }
+            out->rrl_responses_per_sec = static_cast<unsigned int>(v);
+        } else if (key == "rrl_slip") {
+            unsigned long v = 0;
+            if (!ParseInteger(value, &v) || v > 10) {
+                if (err) *err = "invalid rrl_slip";
+                return false;
+            }
+            out->rrl_slip = static_cast<unsigned int>(v);
+        } else if (key == "tcp_listen") {
+            bool v = true;
+            if (!ParseBool(value, &v)) {
+                if (err) *err = "invalid tcp_listen";
+                return false;
+            }
+            out->tcp_listen = v;
+        } else if (key == "tcp_max_connections") {
+            unsigned long v = 0;
+            if (!ParseInteger(value, &v) || v == 0 || v > 65535) {
+                if (err) *err = "invalid tcp_max_connections";
+                return false;
+            }
+            out->tcp_max_connections = static_cast<size_t>(v);
+        } else if (key == "tcp_idle_timeout_sec") {
+            unsigned long v = 0;
+            if (!ParseInteger(value, &v) || v == 0 || v > 3600) {
+                if (err) *err = "invalid tcp_idle_timeout_sec";
+                return false;
+            }
+            out->tcp_idle_timeout_sec = static_cast<unsigned int>(v);
+        } else if (key == "tcp_pipeline_depth") {
+            unsigned long v = 0;
+            if (!ParseInteger(value, &v) || v == 0 || v > 1024) {
+                if (err) *err = "invalid tcp_pipeline_depth";
+                return false;
+            }
+            out->tcp_pipeline_depth = static_cast<size_t>(v);
         } else if (key == "log_level") {
             std::string v;
             if (!ParseQuotedString(value, &v)) {
@@ -242,6 +617,10 @@ bool ConfigLoader::LoadMainConfig(const std::string &path, ServerConfig *out, st
             out->upstreams_file = v;
         }
     }
+    if (out->cache_min_ttl > out->cache_max_ttl) {
+        if (err) *err = "invalid cache_min_ttl";
+        return false;
+    }
     return true;
 }
 
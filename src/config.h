@@ -11,9 +11,52 @@ struct ServerConfig {
     std::string listen_addr;
     unsigned short listen_port;
     size_t cache_size_bytes;
+    size_t cache_shards;
+    std::string cache_policy;
+    std::string cache_snapshot_file;
+    size_t decision_cache_size;
     unsigned int cache_ttl_sec;
+    unsigned int cache_min_ttl;
+    unsigned int cache_max_ttl;
+    unsigned int cache_max_negative_ttl;
+    unsigned int prefetch_percent;
+    unsigned int prefetch_min_hits;
+    size_t prefetch_max_inflight;
+    unsigned int serve_stale_sec;
+    unsigned int stale_answer_ttl;
+    unsigned int stale_answer_timeout_ms;
     bool dot_verify;
     bool rebind_protection;
+    std::string block_mode;
+    unsigned int block_ttl;
+    std::string block_ipv4;
+    std::string block_ipv6;
+    size_t udp_batch_size;
+    size_t listen_shards;
+    std::string event_backend;
+    unsigned int stats_interval_sec;
+    size_t packet_pool_buffers;
+    size_t packet_buffer_size;
+    bool inline_answers;
+    size_t queue_capacity;
+    std::string queue_full_policy;
+    unsigned int queue_target_ms;
+    size_t worker_threads;  // 0 = one per usable CPU
+    bool worker_autoscale;
+    bool worker_cpu_affinity;
+    bool upstream_async;
+    size_t upstream_sockets;
+    unsigned int upstream_timeout_ms;
+    size_t upstream_max_inflight;
+    unsigned int ratelimit_qps;
+    unsigned int ratelimit_burst;
+    size_t ratelimit_table_size;
+    unsigned int rrl_responses_per_sec;
+    unsigned int rrl_slip;
+    bool tcp_listen;
+    size_t tcp_max_connections;
+    unsigned int tcp_idle_timeout_sec;
+    size_t tcp_pipeline_depth;
     std::string log_level;
     std::string blocklist_file;
     std::string local_records_file;
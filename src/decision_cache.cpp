@@ -0,0 +1,91 @@
+#include "decision_cache.h"
+
+#include <cstring>
+
+#include "atomic_ops.h"
+
+namespace gravastar {
+
+namespace {
+
+// Zero-padded to whole words, so keys compare a word at a time.
+void PackKey(const WireKey &key, uint64_t *words, size_t count) {
+    std::memset(words, 0, count * sizeof(uint64_t));
+    std::memcpy(words, key.bytes.data(), key.bytes.size());
+}
+
+size_t WordsFor(size_t bytes) {
+    return (bytes + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+}
+
+} // namespace
+
+DecisionCache::DecisionCache(size_t entries) : mask_(0) {
+    size_t size = 1;
+    while (size < entries) {
+        size <<= 1;
+    }
+    Slot empty;
+    std::memset(&empty, 0, sizeof(empty));
+    slots_.assign(size, empty);
+    mask_ = size - 1;
+}
+
+Decision DecisionCache::Lookup(const WireKey &key, uint32_t generation,
+                               const ResponseTemplate **answer) const {
+    if (key.bytes.size() > kMaxKeyBytes) {
+        return DECISION_NONE;
+    }
+    uint64_t words[kKeyWords];
+    PackKey(key, words, kKeyWords);
+    const Slot &slot = slots_[key.hash & mask_];
+    uint32_t seq = AtomicLoad(&slot.seq);
+    if (seq & 1) {
+        return DECISION_NONE;
+    }
+    uint32_t shape = AtomicLoadRelaxed(&slot.shape);
+    bool match = AtomicLoadRelaxed(&slot.hash) == key.hash &&
+                 AtomicLoadRelaxed(&slot.generation) == generation &&
+                 (shape >> 8) == key.bytes.size();
+    for (size_t i = 0; match && i < WordsFor(key.bytes.size()); ++i) {
+        match = AtomicLoadRelaxed(&slot.key[i]) == words[i];
+    }
+    const ResponseTemplate *stored = AtomicLoadRelaxed(&slot.answer);
+    // Everything above was read from one Store() only if `seq` has not
+    // moved meanwhile.
+    AtomicFence();
+    if (!match || AtomicLoadRelaxed(&slot.seq) != seq) {
+        return DECISION_NONE;
+    }
+    if (answer) {
+        *answer = stored;
+    }
+    return static_cast<Decision>(shape & 0xff);
+}
+
+void DecisionCache::Store(const WireKey &key, uint32_t generation,
+                          Decision decision, const ResponseTemplate *answer) {
+    if (key.bytes.size() > kMaxKeyBytes || decision == DECISION_NONE) {
+        return;
+    }
+    uint64_t words[kKeyWords];
+    PackKey(key, words, kKeyWords);
+    Slot &slot = slots_[key.hash & mask_];
+    uint32_t seq = AtomicLoadRelaxed(&slot.seq);
+    if ((seq & 1) || !AtomicCompareExchange(&slot.seq, &seq, seq + 1)) {
+        return;
+    }
+    // Readers must see `seq` odd before any field changes under them.
+    AtomicFence();
+    AtomicStoreRelaxed(&slot.hash, key.hash);
+    AtomicStoreRelaxed(&slot.generation, generation);
+    AtomicStoreRelaxed(&slot.shape,
+                       static_cast<uint32_t>(key.bytes.size() << 8 | decision));
+    AtomicStoreRelaxed(&slot.answer, answer);
+    for (size_t i = 0; i < kKeyWords; ++i) {
+        AtomicStoreRelaxed(&slot.key[i], words[i]);
+    }
+    AtomicStore(&slot.seq, seq + 2);
+}
+
+} // namespace gravastar
@@ -0,0 +1,69 @@
+#ifndef GRAVASTAR_DECISION_CACHE_H
+#define GRAVASTAR_DECISION_CACHE_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "dns_packet.h"
+
+namespace gravastar {
+
+enum Decision {
+    DECISION_NONE,
+    // Neither blocked nor local: on to the response cache and upstream.
+    DECISION_PASS,
+    DECISION_BLOCKED,
+    DECISION_LOCAL
+};
+
+// What the blocklist and local records made of recently seen questions, so
+// that a repeat query skips both. A fixed, direct-mapped table sized at
+// startup: each slot holds one wire key, the generation it was decided
+// under and the outcome, with the answer to send for blocked and local
+// names. Keys longer than kMaxKeyBytes are never kept.
+//
+// Slots are guarded by sequence counters instead of locks: Lookup() never
+// waits, and a Store() that finds its slot being written by another thread
+// is dropped.
+class DecisionCache {
+public:
+    static const size_t kMaxKeyBytes = 64;
+
+    // `entries` is rounded up to a power of two.
+    explicit DecisionCache(size_t entries);
+
+    // Returns the outcome stored for `key` under `generation`, with its
+    // answer in `*answer`, or DECISION_NONE.
+    Decision Lookup(const WireKey &key, uint32_t generation,
+                    const ResponseTemplate **answer) const;
+    // `answer` must stay valid for as long as `generation` is current.
+    void Store(const WireKey &key, uint32_t generation, Decision decision,
+               const ResponseTemplate *answer);
+
+    size_t entries() const { return slots_.size(); }
+
+private:
+    DecisionCache(const DecisionCache &);
+    DecisionCache &operator=(const DecisionCache &);
+
+    static const size_t kKeyWords = kMaxKeyBytes / sizeof(uint64_t);
+
+    // Every field is read and written with relaxed atomics; `seq` is odd
+    // while a Store() is under way.
+    struct Slot {
+        uint32_t seq;
+        uint32_t hash;
+        uint32_t generation;
+        // The key's length in bytes, shifted left by 8, and the Decision.
+        uint32_t shape;
+        const ResponseTemplate *answer;
+        uint64_t key[kKeyWords];
+    };
+
+    std::vector<Slot> slots_;
+    size_t mask_;
+};
+
+} // namespace gravastar
+
+#endif // GRAVASTAR_DECISION_CACHE_H
@@ -12,11 +12,23 @@ uint16_t ReadU16(const std::vector<unsigned char> &buf, size_t offset) {
     return static_cast<uint16_t>(buf[offset] << 8 | buf[offset + 1]);
 }
 
+uint16_t ReadU16(const unsigned char *buf, size_t offset) {
+    return static_cast<uint16_t>(buf[offset] << 8 | buf[offset + 1]);
+}
+
 void WriteU16(std::vector<unsigned char> *buf, uint16_t value) {
     buf->push_back(static_cast<unsigned char>((value >> 8) & 0xff));
     buf->push_back(static_cast<unsigned char>(value & 0xff));
 }
 
+// Fills in the RDLENGTH placeholder at `offset` once the RDATA after it has
+// been appended.
+void PatchRdLength(std::vector<unsigned char> *buf, size_t offset) {
+    size_t rdlength = buf->size() - offset - 2;
+    (*buf)[offset] = static_cast<unsigned char>((rdlength >> 8) & 0xff);
+    (*buf)[offset + 1] = static_cast<unsigned char>(rdlength & 0xff);
+}
+
 void WriteU32(std::vector<unsigned char> *buf, uint32_t value) {
     buf->push_back(static_cast<unsigned char>((value >> 24) & 0xff));
     buf->push_back(static_cast<unsigned char>((value >> 16) & 0xff));
@@ -24,10 +36,13 @@ void WriteU32(std::vector<unsigned char> *buf, uint32_t value) {
     buf->push_back(static_cast<unsigned char>(value & 0xff));
 }
 
-bool ParseQName(const std::vector<unsigned char> &packet, size_t offset, std::string *out, size_t *end_offset) {
-    std::string name;
+bool ParseQName(const unsigned char *packet, size_t size, size_t offset,
+                std::string *out, size_t *end_offset) {
+    if (out) {
+        out->clear();
+    }
     size_t pos = offset;
-    while (pos < packet.size()) {
+    while (pos < size) {
         unsigned char len = packet[pos++];
         if (len == 0) {
             break;
@@ -35,24 +50,23 @@ bool ParseQName(const std::vector<unsigned char> &packet, size_t offset, std::st
         if ((len & 0xC0) != 0) {
             return false;
         }
-        if (pos + len > packet.size()) {
+        if (pos + len > size) {
             return false;
         }
-        if (!name.empty()) {
-            name.append(".");
+        if (out) {
+            if (!out->empty()) {
+                out->append(".");
+            }
+            out->append(reinterpret_cast<const char *>(&packet[pos]), len);
         }
-        name.append(reinterpret_cast<const char *>(&packet[pos]), len);
         pos += len;
     }
-    if (pos > packet.size()) {
+    if (pos > size) {
         return false;
     }
     if (end_offset) {
         *end_offset = pos;
     }
-    if (out) {
-        *out = name;
-    }
     return true;
 }
 
@@ -77,6 +91,63 @@ void WriteQName(std::vector<unsigned char> *buf, const std::string &name) {
     buf->push_back(0);
 }
 
+// FNV-1a.
+uint32_t HashBytes(const std::string &bytes) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < bytes.size(); ++i) {
+        hash ^= static_cast<unsigned char>(bytes[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Lowercases the name part of a key in place. Label lengths are at most 63,
+// below 'A', so they are never touched.
+void LowercaseKeyName(std::string *bytes, size_t name_len) {
+    for (size_t i = 0; i < name_len; ++i) {
+        char c = (*bytes)[i];
+        if (c >= 'A' && c <= 'Z') {
+            (*bytes)[i] = static_cast<char>(c - 'A' + 'a');
+        }
+    }
+}
+
+// The DO bit lives in the OPT record of the additional section, right after
+// the question of a plain query.
+bool QueryHasDo(const unsigned char *packet, size_t size, size_t offset) {
+    if (ReadU16(packet, 4) != 1 || ReadU16(packet, 6) != 0 ||
+        ReadU16(packet, 8) != 0) {
+        return false;
+    }
+    uint16_t arcount = ReadU16(packet, 10);
+    for (uint16_t i = 0; i < arcount; ++i) {
+        size_t end = 0;
+        if (!ParseQName(packet, size, offset, NULL, &end) || end + 10 > size) {
+            return false;
+        }
+        if (ReadU16(packet, end) == DNS_TYPE_OPT) {
+            return (packet[end + 6] & 0x80) != 0;
+        }
+        offset = end + 10 + ReadU16(packet, end + 8);
+    }
+    return false;
+}
+
+// Cuts a single-question message down to its header and question and
+// clears the record counts.
+bool TrimToQuestion(unsigned char *packet, size_t *len) {
+    if (*len < 12 || ReadU16(packet, 4) != 1) {
+        return false;
+    }
+    size_t end = 0;
+    if (!ParseQName(packet, *len, 12, NULL, &end) || end + 4 > *len) {
+        return false;
+    }
+    std::memset(packet + 6, 0, 6);
+    *len = end + 4;
+    return true;
+}
+
 uint16_t ResponseFlags(const DnsHeader &query_header) {
     uint16_t flags = 0x8000; // QR
     flags |= (query_header.flags & 0x0100); // RD
@@ -84,18 +155,17 @@ uint16_t ResponseFlags(const DnsHeader &query_header) {
     return flags;
 }
 
-std::vector<unsigned char> BuildResponseHeader(const DnsHeader &query_header,
-                                               uint16_t qdcount,
-                                               uint16_t ancount) {
-    std::vector<unsigned char> buf;
-    buf.reserve(12);
-    WriteU16(&buf, query_header.id);
-    WriteU16(&buf, ResponseFlags(query_header));
-    WriteU16(&buf, qdcount);
-    WriteU16(&buf, ancount);
-    WriteU16(&buf, 0);
-    WriteU16(&buf, 0);
-    return buf;
+void WriteResponseHeader(std::vector<unsigned char> *buf,
+                         const DnsHeader &query_header,
+                         uint16_t qdcount,
+                         uint16_t ancount) {
+    buf->clear();
+    WriteU16(buf, query_header.id);
+    WriteU16(buf, ResponseFlags(query_header));
+    WriteU16(buf, qdcount);
+    WriteU16(buf, ancount);
+    WriteU16(buf, 0);
+    WriteU16(buf, 0);
 }
 
 void AppendQuestion(std::vector<unsigned char> *buf, const DnsQuestion &question) {
@@ -182,7 +252,15 @@ bool IsPrivateIPv4(const unsigned char *addr) {
 } // namespace
 
 bool ParseDnsQuery(const std::vector<unsigned char> &packet, DnsHeader *header, DnsQuestion *question) {
-    if (packet.size() < 12) {
+    if (packet.empty()) {
+        return false;
+    }
+    return ParseDnsQuery(&packet[0], packet.size(), header, question);
+}
+
+bool ParseDnsQuery(const unsigned char *packet, size_t size,
+                   DnsHeader *header, DnsQuestion *question) {
+    if (size < 12) {
         return false;
     }
     if (header) {
@@ -201,108 +279,311 @@ bool ParseDnsQuery(const std::vector<unsigned char> &packet, DnsHeader *header,
     }
     size_t offset = 12;
     size_t end = 0;
-    std::string qname;
-    if (!ParseQName(packet, offset, &qname, &end)) {
+    if (!ParseQName(packet, size, offset, &question->qname, &end)) {
         return false;
     }
-    if (end + 4 > packet.size()) {
+    if (end + 4 > size) {
         return false;
     }
-    question->qname = qname;
     question->qtype = ReadU16(packet, end);
     question->qclass = ReadU16(packet, end + 2);
     question->raw_offset = offset;
     question->raw_length = (end + 4) - offset;
+
+    unsigned char flags = 0;
+    if (packet[3] & 0x10) {
+        flags |= WIRE_KEY_CD;
+    }
+    if (QueryHasDo(packet, size, end + 4)) {
+        flags |= WIRE_KEY_DO;
+    }
+    WireKey &key = question->key;
+    key.bytes.assign(reinterpret_cast<const char *>(packet + offset),
+                     question->raw_length);
+    LowercaseKeyName(&key.bytes, end - offset);
+    key.bytes.push_back(static_cast<char>(flags));
+    key.hash = HashBytes(key.bytes);
     return true;
 }
 
+void MakeWireKey(const std::string &name, uint16_t qtype, uint16_t qclass,
+                 WireKey *key) {
+    std::vector<unsigned char> wire;
+    if (!name.empty() && name[name.size() - 1] == '.') {
+        WriteQName(&wire, name.substr(0, name.size() - 1));
+    } else {
+        WriteQName(&wire, name);
+    }
+    size_t name_len = wire.size();
+    WriteU16(&wire, qtype);
+    WriteU16(&wire, qclass);
+    wire.push_back(0);
+    key->bytes.assign(wire.begin(), wire.end());
+    LowercaseKeyName(&key->bytes, name_len);
+    key->hash = HashBytes(key->bytes);
+}
+
+void SetWireKeyType(WireKey *key, uint16_t qtype) {
+    size_t at = key->bytes.size() - 5;
+    key->bytes[at] = static_cast<char>((qtype >> 8) & 0xff);
+    key->bytes[at + 1] = static_cast<char>(qtype & 0xff);
+    key->hash = HashBytes(key->bytes);
+}
+
+uint16_t WireKeyType(const WireKey &key) {
+    size_t at = key.bytes.size() - 5;
+    return static_cast<uint16_t>(
+        (static_cast<unsigned char>(key.bytes[at]) << 8) |
+        static_cast<unsigned char>(key.bytes[at + 1]));
+}
+
 std::vector<unsigned char> BuildEmptyResponse(const DnsHeader &query_header,
                                               const DnsQuestion &question) {
-    std::vector<unsigned char> buf = BuildResponseHeader(query_header, 1, 0);
-    AppendQuestion(&buf, question);
+    std::vector<unsigned char> buf;
+    BuildEmptyResponse(query_header, question, &buf);
     return buf;
 }
 
+void BuildEmptyResponse(const DnsHeader &query_header,
+                        const DnsQuestion &question,
+                        std::vector<unsigned char> *out) {
+    WriteResponseHeader(out, query_header, 1, 0);
+    AppendQuestion(out, question);
+}
+
 std::vector<unsigned char> BuildAResponse(const DnsHeader &query_header,
                                           const DnsQuestion &question,
                                           const std::string &ipv4) {
-    std::vector<unsigned char> buf = BuildResponseHeader(query_header, 1, 1);
-    AppendQuestion(&buf, question);
-    WriteQName(&buf, question.qname);
-    WriteU16(&buf, DNS_TYPE_A);
-    WriteU16(&buf, 1);
-    WriteU32(&buf, 60);
-    WriteU16(&buf, 4);
+    std::vector<unsigned char> buf;
+    BuildAResponse(query_header, question, ipv4, &buf);
+    return buf;
+}
+
+void BuildAResponse(const DnsHeader &query_header,
+                    const DnsQuestion &question,
+                    const std::string &ipv4,
+                    std::vector<unsigned char> *out) {
+    WriteResponseHeader(out, query_header, 1, 1);
+    AppendQuestion(out, question);
+    WriteQName(out, question.qname);
+    WriteU16(out, DNS_TYPE_A);
+    WriteU16(out, 1);
+    WriteU32(out, 60);
+    WriteU16(out, 4);
     unsigned char addr[4];
     if (inet_pton(AF_INET, ipv4.c_str(), addr) != 1) {
         std::memset(addr, 0, sizeof(addr));
     }
-    buf.insert(buf.end(), addr, addr + 4);
-    return buf;
+    out->insert(out->end(), addr, addr + 4);
 }
 
 std::vector<unsigned char> BuildAAAAResponse(const DnsHeader &query_header,
                                              const DnsQuestion &question,
                                              const std::string &ipv6) {
-    std::vector<unsigned char> buf = BuildResponseHeader(query_header, 1, 1);
-    AppendQuestion(&buf, question);
-    WriteQName(&buf, question.qname);
-    WriteU16(&buf, DNS_TYPE_AAAA);
-    WriteU16(&buf, 1);
-    WriteU32(&buf, 60);
-    WriteU16(&buf, 16);
+    std::vector<unsigned char> buf;
+    BuildAAAAResponse(query_header, question, ipv6, &buf);
+    return buf;
+}
+
+void BuildAAAAResponse(const DnsHeader &query_header,
+                       const DnsQuestion &question,
+                       const std::string &ipv6,
+                       std::vector<unsigned char> *out) {
+    WriteResponseHeader(out, query_header, 1, 1);
+    AppendQuestion(out, question);
+    WriteQName(out, question.qname);
+    WriteU16(out, DNS_TYPE_AAAA);
+    WriteU16(out, 1);
+    WriteU32(out, 60);
+    WriteU16(out, 16);
     unsigned char addr[16];
     if (inet_pton(AF_INET6, ipv6.c_str(), addr) != 1) {
         std::memset(addr, 0, sizeof(addr));
     }
-    buf.insert(buf.end(), addr, addr + 16);
-    return buf;
+    out->insert(out->end(), addr, addr + 16);
+}
+
+void MakeAddressTemplate(uint16_t qtype, const unsigned char *address,
+                         size_t address_len, uint32_t ttl,
+                         ResponseTemplate *out) {
+    out->rcode = DNS_RCODE_NOERROR;
+    out->ancount = 1;
+    out->nscount = 0;
+    out->records.clear();
+    WriteU16(&out->records, 0xC00C);
+    WriteU16(&out->records, qtype);
+    WriteU16(&out->records, 1);
+    WriteU32(&out->records, ttl);
+    WriteU16(&out->records, static_cast<uint16_t>(address_len));
+    out->records.insert(out->records.end(), address, address + address_len);
+}
+
+void MakeRecordTemplate(uint16_t rtype, const std::string &value,
+                        unsigned short preference, uint32_t ttl,
+                        ResponseTemplate *out) {
+    if (rtype == DNS_TYPE_A || rtype == DNS_TYPE_AAAA) {
+        unsigned char addr[16];
+        size_t len = rtype == DNS_TYPE_A ? 4 : 16;
+        if (inet_pton(rtype == DNS_TYPE_A ? AF_INET : AF_INET6, value.c_str(),
+                      addr) != 1) {
+            std::memset(addr, 0, sizeof(addr));
+        }
+        MakeAddressTemplate(rtype, addr, len, ttl, out);
+        return;
+    }
+    out->rcode = DNS_RCODE_NOERROR;
+    out->ancount = 1;
+    out->nscount = 0;
+    out->records.clear();
+    WriteU16(&out->records, 0xC00C);
+    WriteU16(&out->records, rtype);
+    WriteU16(&out->records, 1);
+    WriteU32(&out->records, ttl);
+    size_t rdlength_at = out->records.size();
+    WriteU16(&out->records, 0);
+    if (rtype == DNS_TYPE_MX) {
+        WriteU16(&out->records, preference);
+    }
+    if (rtype != DNS_TYPE_TXT) {
+        WriteQName(&out->records, value);
+    } else if (value.empty()) {
+        out->records.push_back(0);
+    } else {
+        for (size_t offset = 0; offset < value.size(); offset += 255) {
+            size_t chunk = value.size() - offset;
+            if (chunk > 255) {
+                chunk = 255;
+            }
+            out->records.push_back(static_cast<unsigned char>(chunk));
+            out->records.insert(out->records.end(), value.begin() + offset,
+                                value.begin() + offset + chunk);
+        }
+    }
+    PatchRdLength(&out->records, rdlength_at);
+}
+
+void MakeNegativeTemplate(unsigned int rcode, uint32_t ttl,
+                          ResponseTemplate *out) {
+    out->rcode = rcode;
+    out->ancount = 0;
+    out->nscount = 1;
+    out->records.clear();
+    // The SOA is made out for the question's name itself, which keeps the
+    // records the same whatever was asked: MNAME is that name and RNAME is
+    // hostmaster under it.
+    WriteU16(&out->records, 0xC00C);
+    WriteU16(&out->records, DNS_TYPE_SOA);
+    WriteU16(&out->records, 1);
+    WriteU32(&out->records, ttl);
+    size_t rdlength_at = out->records.size();
+    WriteU16(&out->records, 0);
+    WriteU16(&out->records, 0xC00C);
+    const char hostmaster[] = "hostmaster";
+    out->records.push_back(static_cast<unsigned char>(sizeof(hostmaster) - 1));
+    out->records.insert(out->records.end(), hostmaster,
+                        hostmaster + sizeof(hostmaster) - 1);
+    WriteU16(&out->records, 0xC00C);
+    WriteU32(&out->records, 1);     // SERIAL
+    WriteU32(&out->records, 3600);  // REFRESH
+    WriteU32(&out->records, 600);   // RETRY
+    WriteU32(&out->records, 86400); // EXPIRE
+    WriteU32(&out->records, ttl);   // MINIMUM
+    PatchRdLength(&out->records, rdlength_at);
+}
+
+void BuildTemplateResponse(const unsigned char *packet,
+                           const DnsHeader &query_header,
+                           const DnsQuestion &question,
+                           const ResponseTemplate &tmpl,
+                           std::vector<unsigned char> *out) {
+    size_t question_end = question.raw_offset + question.raw_length;
+    out->assign(packet, packet + question_end);
+    uint16_t flags = static_cast<uint16_t>(ResponseFlags(query_header) |
+                                           (tmpl.rcode & 0x0f));
+    unsigned char *header = &(*out)[0];
+    header[2] = static_cast<unsigned char>(flags >> 8);
+    header[3] = static_cast<unsigned char>(flags & 0xff);
+    header[4] = 0;
+    header[5] = 1;
+    header[6] = static_cast<unsigned char>(tmpl.ancount >> 8);
+    header[7] = static_cast<unsigned char>(tmpl.ancount & 0xff);
+    header[8] = static_cast<unsigned char>(tmpl.nscount >> 8);
+    header[9] = static_cast<unsigned char>(tmpl.nscount & 0xff);
+    header[10] = 0;
+    header[11] = 0;
+    out->insert(out->end(), tmpl.records.begin(), tmpl.records.end());
 }
 
 std::vector<unsigned char> BuildCNAMEResponse(const DnsHeader &query_header,
                                               const DnsQuestion &question,
                                               const std::string &target) {
-    std::vector<unsigned char> buf = BuildResponseHeader(query_header, 1, 1);
-    AppendQuestion(&buf, question);
-    WriteQName(&buf, question.qname);
-    WriteU16(&buf, DNS_TYPE_CNAME);
-    WriteU16(&buf, 1);
-    WriteU32(&buf, 60);
-    std::vector<unsigned char> cname;
-    WriteQName(&cname, target);
-    WriteU16(&buf, static_cast<uint16_t>(cname.size()));
-    buf.insert(buf.end(), cname.begin(), cname.end());
+    std::vector<unsigned char> buf;
+    BuildCNAMEResponse(query_header, question, target, &buf);
     return buf;
 }
 
+void BuildCNAMEResponse(const DnsHeader &query_header,
+                        const DnsQuestion &question,
+                        const std::string &target,
+                        std::vector<unsigned char> *out) {
+    WriteResponseHeader(out, query_header, 1, 1);
+    AppendQuestion(out, question);
+    WriteQName(out, question.qname);
+    WriteU16(out, DNS_TYPE_CNAME);
+    WriteU16(out, 1);
+    WriteU32(out, 60);
+    size_t rdlength_offset = out->size();
+    WriteU16(out, 0);
+    WriteQName(out, target);
+    PatchRdLength(out, rdlength_offset);
+}
+
 std::vector<unsigned char> BuildPTRResponse(const DnsHeader &query_header,
                                              const DnsQuestion &question,
                                              const std::string &target) {
-    std::vector<unsigned char> buf = BuildResponseHeader(query_header, 1, 1);
-    AppendQuestion(&buf, question);
-    WriteQName(&buf, question.qname);
-    WriteU16(&buf, DNS_TYPE_PTR);
-    WriteU16(&buf, 1);
-    WriteU32(&buf, 60);
-    std::vector<unsigned char> ptr;
-    WriteQName(&ptr, target);
-    WriteU16(&buf, static_cast<uint16_t>(ptr.size()));
-    buf.insert(buf.end(), ptr.begin(), ptr.end());
+    std::vector<unsigned char> buf;
+    BuildPTRResponse(query_header, question, target, &buf);
     return buf;
 }
 
+void BuildPTRResponse(const DnsHeader &query_header,
+                      const DnsQuestion &question,
+                      const std::string &target,
+                      std::vector<unsigned char> *out) {
+    WriteResponseHeader(out, query_header, 1, 1);
+    AppendQuestion(out, question);
+    WriteQName(out, question.qname);
+    WriteU16(out, DNS_TYPE_PTR);
+    WriteU16(out, 1);
+    WriteU32(out, 60);
+    size_t rdlength_offset = out->size();
+    WriteU16(out, 0);
+    WriteQName(out, target);
+    PatchRdLength(out, rdlength_offset);
+}
+
 std::vector<unsigned char> BuildTXTResponse(const DnsHeader &query_header,
                                              const DnsQuestion &question,
                                              const std::string &text) {
-    std::vector<unsigned char> buf = BuildResponseHeader(query_header, 1, 1);
-    AppendQuestion(&buf, question);
-    WriteQName(&buf, question.qname);
-    WriteU16(&buf, DNS_TYPE_TXT);
-    WriteU16(&buf, 1);
-    WriteU32(&buf, 60);
-    std::vector<unsigned char> rdata;
+    std::vector<unsigned char> buf;
+    BuildTXTResponse(query_header, question, text, &buf);
+    return buf;
+}
+
+void BuildTXTResponse(const DnsHeader &query_header,
+                      const DnsQuestion &question,
+                      const std::string &text,
+                      std::vector<unsigned char> *out) {
+    WriteResponseHeader(out, query_header, 1, 1);
+    AppendQuestion(out, question);
+    WriteQName(out, question.qname);
+    WriteU16(out, DNS_TYPE_TXT);
+    WriteU16(out, 1);
+    WriteU32(out, 60);
+    size_t rdlength_offset = out->size();
+    WriteU16(out, 0);
     if (text.empty()) {
-        rdata.push_back(0);
+        out->push_back(0);
     } else {
         size_t offset = 0;
         while (offset < text.size()) {
@@ -310,36 +591,43 @@ std::vector<unsigned char> BuildTXTResponse(const DnsHeader &query_header,
             if (chunk > 255) {
                 chunk = 255;
             }
-            rdata.push_back(static_cast<unsigned char>(chunk));
+            out->push_back(static_cast<unsigned char>(chunk));
             for (size_t i = 0; i < chunk; ++i) {
-                rdata.push_back(static_cast<unsigned char>(text[offset + i]));
+                out->push_back(static_cast<unsigned char>(text[offset + i]));
             }
             offset += chunk;
         }
     }
-    WriteU16(&buf, static_cast<uint16_t>(rdata.size()));
-    buf.insert(buf.end(), rdata.begin(), rdata.end());
-    return buf;
+    PatchRdLength(out, rdlength_offset);
 }
 
 std::vector<unsigned char> BuildMXResponse(const DnsHeader &query_header,
                                             const DnsQuestion &question,
                                             unsigned short preference,
                                             const std::string &exchange) {
-    std::vector<unsigned char> buf = BuildResponseHeader(query_header, 1, 1);
-    AppendQuestion(&buf, question);
-    WriteQName(&buf, question.qname);
-    WriteU16(&buf, DNS_TYPE_MX);
-    WriteU16(&buf, 1);
-    WriteU32(&buf, 60);
-    std::vector<unsigned char> rdata;
-    WriteU16(&rdata, preference);
-    WriteQName(&rdata, exchange);
-    WriteU16(&buf, static_cast<uint16_t>(rdata.size()));
-    buf.insert(buf.end(), rdata.begin(), rdata.end());
+    std::vector<unsigned char> buf;
+    BuildMXResponse(query_header, question, preference, exchange, &buf);
     return buf;
 }
 
+void BuildMXResponse(const DnsHeader &query_header,
+                     const DnsQuestion &question,
+                     unsigned short preference,
+                     const std::string &exchange,
+                     std::vector<unsigned char> *out) {
+    WriteResponseHeader(out, query_header, 1, 1);
+    AppendQuestion(out, question);
+    WriteQName(out, question.qname);
+    WriteU16(out, DNS_TYPE_MX);
+    WriteU16(out, 1);
+    WriteU32(out, 60);
+    size_t rdlength_offset = out->size();
+    WriteU16(out, 0);
+    WriteU16(out, preference);
+    WriteQName(out, exchange);
+    PatchRdLength(out, rdlength_offset);
+}
+
 bool RewritePrivateARecordsToZero(std::vector<unsigned char> *packet,
                                   bool *rewritten) {
     if (!packet || packet->size() < 12) {
@@ -400,6 +688,191 @@ bool RewritePrivateARecordsToZero(std::vector<unsigned char> *packet,
     return true;
 }
 
+bool FindResponseTtls(const std::vector<unsigned char> &packet,
+                      std::vector<size_t> *offsets, uint32_t *min_ttl) {
+    if (packet.size() < 12) {
+        return false;
+    }
+    size_t offset = 12;
+    uint16_t qdcount = ReadU16(packet, 4);
+    for (uint16_t i = 0; i < qdcount; ++i) {
+        size_t end = 0;
+        if (!ReadName(packet, offset, NULL, &end, 0)) {
+            return false;
+        }
+        if (end + 4 > packet.size()) {
+            return false;
+        }
+        offset = end + 4;
+    }
+    uint16_t ancount = ReadU16(packet, 6);
+    uint16_t nscount = ReadU16(packet, 8);
+    unsigned long rr_count = static_cast<unsigned long>(ancount) +
+                             static_cast<unsigned long>(nscount) +
+                             static_cast<unsigned long>(ReadU16(packet, 10));
+    // The answer section decides the lifetime; without one, the authority
+    // section does.
+    unsigned long ttl_rrs = ancount > 0 ? ancount : nscount;
+    bool have_min = false;
+    uint32_t lowest = 0;
+    if (offsets) {
+        offsets->clear();
+    }
+    for (unsigned long i = 0; i < rr_count; ++i) {
+        size_t end = 0;
+        if (!ReadName(packet, offset, NULL, &end, 0)) {
+            return false;
+        }
+        if (end + 10 > packet.size()) {
+            return false;
+        }
+        uint16_t type = ReadU16(packet, end);
+        uint16_t rdlength = ReadU16(packet, end + 8);
+        if (end + 10 + rdlength > packet.size()) {
+            return false;
+        }
+        // OPT keeps its extended RCODE and flags in the TTL field.
+        if (type != DNS_TYPE_OPT) {
+            uint32_t ttl = (static_cast<uint32_t>(ReadU16(packet, end + 4)) << 16) |
+                           ReadU16(packet, end + 6);
+            if (offsets) {
+                offsets->push_back(end + 4);
+            }
+            if (i < ttl_rrs && (!have_min || ttl < lowest)) {
+                lowest = ttl;
+                have_min = true;
+            }
+        }
+        offset = end + 10 + rdlength;
+    }
+    if (have_min && min_ttl) {
+        *min_ttl = lowest;
+    }
+    return true;
+}
+
+void SetTtlsAt(std::vector<unsigned char> *packet,
+               const std::vector<size_t> &offsets, uint32_t ttl) {
+    for (size_t i = 0; i < offsets.size(); ++i) {
+        size_t at = offsets[i];
+        if (at + 4 > packet->size()) {
+            continue;
+        }
+        (*packet)[at] = static_cast<unsigned char>((ttl >> 24) & 0xff);
+        (*packet)[at + 1] = static_cast<unsigned char>((ttl >> 16) & 0xff);
+        (*packet)[at + 2] = static_cast<unsigned char>((ttl >> 8) & 0xff);
+        (*packet)[at + 3] = static_cast<unsigned char>(ttl & 0xff);
+    }
+}
+
+bool IsNegativeResponse(const std::vector<unsigned char> &packet,
+                        bool *nxdomain) {
+    if (nxdomain) {
+        *nxdomain = false;
+    }
+    if (packet.size() < 12) {
+        return false;
+    }
+    unsigned int rcode = packet[3] & 0x0f;
+    uint16_t ancount = ReadU16(packet, 6);
+    if (rcode == DNS_RCODE_NXDOMAIN) {
+        // With a CNAME chain in front, it is the target that does not exist.
+        if (nxdomain) {
+            *nxdomain = ancount == 0;
+        }
+        return true;
+    }
+    return rcode == DNS_RCODE_NOERROR && ancount == 0;
+}
+
+bool FindNegativeTtl(const std::vector<unsigned char> &packet, uint32_t *ttl) {
+    if (!IsNegativeResponse(packet, NULL)) {
+        return false;
+    }
+    size_t offset = 12;
+    uint16_t qdcount = ReadU16(packet, 4);
+    for (uint16_t i = 0; i < qdcount; ++i) {
+        size_t end = 0;
+        if (!ReadName(packet, offset, NULL, &end, 0)) {
+            return false;
+        }
+        if (end + 4 > packet.size()) {
+            return false;
+        }
+        offset = end + 4;
+    }
+    unsigned long rr_count = static_cast<unsigned long>(ReadU16(packet, 6)) +
+                             static_cast<unsigned long>(ReadU16(packet, 8));
+    for (unsigned long i = 0; i < rr_count; ++i) {
+        size_t end = 0;
+        if (!ReadName(packet, offset, NULL, &end, 0)) {
+            return false;
+        }
+        if (end + 10 > packet.size()) {
+            return false;
+        }
+        uint16_t type = ReadU16(packet, end);
+        uint16_t rdlength = ReadU16(packet, end + 8);
+        size_t rdata_offset = end + 10;
+        if (rdata_offset + rdlength > packet.size()) {
+            return false;
+        }
+        if (type == DNS_TYPE_SOA) {
+            // MNAME and RNAME, then SERIAL, REFRESH, RETRY, EXPIRE, MINIMUM.
+            size_t mname_end = 0;
+            size_t rname_end = 0;
+            if (!ReadName(packet, rdata_offset, NULL, &mname_end, 0) ||
+                !ReadName(packet, mname_end, NULL, &rname_end, 0) ||
+                rname_end + 20 > rdata_offset + rdlength) {
+                return false;
+            }
+            uint32_t rr_ttl = (static_cast<uint32_t>(ReadU16(packet, end + 4)) << 16) |
+                              ReadU16(packet, end + 6);
+            uint32_t minimum = (static_cast<uint32_t>(ReadU16(packet, rname_end + 16)) << 16) |
+                               ReadU16(packet, rname_end + 18);
+            if (ttl) {
+                *ttl = rr_ttl < minimum ? rr_ttl : minimum;
+            }
+            return true;
+        }
+        offset = rdata_offset + rdlength;
+    }
+    return false;
+}
+
+bool SetQuestionType(std::vector<unsigned char> *packet, uint16_t qtype) {
+    if (!packet || packet->size() < 12 || ReadU16(*packet, 4) == 0) {
+        return false;
+    }
+    size_t end = 0;
+    if (!ReadName(*packet, 12, NULL, &end, 0) || end + 4 > packet->size()) {
+        return false;
+    }
+    (*packet)[end] = static_cast<unsigned char>((qtype >> 8) & 0xff);
+    (*packet)[end + 1] = static_cast<unsigned char>(qtype & 0xff);
+    return true;
+}
+
+bool RewriteAsErrorResponse(unsigned char *packet, size_t *len,
+                            unsigned int rcode) {
+    if (!TrimToQuestion(packet, len)) {
+        return false;
+    }
+    // Same flags as ResponseFlags(): QR, the query's RD, RA.
+    packet[2] = static_cast<unsigned char>(0x80 | (packet[2] & 0x01));
+    packet[3] = static_cast<unsigned char>(0x80 | (rcode & 0x0f));
+    return true;
+}
+
+bool RewriteAsTruncatedResponse(unsigned char *packet, size_t *len,
+                                unsigned int rcode) {
+    if (!RewriteAsErrorResponse(packet, len, rcode)) {
+        return false;
+    }
+    packet[2] |= 0x02; // TC
+    return true;
+}
+
 void PatchResponseId(std::vector<unsigned char> *packet, uint16_t id) {
     if (!packet || packet->size() < 2) {
         return;
@@ -11,10 +11,19 @@ namespace gravastar {
 enum {
     DNS_TYPE_A = 1,
     DNS_TYPE_CNAME = 5,
+    DNS_TYPE_SOA = 6,
     DNS_TYPE_PTR = 12,
     DNS_TYPE_MX = 15,
     DNS_TYPE_TXT = 16,
-    DNS_TYPE_AAAA = 28
+    DNS_TYPE_AAAA = 28,
+    DNS_TYPE_OPT = 41
+};
+
+enum {
+    DNS_RCODE_NOERROR = 0,
+    DNS_RCODE_SERVFAIL = 2,
+    DNS_RCODE_NXDOMAIN = 3,
+    DNS_RCODE_REFUSED = 5
 };
 
 struct DnsHeader {
@@ -26,15 +35,43 @@ struct DnsHeader {
     uint16_t arcount;
 };
 
+// Query bits that change the answer, kept in the last byte of a WireKey.
+enum {
+    WIRE_KEY_CD = 0x01,
+    WIRE_KEY_DO = 0x02
+};
+
+// Lookup key for a question, taken straight from the wire: the name in wire
+// format with ASCII letters lowercased, QTYPE, QCLASS and a byte of
+// WIRE_KEY_* bits. The hash is computed once, when the key is built.
+struct WireKey {
+    std::string bytes;
+    uint32_t hash;
+};
+
+// A canned answer that fits any question: the records that follow the
+// question, their names compressed to point at it, and the header fields
+// that go with them.
+struct ResponseTemplate {
+    unsigned int rcode;
+    uint16_t ancount;
+    uint16_t nscount;
+    std::vector<unsigned char> records;
+};
+
 struct DnsQuestion {
     std::string qname;
     uint16_t qtype;
     uint16_t qclass;
     size_t raw_offset;
     size_t raw_length;
+    WireKey key;
 };
 
+// Also fills in question->key.
 bool ParseDnsQuery(const std::vector<unsigned char> &packet, DnsHeader *header, DnsQuestion *question);
+bool ParseDnsQuery(const unsigned char *packet, size_t size,
+                   DnsHeader *header, DnsQuestion *question);
 
 std::vector<unsigned char> BuildEmptyResponse(const DnsHeader &query_header,
                                               const DnsQuestion &question);
@@ -57,11 +94,101 @@ std::vector<unsigned char> BuildMXResponse(const DnsHeader &query_header,
                                             const DnsQuestion &question,
                                             unsigned short preference,
                                             const std::string &exchange);
+// In-place variants: `out` is cleared and refilled, so a caller that reuses
+// the same vector does not reallocate once it has grown.
+void BuildEmptyResponse(const DnsHeader &query_header,
+                        const DnsQuestion &question,
+                        std::vector<unsigned char> *out);
+void BuildAResponse(const DnsHeader &query_header,
+                    const DnsQuestion &question,
+                    const std::string &ipv4,
+                    std::vector<unsigned char> *out);
+void BuildAAAAResponse(const DnsHeader &query_header,
+                       const DnsQuestion &question,
+                       const std::string &ipv6,
+                       std::vector<unsigned char> *out);
+void BuildCNAMEResponse(const DnsHeader &query_header,
+                        const DnsQuestion &question,
+                        const std::string &target,
+                        std::vector<unsigned char> *out);
+void BuildPTRResponse(const DnsHeader &query_header,
+                      const DnsQuestion &question,
+                      const std::string &target,
+                      std::vector<unsigned char> *out);
+void BuildTXTResponse(const DnsHeader &query_header,
+                      const DnsQuestion &question,
+                      const std::string &text,
+                      std::vector<unsigned char> *out);
+void BuildMXResponse(const DnsHeader &query_header,
+                     const DnsQuestion &question,
+                     unsigned short preference,
+                     const std::string &exchange,
+                     std::vector<unsigned char> *out);
+// One `qtype` record for the question's name holding `address`, 4 bytes for
+// A and 16 for AAAA.
+void MakeAddressTemplate(uint16_t qtype, const unsigned char *address,
+                         size_t address_len, uint32_t ttl,
+                         ResponseTemplate *out);
+// One `rtype` record for the question's name. `value` is the address for A
+// and AAAA (all zeros if it does not parse), the target name for CNAME, PTR
+// and MX, and the text for TXT; `preference` is only used by MX.
+void MakeRecordTemplate(uint16_t rtype, const std::string &value,
+                        unsigned short preference, uint32_t ttl,
+                        ResponseTemplate *out);
+// No answers and an SOA in the authority section whose TTL and MINIMUM are
+// `ttl`, so clients cache the negative answer (RFC 2308). `rcode` is
+// DNS_RCODE_NXDOMAIN or DNS_RCODE_NOERROR for NODATA.
+void MakeNegativeTemplate(unsigned int rcode, uint32_t ttl,
+                          ResponseTemplate *out);
+// Answers the query in `packet`, as parsed into `query_header` and
+// `question`, by copying its question and appending the template's records.
+// Nothing is parsed, and a reused `out` is not reallocated once it has
+// grown.
+void BuildTemplateResponse(const unsigned char *packet,
+                           const DnsHeader &query_header,
+                           const DnsQuestion &question,
+                           const ResponseTemplate &tmpl,
+                           std::vector<unsigned char> *out);
+// Turns the query held in `packet` into a header-plus-question response with
+// the given RCODE, in place, without decoding the name. Returns false if the
+// question cannot be located.
+bool RewriteAsErrorResponse(unsigned char *packet, size_t *len,
+                            unsigned int rcode);
+// As above with TC set, telling the client to retry over TCP.
+bool RewriteAsTruncatedResponse(unsigned char *packet, size_t *len,
+                                unsigned int rcode);
 void PatchResponseId(std::vector<unsigned char> *packet, uint16_t id);
 bool ExtractFirstPtrTarget(const std::vector<unsigned char> &packet,
                            std::string *out_name);
 bool RewritePrivateARecordsToZero(std::vector<unsigned char> *packet,
                                   bool *rewritten);
+// Collects the offset of the TTL field of every resource record except OPT
+// into `offsets`, and stores the lowest answer TTL (authority TTL when there
+// are no answers) in `*min_ttl`. `*min_ttl` is left alone when the response
+// carries no such record. Returns false if the response does not parse.
+bool FindResponseTtls(const std::vector<unsigned char> &packet,
+                      std::vector<size_t> *offsets, uint32_t *min_ttl);
+// Writes `ttl` into the TTL fields at `offsets`, as found above.
+void SetTtlsAt(std::vector<unsigned char> *packet,
+               const std::vector<size_t> &offsets, uint32_t ttl);
+// True for NXDOMAIN, and for NOERROR with no answer records (NODATA).
+// `*nxdomain` is set when the queried name itself does not exist, i.e. an
+// NXDOMAIN with no CNAME chain in front of it.
+bool IsNegativeResponse(const std::vector<unsigned char> &packet,
+                        bool *nxdomain);
+// For a negative response with an SOA in its authority section, stores the
+// lower of the SOA record's TTL and its MINIMUM field in `*ttl` (RFC 2308).
+// Returns false for positive responses and negative ones without an SOA.
+bool FindNegativeTtl(const std::vector<unsigned char> &packet, uint32_t *ttl);
+// Builds the key for `name` as it would come off the wire, with no flag
+// bits set.
+void MakeWireKey(const std::string &name, uint16_t qtype, uint16_t qclass,
+                 WireKey *key);
+// Replaces the QTYPE in `key` and rehashes it.
+void SetWireKeyType(WireKey *key, uint16_t qtype);
+uint16_t WireKeyType(const WireKey &key);
+// Rewrites the QTYPE of the first question.
+bool SetQuestionType(std::vector<unsigned char> *packet, uint16_t qtype);
 
 } // namespace gravastar
 
@@ -1,386 +1,313 @@
 #include "dns_server.h"
 
+#include "atomic_ops.h"
 #include "dns_packet.h"
+#include "event_loop.h"
 #include "util.h"
 
 #include <arpa/inet.h>
 #include <cerrno>
 #include <csignal>
-#include <cstdio>
 #include <cstring>
+#include <ctime>
 #include <fcntl.h>
 #include <sstream>
+#include <algorithm>
 #include <netinet/in.h>
-#include <sys/select.h>
+#include <netinet/tcp.h>
+#include <sched.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <unistd.h>
 
+#if defined(__FreeBSD__)
+#include <pthread_np.h>
+#include <sys/cpuset.h>
+typedef cpuset_t cpu_set_t;
+#endif
+
 namespace gravastar {
 
 namespace {
 
-volatile sig_atomic_t g_running = 1;
-
-void HandleSignal(int) { g_running = 0; }
 
-std::string MakeCacheKey(const std::string &name, unsigned short qtype) {
-  std::string key = ToLower(name);
-  if (!key.empty() && key[key.size() - 1] == '.') {
-    key.resize(key.size() - 1);
-  }
-  key.append("|");
-  char buf[16];
-  std::snprintf(buf, 16, "%u", static_cast<unsigned int>(qtype));
-  key.append(buf);
-  return key;
-}
+// Read by every listener thread; the __atomic builtins on an int are
+// lock-free and therefore safe to use from the signal handler.
+int g_running = 1;
+// Never drained: once the signal handler writes to it, every event loop that
+// watches the read end stays woken until it notices g_running is clear.
+int g_shutdown_pipe[2] = {-1, -1};
 
-std::string QTypeToString(unsigned short qtype) {
-  if (qtype == DNS_TYPE_A) {
-    return "A";
-  }
-  if (qtype == DNS_TYPE_AAAA) {
-    return "AAAA";
-  }
-  if (qtype == DNS_TYPE_CNAME) {
-    return "CNAME";
-  }
-  if (qtype == DNS_TYPE_PTR) {
-    return "PTR";
+void HandleSignal(int) {
+  AtomicStore(&g_running, 0);
+  if (g_shutdown_pipe[1] >= 0) {
+    unsigned char byte = 1;
+    ssize_t rc = write(g_shutdown_pipe[1], &byte, 1);
+    (void)rc;
   }
-  if (qtype == DNS_TYPE_MX) {
-    return "MX";
-  }
-  if (qtype == DNS_TYPE_TXT) {
-    return "TXT";
-  }
-  std::ostringstream out;
-  out << "TYPE" << qtype;
-  return out.str();
 }
 
-void ParseMxValue(const std::string &value,
-                  unsigned short *preference,
-                  std::string *exchange) {
-  unsigned short pref = 10;
-  std::string target = Trim(value);
-  std::istringstream iss(value);
-  unsigned long parsed_pref = 0;
-  std::string parsed_target;
-  if ((iss >> parsed_pref) && (iss >> parsed_target)) {
-    if (parsed_pref <= 65535) {
-      pref = static_cast<unsigned short>(parsed_pref);
+bool InstallSignalHandlers() {
+  if (g_shutdown_pipe[0] < 0) {
+    if (pipe(g_shutdown_pipe) != 0) {
+      DebugLog(std::string("pipe() failed: ") + std::strerror(errno));
+      return false;
+    }
+    for (int i = 0; i < 2; ++i) {
+      int flags = fcntl(g_shutdown_pipe[i], F_GETFL, 0);
+      if (flags >= 0) {
+        fcntl(g_shutdown_pipe[i], F_SETFL, flags | O_NONBLOCK);
+      }
     }
-    target = parsed_target;
-  }
-  if (preference) {
-    *preference = pref;
-  }
-  if (exchange) {
-    *exchange = target;
   }
+  std::signal(SIGINT, HandleSignal);
+  std::signal(SIGTERM, HandleSignal);
+  // A TCP client that disconnects mid-answer must not kill the process.
+  std::signal(SIGPIPE, SIG_IGN);
+  return true;
 }
 
-} // namespace
-
-DnsServer::DnsServer(const ServerConfig &config, Blocklist *blocklist,
-                     const LocalRecords &local_records, DnsCache *cache,
-                     const UpstreamResolver &resolver, QueryLogger *logger)
-    : config_(config), blocklist_(blocklist), local_records_(local_records),
-      cache_(cache), resolver_(resolver), logger_(logger), sock_(-1),
-      running_(false), worker_count_(4) {
-  pthread_mutex_init(&queue_mutex_, NULL);
-  pthread_cond_init(&queue_cv_, NULL);
-  pthread_mutex_init(&cache_mutex_, NULL);
-}
-
-DnsServer::~DnsServer() {
-  StopWorkers();
-  pthread_mutex_destroy(&queue_mutex_);
-  pthread_cond_destroy(&queue_cv_);
-  pthread_mutex_destroy(&cache_mutex_);
+bool ReusePortSupported() {
+#if defined(SO_REUSEPORT_LB) || (defined(__linux__) && defined(SO_REUSEPORT))
+  return true;
+#else
+  // Elsewhere SO_REUSEPORT only permits the duplicate bind; datagrams still
+  // land on a single socket, so sharding would starve all but one thread.
+  return false;
+#endif
 }
 
-bool DnsServer::Run() {
+int OpenUdpSocket(const std::string &listen_addr, unsigned short listen_port,
+                  bool reuse_port) {
   int sock = socket(AF_INET, SOCK_DGRAM, 0);
   if (sock < 0) {
     DebugLog(std::string("socket() failed: ") + std::strerror(errno));
-    return false;
+    return -1;
   }
   int enable = 1;
   setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+  if (reuse_port) {
+#if defined(SO_REUSEPORT_LB)
+    int rc = setsockopt(sock, SOL_SOCKET, SO_REUSEPORT_LB, &enable,
+                        sizeof(enable));
+#elif defined(SO_REUSEPORT)
+    int rc = setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &enable,
+                        sizeof(enable));
+#else
+    int rc = -1;
+    errno = ENOPROTOOPT;
+#endif
+    if (rc != 0) {
+      DebugLog(std::string("setsockopt(SO_REUSEPORT) failed: ") +
+               std::strerror(errno));
+      close(sock);
+      return -1;
+    }
+  }
   int flags = fcntl(sock, F_GETFL, 0);
   if (flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0) {
     DebugLog(std::string("fcntl(O_NONBLOCK) failed: ") + std::strerror(errno));
     close(sock);
-    return false;
+    return -1;
   }
 
   struct sockaddr_in addr;
   std::memset(&addr, 0, sizeof(addr));
   addr.sin_family = AF_INET;
-  addr.sin_port = htons(config_.listen_port);
-  if (inet_pton(AF_INET, config_.listen_addr.c_str(), &addr.sin_addr) != 1) {
-    DebugLog(std::string("inet_pton failed for address: ") + config_.listen_addr);
+  addr.sin_port = htons(listen_port);
+  if (inet_pton(AF_INET, listen_addr.c_str(), &addr.sin_addr) != 1) {
+    DebugLog(std::string("inet_pton failed for address: ") + listen_addr);
     close(sock);
-    return false;
+    return -1;
   }
 
   if (bind(sock, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) <
       0) {
     DebugLog(std::string("bind() failed: ") + std::strerror(errno));
     close(sock);
-    return false;
-  }
-
-  std::signal(SIGINT, HandleSignal);
-  std::signal(SIGTERM, HandleSignal);
-
-  sock_ = sock;
-  running_ = true;
-  {
-    std::ostringstream out;
-    out << "Listening on " << config_.listen_addr << ":" << config_.listen_port;
-    DebugLog(out.str());
-  }
-  StartWorkers();
-  {
-    std::ostringstream out;
-    out << "Worker threads started: " << workers_.size();
-    DebugLog(out.str());
-  }
-
-  while (g_running) {
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(sock, &readfds);
-    struct timeval tv;
-    tv.tv_sec = 1;
-    tv.tv_usec = 0;
-    int ready = select(sock + 1, &readfds, NULL, NULL, &tv);
-    if (ready < 0) {
-      DebugLog(std::string("select() failed: ") + std::strerror(errno));
-      continue;
-    }
-    if (ready == 0) {
-      continue;
-    }
-    if (!FD_ISSET(sock, &readfds)) {
-      continue;
-    }
-    for (;;) {
-      unsigned char buf[4096];
-      struct sockaddr_in client_addr;
-      socklen_t client_len = sizeof(client_addr);
-      ssize_t received = recvfrom(
-          sock, buf, sizeof(buf), 0,
-          reinterpret_cast<struct sockaddr *>(&client_addr), &client_len);
-      if (received < 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-          break;
-        }
-        DebugLog(std::string("recvfrom() failed: ") + std::strerror(errno));
-        break;
-      }
-      if (received == 0) {
-        continue;
-      }
-      if (DebugEnabled()) {
-        char addr_buf[INET_ADDRSTRLEN];
-        const char *addr_str = inet_ntop(AF_INET, &client_addr.sin_addr,
-                                         addr_buf, sizeof(addr_buf));
-        std::ostringstream out;
-        out << "Received " << received << " bytes from "
-            << (addr_str ? addr_str : "unknown") << ":" << ntohs(client_addr.sin_port);
-        DebugLog(out.str());
-      }
-      Job job;
-      job.packet.assign(buf, buf + received);
-      job.client_addr = client_addr;
-      job.client_len = client_len;
-      Enqueue(job);
-    }
+    return -1;
   }
+  return sock;
+}
 
-  StopWorkers();
-  close(sock);
-  sock_ = -1;
-  return true;
+bool SetNonBlocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
 }
 
-bool DnsServer::HandleQuery(int sock, const std::vector<unsigned char> &packet,
-                            const struct sockaddr_in &client_addr,
-                            socklen_t client_len) {
-  DnsHeader header;
-  DnsQuestion question;
-  if (!ParseDnsQuery(packet, &header, &question)) {
-    DebugLog("Failed to parse DNS query");
-    return false;
+int OpenTcpSocket(const std::string &listen_addr, unsigned short listen_port) {
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock < 0) {
+    DebugLog(std::string("socket() failed: ") + std::strerror(errno));
+    return -1;
   }
-  if (DebugEnabled()) {
-    std::ostringstream out;
-    out << "Query: " << question.qname << " " << QTypeToString(question.qtype);
-    DebugLog(out.str());
+  int enable = 1;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+  if (!SetNonBlocking(sock)) {
+    DebugLog(std::string("fcntl(O_NONBLOCK) failed: ") + std::strerror(errno));
+    close(sock);
+    return -1;
   }
 
-  ResolveResult result;
-  if (!ResolveQuery(packet, header, question, &result)) {
-    return false;
+  struct sockaddr_in addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(listen_port);
+  if (inet_pton(AF_INET, listen_addr.c_str(), &addr.sin_addr) != 1) {
+    DebugLog(std::string("inet_pton failed for address: ") + listen_addr);
+    close(sock);
+    return -1;
   }
-
-  if (!result.response.empty()) {
-    if (result.source == RESOLVE_CACHE) {
-      PatchResponseId(&result.response, header.id);
-    }
-    sendto(sock, &result.response[0], result.response.size(), 0,
-           reinterpret_cast<const struct sockaddr *>(&client_addr), client_len);
-  }
-
-  if (logger_) {
-    char addr_buf[INET_ADDRSTRLEN];
-    const char *addr_str = inet_ntop(AF_INET, &client_addr.sin_addr, addr_buf,
-                                     sizeof(addr_buf));
-    std::string client_ip = addr_str ? addr_str : "unknown";
-    std::string client_name = ResolveClientName(client_addr);
-    std::string qtype = QTypeToString(question.qtype);
-    if (result.source == RESOLVE_BLOCKLIST) {
-      logger_->LogBlock(client_ip, client_name, question.qname, qtype);
-    } else {
-      std::string resolved_by;
-      if (result.source == RESOLVE_LOCAL) {
-        resolved_by = "local";
-      } else if (result.source == RESOLVE_CACHE) {
-        resolved_by = "cache";
-      } else {
-        resolved_by = "external";
-      }
-      logger_->LogPass(client_ip, client_name, question.qname, qtype,
-                       resolved_by, result.upstream);
-    }
+  if (bind(sock, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) <
+          0 ||
+      listen(sock, 128) < 0) {
+    DebugLog(std::string("TCP bind()/listen() failed: ") + std::strerror(errno));
+    close(sock);
+    return -1;
   }
-
-  return true;
+  return sock;
 }
 
-bool DnsServer::ResolveQuery(const std::vector<unsigned char> &packet,
-                             const DnsHeader &header,
-                             const DnsQuestion &question,
-                             ResolveResult *result) {
-  if (!result) {
-    return false;
-  }
-  result->response.clear();
-  result->upstream.clear();
-  result->source = RESOLVE_NONE;
+// Tracks the next periodic stats line for an event loop that otherwise
+// blocks indefinitely.
+class StatsTimer {
+public:
+  explicit StatsTimer(unsigned int interval_sec)
+      : interval_(interval_sec), next_(std::time(NULL) + interval_sec) {}
 
-  if (blocklist_ && blocklist_->IsBlocked(question.qname)) {
-    DebugLog("Blocklist match");
-    result->source = RESOLVE_BLOCKLIST;
-    if (question.qtype == DNS_TYPE_A) {
-      result->response = BuildAResponse(header, question, "0.0.0.0");
-    } else if (question.qtype == DNS_TYPE_AAAA) {
-      result->response = BuildAAAAResponse(header, question, "::1");
-    } else {
-      result->response = BuildEmptyResponse(header, question);
+  int TimeoutMs() const {
+    if (interval_ == 0) {
+      return -1;
     }
-    return true;
+    time_t now = std::time(NULL);
+    return next_ > now ? static_cast<int>(next_ - now) * 1000 : 0;
   }
 
-  std::string local_value;
-  unsigned short local_type = 0;
-  if (local_records_.Resolve(question.qname, question.qtype, &local_value,
-                             &local_type)) {
-    DebugLog("Local record match");
-    result->source = RESOLVE_LOCAL;
-    if (local_type == DNS_TYPE_A) {
-      result->response = BuildAResponse(header, question, local_value);
-    } else if (local_type == DNS_TYPE_AAAA) {
-      result->response = BuildAAAAResponse(header, question, local_value);
-    } else if (local_type == DNS_TYPE_CNAME) {
-      result->response = BuildCNAMEResponse(header, question, local_value);
-    } else if (local_type == DNS_TYPE_PTR) {
-      result->response = BuildPTRResponse(header, question, local_value);
-    } else if (local_type == DNS_TYPE_TXT) {
-      result->response = BuildTXTResponse(header, question, local_value);
-    } else if (local_type == DNS_TYPE_MX) {
-      unsigned short pref = 10;
-      std::string exchange;
-      ParseMxValue(local_value, &pref, &exchange);
-      result->response = BuildMXResponse(header, question, pref, exchange);
+  bool Due() {
+    if (interval_ == 0 || std::time(NULL) < next_) {
+      return false;
     }
+    next_ = std::time(NULL) + interval_;
     return true;
   }
 
-  std::string key = MakeCacheKey(question.qname, question.qtype);
-  std::vector<unsigned char> cached;
-  if (cache_) {
-    pthread_mutex_lock(&cache_mutex_);
-    bool hit = cache_->Get(key, &cached);
-    pthread_mutex_unlock(&cache_mutex_);
-    if (hit) {
-      DebugLog("Cache hit");
-      result->source = RESOLVE_CACHE;
-      result->response = cached;
+private:
+  unsigned int interval_;
+  time_t next_;
+};
+
+bool HasReadEvent(const std::vector<LoopEvent> &events, int fd) {
+  for (size_t i = 0; i < events.size(); ++i) {
+    if (events[i].fd == fd && (events[i].events & (EVENT_READ | EVENT_ERROR))) {
       return true;
     }
-    DebugLog("Cache miss");
   }
+  return false;
+}
 
-  result->source = RESOLVE_UPSTREAM;
-  if (resolver_.ResolveDot(packet, &result->response, &result->upstream)) {
-    DebugLog("DoT resolution success");
-  } else if (resolver_.ResolveUdp(packet, &result->response, &result->upstream)) {
-    DebugLog("Upstream resolution success");
-  } else {
-    DebugLog("Upstream resolution failed");
-    result->response = BuildEmptyResponse(header, question);
+void LogReceived(const struct sockaddr_in &client_addr, size_t bytes) {
+  if (!DebugEnabled()) {
+    return;
   }
-  if (!result->response.empty() && config_.rebind_protection) {
-    bool rewritten = false;
-    if (!RewritePrivateARecordsToZero(&result->response, &rewritten)) {
-      DebugLog("Upstream response parse failed during rebind protection");
-      result->response = BuildEmptyResponse(header, question);
-    } else if (rewritten) {
-      DebugLog("Rebind protection rewrote upstream private A record(s) to 0.0.0.0");
-    }
+  char addr_buf[INET_ADDRSTRLEN];
+  const char *addr_str = inet_ntop(AF_INET, &client_addr.sin_addr, addr_buf,
+                                   sizeof(addr_buf));
+  std::ostringstream out;
+  out << "Received " << bytes << " bytes from "
+      << (addr_str ? addr_str : "unknown") << ":" << ntohs(client_addr.sin_port);
+  DebugLog(out.str());
+}
+
+// NXDOMAIN covers every type of a name (RFC 8020), so it is cached once
+// under the question's key with the reserved type 0.
+WireKey MakeNxDomainKey(const WireKey &key) {
+  WireKey nx = key;
+  SetWireKeyType(&nx, 0);
+  return nx;
+}
+
+std::string QTypeToString(unsigned short qtype) {
+  if (qtype == DNS_TYPE_A) {
+    return "A";
   }
-  if (!result->response.empty() && cache_) {
-    pthread_mutex_lock(&cache_mutex_);
-    cache_->Put(key, result->response);
-    pthread_mutex_unlock(&cache_mutex_);
+  if (qtype == DNS_TYPE_AAAA) {
+    return "AAAA";
   }
-  return true;
+  if (qtype == DNS_TYPE_CNAME) {
+    return "CNAME";
+  }
+  if (qtype == DNS_TYPE_PTR) {
+    return "PTR";
+  }
+  if (qtype == DNS_TYPE_MX) {
+    return "MX";
+  }
+  if (qtype == DNS_TYPE_TXT) {
+    return "TXT";
+  }
+  std::ostringstream out;
+  out << "TYPE" << qtype;
+  return out.str();
+}
+
+// RRL buckets group answers by client /24, name, type and RCODE, the way a
+// reflection attack repeats them.
+uint64_t ResponseKey(const struct sockaddr_in &client_addr,
+                     const DnsQuestion &question, unsigned int rcode) {
+  uint64_t hash = 14695981039346656037ULL;
+  uint32_t prefix = ntohl(client_addr.sin_addr.s_addr) & 0xffffff00U;
+  unsigned char head[7];
+  head[0] = static_cast<unsigned char>(prefix >> 24);
+  head[1] = static_cast<unsigned char>(prefix >> 16);
+  head[2] = static_cast<unsigned char>(prefix >> 8);
+  head[3] = static_cast<unsigned char>(question.qtype >> 8);
+  head[4] = static_cast<unsigned char>(question.qtype);
+  head[5] = static_cast<unsigned char>(rcode);
+  head[6] = 0;
+  for (size_t i = 0; i < sizeof(head); ++i) {
+    hash = (hash ^ head[i]) * 1099511628211ULL;
+  }
+  for (size_t i = 0; i < question.qname.size(); ++i) {
+    unsigned char c = static_cast<unsigned char>(question.qname[i]);
+    if (c >= 'A' && c <= 'Z') {
+      c = static_cast<unsigned char>(c - 'A' + 'a');
+    }
+    hash = (hash ^ c) * 1099511628211ULL;
+  }
+  return hash;
 }
 
-std::string DnsServer::ResolveClientName(const struct sockaddr_in &client_addr) {
+// Reverse lookup query for the client address, as used for the query log.
+bool BuildPtrQuery(const struct sockaddr_in &client_addr,
+                   std::vector<unsigned char> *query) {
   char addr_buf[INET_ADDRSTRLEN];
   const char *addr_str = inet_ntop(AF_INET, &client_addr.sin_addr, addr_buf,
                                    sizeof(addr_buf));
   if (!addr_str) {
-    return "-";
+    return false;
   }
   std::vector<std::string> parts = Split(addr_str, '.');
   if (parts.size() != 4) {
-    return "-";
+    return false;
   }
   std::ostringstream qname;
   qname << parts[3] << "." << parts[2] << "." << parts[1] << "." << parts[0]
         << ".in-addr.arpa";
-  std::vector<unsigned char> query;
-  query.reserve(64);
+  query->clear();
+  query->reserve(64);
   unsigned short id = 0x4242;
-  query.push_back(static_cast<unsigned char>((id >> 8) & 0xff));
-  query.push_back(static_cast<unsigned char>(id & 0xff));
-  query.push_back(0x01);
-  query.push_back(0x00);
-  query.push_back(0x00);
-  query.push_back(0x01);
-  query.push_back(0x00);
-  query.push_back(0x00);
-  query.push_back(0x00);
-  query.push_back(0x00);
-  query.push_back(0x00);
-  query.push_back(0x00);
+  query->push_back(static_cast<unsigned char>((id >> 8) & 0xff));
+  query->push_back(static_cast<unsigned char>(id & 0xff));
+  query->push_back(0x01);
+  query->push_back(0x00);
+  query->push_back(0x00);
+  query->push_back(0x01);
+  query->push_back(0x00);
+  query->push_back(0x00);
+  query->push_back(0x00);
+  query->push_back(0x00);
+  query->push_back(0x00);
+  query->push_back(0x00);
   std::string name = qname.str();
   size_t start = 0;
   while (start < name.size()) {
@@ -389,93 +316,2236 @@ std::string DnsServer::ResolveClientName(const struct sockaddr_in &client_addr)
       dot = name.size();
     }
     size_t len = dot - start;
-    query.push_back(static_cast<unsigned char>(len));
+    query->push_back(static_cast<unsigned char>(len));
     for (size_t i = 0; i < len; ++i) {
-      query.push_back(static_cast<unsigned char>(name[start + i]));
+      query->push_back(static_cast<unsigned char>(name[start + i]));
     }
     start = dot + 1;
   }
-  query.push_back(0);
-  query.push_back(0x00);
-  query.push_back(static_cast<unsigned char>(DNS_TYPE_PTR));
-  query.push_back(0x00);
-  query.push_back(0x01);
+  query->push_back(0);
+  query->push_back(0x00);
+  query->push_back(static_cast<unsigned char>(DNS_TYPE_PTR));
+  query->push_back(0x00);
+  query->push_back(0x01);
+  return true;
+}
 
-  DnsHeader header;
-  DnsQuestion question;
-  if (!ParseDnsQuery(query, &header, &question)) {
-    return "-";
+// Returns the RCODE for queue_full_policy, or -1 to drop silently.
+int ShedRcode(const std::string &policy) {
+  if (policy == "refused") {
+    return DNS_RCODE_REFUSED;
   }
-  ResolveResult result;
-  if (!ResolveQuery(query, header, question, &result)) {
-    return "-";
+  if (policy == "servfail") {
+    return DNS_RCODE_SERVFAIL;
   }
-  std::string ptr_name;
-  if (!ExtractFirstPtrTarget(result.response, &ptr_name)) {
-    return "-";
+  return -1;
+}
+
+// Fills in the answers for blocked names under block_mode: the null or
+// configured address for A and AAAA in "null" and "ip" mode, and an
+// NXDOMAIN or NODATA carrying an SOA for everything else.
+void MakeBlockTemplates(const ServerConfig &config, ResponseTemplate *a,
+                        ResponseTemplate *aaaa, ResponseTemplate *other) {
+  unsigned int rcode = config.block_mode == "nxdomain" ? DNS_RCODE_NXDOMAIN
+                                                       : DNS_RCODE_NOERROR;
+  MakeNegativeTemplate(rcode, config.block_ttl, other);
+  if (config.block_mode != "null" && config.block_mode != "ip") {
+    *a = *other;
+    *aaaa = *other;
+    return;
   }
-  if (ptr_name.empty()) {
-    return "-";
+  unsigned char ipv4[4];
+  unsigned char ipv6[16];
+  std::memset(ipv4, 0, sizeof(ipv4));
+  std::memset(ipv6, 0, sizeof(ipv6));
+  if (config.block_mode == "ip") {
+    inet_pton(AF_INET, config.block_ipv4.c_str(), ipv4);
+    inet_pton(AF_INET6, config.block_ipv6.c_str(), ipv6);
   }
-  return ptr_name;
+  MakeAddressTemplate(DNS_TYPE_A, ipv4, sizeof(ipv4), config.block_ttl, a);
+  MakeAddressTemplate(DNS_TYPE_AAAA, ipv6, sizeof(ipv6), config.block_ttl,
+                      aaaa);
 }
 
-void DnsServer::StartWorkers() {
-  workers_.clear();
-  for (size_t i = 0; i < worker_count_; ++i) {
-    pthread_t tid;
-    if (pthread_create(&tid, NULL, WorkerEntry, this) == 0) {
-      workers_.push_back(tid);
+// Every listener keeps a full receive batch of buffers parked in its slots;
+// make sure those alone can never drain the pool.
+size_t PoolBufferCount(const ServerConfig &config) {
+  size_t batch = config.udp_batch_size == 0 ? 1 : config.udp_batch_size;
+  size_t listeners = config.listen_shards > 1 ? config.listen_shards : 1;
+  size_t floor = 2 * batch * listeners;
+  return config.packet_pool_buffers > floor ? config.packet_pool_buffers : floor;
+}
+
+// Scaling decisions are taken from samples of the backlog at this interval.
+const uint64_t kScaleIntervalUs = 100000;
+// Grow after this many consecutive samples with more pending jobs than
+// active workers; shrink after this many with less work than workers and
+// more than one of them parked.
+const unsigned int kGrowSamples = 2;
+const unsigned int kShrinkSamples = 50;
+const size_t kMinActiveWorkers = 2;
+// Workers block on upstream round trips, so even a single-core box wants a
+// few of them.
+const size_t kMinAutoWorkers = 4;
+const size_t kMaxAutoWorkers = 64;
+
+// CPUs this process may run on; honours taskset/cpuset limits where the
+// platform exposes them.
+size_t UsableCpuCount() {
+#if defined(__linux__) || defined(__FreeBSD__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) == 0) {
+    int count = CPU_COUNT(&set);
+    if (count > 0) {
+      return static_cast<size_t>(count);
     }
   }
+#endif
+  long online = sysconf(_SC_NPROCESSORS_ONLN);
+  return online > 0 ? static_cast<size_t>(online) : 1;
 }
 
-void DnsServer::StopWorkers() {
-  pthread_mutex_lock(&queue_mutex_);
-  running_ = false;
-  pthread_cond_broadcast(&queue_cv_);
-  pthread_mutex_unlock(&queue_mutex_);
+size_t WorkerCount(const ServerConfig &config) {
+  if (config.worker_threads > 0) {
+    return config.worker_threads;
+  }
+  size_t cpus = UsableCpuCount();
+  if (cpus < kMinAutoWorkers) {
+    return kMinAutoWorkers;
+  }
+  return cpus < kMaxAutoWorkers ? cpus : kMaxAutoWorkers;
+}
+
+// Pins the calling thread to the slot-th CPU it is currently allowed on,
+// wrapping around when there are more threads than CPUs.
+bool PinToCpu(size_t slot) {
+#if defined(__linux__) || defined(__FreeBSD__)
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (pthread_getaffinity_np(pthread_self(), sizeof(allowed), &allowed) != 0) {
+    return false;
+  }
+  int count = CPU_COUNT(&allowed);
+  if (count <= 0) {
+    return false;
+  }
+  size_t target = slot % static_cast<size_t>(count);
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (!CPU_ISSET(cpu, &allowed)) {
+      continue;
+    }
+    if (target-- > 0) {
+      continue;
+    }
+    cpu_set_t one;
+    CPU_ZERO(&one);
+    CPU_SET(cpu, &one);
+    return pthread_setaffinity_np(pthread_self(), sizeof(one), &one) == 0;
+  }
+  return false;
+#else
+  (void)slot;
+  return false;
+#endif
+}
+
+// Absolute CLOCK_REALTIME deadline for pthread_cond_timedwait().
+void DeadlineAfter(unsigned int timeout_ms, struct timespec *out) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  unsigned long usec = static_cast<unsigned long>(now.tv_usec) +
+                       (timeout_ms % 1000) * 1000UL;
+  out->tv_sec = now.tv_sec + timeout_ms / 1000 +
+                static_cast<time_t>(usec / 1000000);
+  out->tv_nsec = static_cast<long>((usec % 1000000) * 1000);
+}
+
+} // namespace
+
+DnsServer::DnsServer(const ServerConfig &config, Blocklist *blocklist,
+                     const LocalRecords &local_records, DnsCache *cache,
+                     const UpstreamResolver &resolver, QueryLogger *logger)
+    : config_(config), blocklist_(blocklist), local_records_(local_records),
+      decisions_(NULL), decision_hits_(0), cache_(cache), resolver_(resolver), logger_(logger), sock_(-1),
+      running_(false), worker_count_(WorkerCount(config)),
+      batch_size_(config.udp_batch_size == 0 ? 1 : config.udp_batch_size),
+      event_backend_(EVENT_BACKEND_AUTO),
+      pool_(PoolBufferCount(config), config.packet_buffer_size),
+      shed_rcode_(ShedRcode(config.queue_full_policy)), next_ring_(0),
+      idle_workers_(0), enqueued_(0), dropped_(0), shed_(0),
+      queue_wait_us_(0), discarded_(0), inline_answers_(0), deferred_(0),
+      tcp_sock_(-1), tcp_loop_(NULL), tcp_started_(false), next_tcp_id_(0),
+      tcp_connections_(0), tcp_queries_(0), client_limiter_(NULL), rrl_(NULL),
+      ratelimited_(0), rrl_dropped_(0), rrl_slipped_(0), active_workers_(0),
+      next_scale_us_(0), busy_samples_(0), quiet_samples_(0),
+      upstream_(NULL), cache_hits_(0), negative_hits_(0), coalesced_(0),
+      prefetch_inflight_(0), prefetches_(0), stale_answers_(0),
+      prefetch_started_(false), prefetch_stop_(false) {
+  // DoT upstreams are still resolved synchronously, ahead of UDP, so the
+  // engine only takes over when there are none.
+  if (config_.upstream_async && resolver_.dot_servers().empty() &&
+      !resolver_.udp_servers().empty()) {
+    upstream_ = new UpstreamEngine(resolver_.udp_servers(),
+                                   config_.upstream_sockets,
+                                   config_.upstream_timeout_ms,
+                                   config_.upstream_max_inflight,
+                                   EVENT_BACKEND_AUTO);
+    if (cache_ && config_.serve_stale_sec > 0) {
+      upstream_->SetLateNotice(config_.stale_answer_timeout_ms);
+    }
+  }
+  if (config_.ratelimit_qps > 0) {
+    client_limiter_ = new RateLimiter(config_.ratelimit_table_size,
+                                      config_.ratelimit_qps,
+                                      config_.ratelimit_burst);
+  }
+  if (config_.rrl_responses_per_sec > 0) {
+    rrl_ = new RateLimiter(config_.ratelimit_table_size,
+                           config_.rrl_responses_per_sec, 0);
+  }
+  EventLoop::ParseBackend(config_.event_backend, &event_backend_);
+  MakeBlockTemplates(config_, &block_a_, &block_aaaa_, &block_other_);
+  if (config_.decision_cache_size > 0) {
+    decisions_ = new DecisionCache(config_.decision_cache_size);
+  }
+  pthread_mutex_init(&park_mutex_, NULL);
+  pthread_cond_init(&park_cv_, NULL);
+  pthread_cond_init(&standby_cv_, NULL);
+  pthread_mutex_init(&scale_mutex_, NULL);
+  pthread_mutex_init(&tcp_mutex_, NULL);
+  pthread_mutex_init(&flight_mutex_, NULL);
+  pthread_cond_init(&flight_cv_, NULL);
+  pthread_mutex_init(&prefetch_mutex_, NULL);
+  pthread_cond_init(&prefetch_cv_, NULL);
+  workers_.resize(worker_count_);
+  // queue_capacity is split evenly; JobRing rounds each share up to a power
+  // of two.
+  size_t ring_capacity =
+      (config_.queue_capacity + worker_count_ - 1) / worker_count_;
   for (size_t i = 0; i < workers_.size(); ++i) {
-    pthread_join(workers_[i], NULL);
+    Worker &worker = workers_[i];
+    worker.server = this;
+    worker.index = i;
+    worker.started = false;
+    worker.steals = 0;
+    worker.held = 0;
+    worker.ring = new JobRing<Job>(ring_capacity);
   }
-  workers_.clear();
+  // With autoscaling the extra workers start on standby and are brought in
+  // as the backlog demands.
+  active_workers_ = worker_count_;
+  if (config_.worker_autoscale && worker_count_ > kMinActiveWorkers) {
+    active_workers_ = kMinActiveWorkers;
+  }
+}
+
+DnsServer::~DnsServer() {
+  StopTcp();
+  StopWorkers();
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    delete workers_[i].ring;
+  }
+  StopUpstream();
+  delete upstream_;
+  delete client_limiter_;
+  delete rrl_;
+  delete decisions_;
+  pthread_mutex_destroy(&park_mutex_);
+  pthread_cond_destroy(&park_cv_);
+  pthread_cond_destroy(&standby_cv_);
+  pthread_mutex_destroy(&scale_mutex_);
+  pthread_mutex_destroy(&tcp_mutex_);
+  pthread_mutex_destroy(&flight_mutex_);
+  pthread_cond_destroy(&flight_cv_);
+  pthread_mutex_destroy(&prefetch_mutex_);
+  pthread_cond_destroy(&prefetch_cv_);
 }
 
-void DnsServer::Enqueue(const Job &job) {
-  pthread_mutex_lock(&queue_mutex_);
-  queue_.push_back(job);
-  pthread_cond_signal(&queue_cv_);
-  pthread_mutex_unlock(&queue_mutex_);
+void DnsServer::Job::Swap(Job &other) {
+  std::swap(packet, other.packet);
+  std::swap(client_addr, other.client_addr);
+  std::swap(client_len, other.client_len);
+  std::swap(tcp_conn, other.tcp_conn);
+  std::swap(queued_at, other.queued_at);
 }
 
-bool DnsServer::Dequeue(Job *job) {
-  pthread_mutex_lock(&queue_mutex_);
-  while (queue_.empty() && running_) {
-    pthread_cond_wait(&queue_cv_, &queue_mutex_);
+DnsServer::Stats DnsServer::GetStats() const {
+  Stats stats;
+  stats.queue_depth = QueueDepth();
+  stats.workers_active = AtomicLoadRelaxed(&active_workers_);
+  stats.enqueued = AtomicLoadRelaxed(&enqueued_);
+  stats.dropped = AtomicLoadRelaxed(&dropped_);
+  stats.shed = AtomicLoadRelaxed(&shed_);
+  stats.queue_wait_ms = AtomicLoadRelaxed(&queue_wait_us_) / 1000;
+  stats.steals = 0;
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    stats.steals += AtomicLoadRelaxed(&workers_[i].steals);
   }
-  if (!running_ && queue_.empty()) {
-    pthread_mutex_unlock(&queue_mutex_);
-    return false;
+  stats.buffers_in_use = pool_.in_use();
+  stats.buffers_high_water = pool_.high_water();
+  stats.buffers_exhausted = pool_.exhausted();
+  stats.buffers_discarded = AtomicLoadRelaxed(&discarded_);
+  stats.tcp_connections = AtomicLoadRelaxed(&tcp_connections_);
+  stats.tcp_queries = AtomicLoadRelaxed(&tcp_queries_);
+  stats.upstream_inflight = upstream_ ? upstream_->inflight() : 0;
+  stats.upstream_timeouts = upstream_ ? upstream_->timeouts() : 0;
+  stats.cache_bytes = 0;
+  stats.cache_fragmentation_pct = 0;
+  stats.cache_rejected = cache_ ? cache_->rejected() : 0;
+  if (cache_) {
+    CacheMemoryStats memory;
+    cache_->GetMemoryStats(&memory);
+    stats.cache_bytes =
+        memory.slab_bytes + memory.oversize_bytes + memory.overhead_bytes +
+        memory.policy_bytes;
+    size_t in_slabs = memory.payload_bytes - memory.oversize_bytes;
+    if (memory.slab_bytes > 0) {
+      stats.cache_fragmentation_pct = static_cast<unsigned int>(
+          (memory.slab_bytes - in_slabs) * 100 / memory.slab_bytes);
+    }
   }
-  *job = queue_.front();
-  queue_.pop_front();
-  pthread_mutex_unlock(&queue_mutex_);
-  return true;
+  stats.decision_hits = AtomicLoadRelaxed(&decision_hits_);
+  stats.cache_hits = AtomicLoadRelaxed(&cache_hits_);
+  stats.negative_hits = AtomicLoadRelaxed(&negative_hits_);
+  stats.coalesced = AtomicLoadRelaxed(&coalesced_);
+  stats.prefetches = AtomicLoadRelaxed(&prefetches_);
+  stats.stale_answers = AtomicLoadRelaxed(&stale_answers_);
+  stats.ratelimited = AtomicLoadRelaxed(&ratelimited_);
+  stats.rrl_dropped = AtomicLoadRelaxed(&rrl_dropped_);
+  stats.rrl_slipped = AtomicLoadRelaxed(&rrl_slipped_);
+  stats.inline_answers = AtomicLoadRelaxed(&inline_answers_);
+  stats.deferred = AtomicLoadRelaxed(&deferred_);
+  return stats;
 }
 
-void *DnsServer::WorkerEntry(void *arg) {
-  DnsServer *server = static_cast<DnsServer *>(arg);
-  server->WorkerLoop();
-  return NULL;
+void DnsServer::LogStats() const {
+  Stats stats = GetStats();
+  std::ostringstream out;
+  out << "Stats: workers=" << stats.workers_active << "/" << workers_.size()
+      << " queue_depth=" << stats.queue_depth
+      << " enqueued=" << stats.enqueued << " dropped=" << stats.dropped
+      << " shed=" << stats.shed << " queue_wait_ms=" << stats.queue_wait_ms
+      << " steals=" << stats.steals << " buffers_in_use=" << stats.buffers_in_use
+      << "/" << pool_.count() << " buffers_high_water=" << stats.buffers_high_water
+      << " buffers_exhausted=" << stats.buffers_exhausted
+      << " discarded=" << stats.buffers_discarded
+      << " tcp_connections=" << stats.tcp_connections
+      << " tcp_queries=" << stats.tcp_queries
+      << " inline=" << stats.inline_answers << " deferred=" << stats.deferred
+      << " upstream_inflight=" << stats.upstream_inflight
+      << " upstream_timeouts=" << stats.upstream_timeouts
+      << " cache_bytes=" << stats.cache_bytes << "/"
+      << (cache_ ? cache_->max_bytes() : 0)
+      << " cache_fragmentation=" << stats.cache_fragmentation_pct << "%"
+      << " cache_rejected=" << stats.cache_rejected
+      << " decision_hits=" << stats.decision_hits
+      << " cache_hits=" << stats.cache_hits
+      << " negative_hits=" << stats.negative_hits
+      << " coalesced=" << stats.coalesced
+      << " prefetches=" << stats.prefetches
+      << " stale=" << stats.stale_answers
+      << " ratelimited=" << stats.ratelimited
+      << " rrl_dropped=" << stats.rrl_dropped
+      << " rrl_slipped=" << stats.rrl_slipped;
+  LogInfo(out.str());
 }
 
-void DnsServer::WorkerLoop() {
-  for (;;) {
-    Job job;
-    if (!Dequeue(&job)) {
-      break;
+bool DnsServer::Run() {
+  size_t shard_count = config_.listen_shards;
+  if (shard_count > 1 && !ReusePortSupported()) {
+    LogWarn("listen_shards requires SO_REUSEPORT load balancing; "
+            "falling back to a single listener");
+    shard_count = 0;
+  }
+  if (shard_count > 1) {
+    return RunSharded(shard_count);
+  }
+
+  int sock = OpenUdpSocket(config_.listen_addr, config_.listen_port, false);
+  if (sock < 0) {
+    return false;
+  }
+
+  EventLoop loop(event_backend_);
+  if (!InstallSignalHandlers() || !loop.ok() ||
+      !loop.Add(sock, EVENT_READ) ||
+      !loop.Add(g_shutdown_pipe[0], EVENT_READ)) {
+    close(sock);
+    return false;
+  }
+
+  sock_ = sock;
+  running_ = true;
+  {
+    std::ostringstream out;
+    out << "Listening on " << config_.listen_addr << ":" << config_.listen_port
+        << " (" << EventLoop::BackendName(loop.backend()) << ")";
+    DebugLog(out.str());
+  }
+  StartUpstream();
+  StartWorkers();
+  {
+    std::ostringstream out;
+    out << "Worker threads started: " << workers_.size() << " ("
+        << AtomicLoadRelaxed(&active_workers_) << " active)";
+    DebugLog(out.str());
+  }
+  StartTcp();
+
+  UdpRecvBatch batch(batch_size_, &pool_);
+  UdpSendBatch replies(batch_size_, &pool_);
+  QueryScratch scratch;
+  std::vector<Job> jobs(batch_size_);
+  std::vector<LoopEvent> events;
+  StatsTimer stats_timer(config_.stats_interval_sec);
+  while (AtomicLoadRelaxed(&g_running)) {
+    if (loop.Wait(stats_timer.TimeoutMs(), &events) < 0) {
+      DebugLog(std::string("event loop wait failed: ") + std::strerror(errno));
+      continue;
+    }
+    if (stats_timer.Due()) {
+      LogStats();
+    }
+    if (!HasReadEvent(events, sock)) {
+      continue;
+    }
+    for (;;) {
+      int received = batch.Receive(sock);
+      if (received <= 0) {
+        break;
+      }
+      // Under overload cheap answers are served here even when inline
+      // answering is off, so shedding only ever hits upstream-bound work.
+      bool try_inline = config_.inline_answers || Overloaded();
+      uint64_t now = MonotonicMicros();
+      size_t deferred = 0;
+      for (int i = 0; i < received; ++i) {
+        PacketBuffer *packet = batch.Take(i);
+        LogReceived(batch.addr(i), packet->len);
+        if (!AdmitClient(batch.addr(i), now)) {
+          pool_.Release(packet);
+          continue;
+        }
+        if (try_inline &&
+            AnswerInline(sock, packet, batch.addr(i), batch.addr_len(i),
+                         &replies, &scratch)) {
+          AtomicFetchAddRelaxed(&inline_answers_, 1UL);
+          continue;
+        }
+        Job &job = jobs[deferred++];
+        job.packet = packet;
+        job.client_addr = batch.addr(i);
+        job.client_len = batch.addr_len(i);
+        job.tcp_conn = 0;
+      }
+      if (try_inline) {
+        AtomicFetchAddRelaxed(&deferred_, static_cast<unsigned long>(deferred));
+      }
+      EnqueueBatch(&jobs, deferred, &replies);
+      replies.Flush(sock);
+      if (static_cast<size_t>(received) < batch.capacity()) {
+        break;
+      }
+    }
+  }
+
+  StopTcp();
+  StopWorkers();
+  StopUpstream();
+  AtomicFetchAddRelaxed(&discarded_, batch.discarded());
+  LogStats();
+  close(sock);
+  sock_ = -1;
+  return true;
+}
+
+bool DnsServer::RunSharded(size_t shard_count) {
+  shards_.clear();
+  shards_.reserve(shard_count);
+  for (size_t i = 0; i < shard_count; ++i) {
+    int sock = OpenUdpSocket(config_.listen_addr, config_.listen_port, true);
+    if (sock < 0) {
+      for (size_t j = 0; j < shards_.size(); ++j) {
+        close(shards_[j].sock);
+      }
+      shards_.clear();
+      return false;
+    }
+    Shard shard;
+    shard.server = this;
+    shard.sock = sock;
+    shards_.push_back(shard);
+  }
+
+  EventLoop loop(event_backend_);
+  if (!InstallSignalHandlers() || !loop.ok() ||
+      !loop.Add(g_shutdown_pipe[0], EVENT_READ)) {
+    for (size_t j = 0; j < shards_.size(); ++j) {
+      close(shards_[j].sock);
+    }
+    shards_.clear();
+    return false;
+  }
+
+  running_ = true;
+  {
+    std::ostringstream out;
+    out << "Listening on " << config_.listen_addr << ":" << config_.listen_port
+        << " with " << shard_count << " SO_REUSEPORT shards";
+    DebugLog(out.str());
+  }
+  StartUpstream();
+  size_t started = 0;
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    if (pthread_create(&shards_[i].thread, NULL, ShardEntry, &shards_[i]) ==
+        0) {
+      shards_[i].started = true;
+      ++started;
+    } else {
+      shards_[i].started = false;
+    }
+  }
+  {
+    std::ostringstream out;
+    out << "Shard threads started: " << started;
+    DebugLog(out.str());
+  }
+  if (config_.tcp_listen) {
+    // Shards answer UDP inline; TCP queries still go through the workers.
+    StartWorkers();
+    StartTcp();
+  }
+
+  std::vector<LoopEvent> events;
+  StatsTimer stats_timer(config_.stats_interval_sec);
+  while (AtomicLoadRelaxed(&g_running)) {
+    loop.Wait(stats_timer.TimeoutMs(), &events);
+    if (stats_timer.Due()) {
+      LogStats();
+    }
+  }
+
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    if (shards_[i].started) {
+      pthread_join(shards_[i].thread, NULL);
+    }
+  }
+  StopTcp();
+  StopWorkers();
+  // Completions may still be answering on the shard sockets.
+  StopUpstream();
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    close(shards_[i].sock);
+  }
+  shards_.clear();
+  LogStats();
+  return true;
+}
+
+void *DnsServer::ShardEntry(void *arg) {
+  Shard *shard = static_cast<Shard *>(arg);
+  shard->server->ShardLoop(shard->sock);
+  return NULL;
+}
+
+void DnsServer::ShardLoop(int sock) {
+  EventLoop loop(event_backend_);
+  if (!loop.ok() || !loop.Add(sock, EVENT_READ) ||
+      !loop.Add(g_shutdown_pipe[0], EVENT_READ)) {
+    LogError("Shard event loop setup failed");
+    return;
+  }
+  UdpRecvBatch batch(batch_size_, &pool_);
+  UdpSendBatch replies(batch_size_, &pool_);
+  QueryScratch scratch;
+  std::vector<LoopEvent> events;
+  while (AtomicLoadRelaxed(&g_running)) {
+    if (loop.Wait(-1, &events) < 0) {
+      DebugLog(std::string("event loop wait failed: ") + std::strerror(errno));
+      continue;
+    }
+    if (!HasReadEvent(events, sock)) {
+      continue;
+    }
+    for (;;) {
+      int received = batch.Receive(sock);
+      if (received <= 0) {
+        break;
+      }
+      uint64_t now = MonotonicMicros();
+      for (int i = 0; i < received; ++i) {
+        PacketBuffer *packet = batch.Take(i);
+        LogReceived(batch.addr(i), packet->len);
+        if (!AdmitClient(batch.addr(i), now)) {
+          pool_.Release(packet);
+          continue;
+        }
+        HandleQuery(sock, packet, batch.addr(i), batch.addr_len(i), &replies,
+                    &scratch);
+      }
+      replies.Flush(sock);
+      if (static_cast<size_t>(received) < batch.capacity()) {
+        break;
+      }
+    }
+  }
+  AtomicFetchAddRelaxed(&discarded_, batch.discarded());
+}
+
+// Answers from the blocklist, local records and the cache. Returns false
+// with the source left at RESOLVE_UPSTREAM when the query needs an upstream;
+// AnswerMiss() then finishes it.
+bool DnsServer::AnswerQuery(const PacketBuffer &packet, QueryScratch *scratch) {
+  scratch->result.source = RESOLVE_NONE;
+  if (!ParseDnsQuery(packet.data, packet.len, &scratch->header,
+                     &scratch->question)) {
+    DebugLog("Failed to parse DNS query");
+    return false;
+  }
+  if (DebugEnabled()) {
+    std::ostringstream out;
+    out << "Query: " << scratch->question.qname << " "
+        << QTypeToString(scratch->question.qtype);
+    DebugLog(out.str());
+  }
+  if (!ResolveQuery(packet.data, packet.len, scratch->header,
+                    scratch->question, &scratch->result, false)) {
+    return false;
+  }
+  CountAnswer(scratch);
+  return true;
+}
+
+// Resolves a query AnswerQuery() left to an upstream, blocking on the
+// lookup, without repeating the blocklist and cache lookups.
+void DnsServer::AnswerMiss(const PacketBuffer &packet, QueryScratch *scratch) {
+  ResolveMiss(packet.data, packet.len, scratch->header, scratch->question,
+              &scratch->result);
+  CountAnswer(scratch);
+}
+
+void DnsServer::CountAnswer(QueryScratch *scratch) {
+  ResolveResult &result = scratch->result;
+  if (!result.response.empty() &&
+      (result.source == RESOLVE_CACHE || result.source == RESOLVE_STALE)) {
+    PatchResponseId(&result.response, scratch->header.id);
+  }
+  if (result.source == RESOLVE_STALE) {
+    AtomicFetchAddRelaxed(&stale_answers_, 1UL);
+  } else if (result.source == RESOLVE_CACHE) {
+    AtomicFetchAddRelaxed(IsNegativeResponse(result.response, NULL)
+                              ? &negative_hits_
+                              : &cache_hits_,
+                          1UL);
+  }
+}
+
+void DnsServer::LogQuery(const struct sockaddr_in &client_addr,
+                         const QueryScratch &scratch,
+                         const std::string *known_name) {
+  if (!logger_) {
+    return;
+  }
+  const DnsQuestion &question = scratch.question;
+  const ResolveResult &result = scratch.result;
+  char addr_buf[INET_ADDRSTRLEN];
+  const char *addr_str = inet_ntop(AF_INET, &client_addr.sin_addr, addr_buf,
+                                   sizeof(addr_buf));
+  std::string client_ip = addr_str ? addr_str : "unknown";
+  std::string client_name;
+  if (known_name) {
+    client_name = *known_name;
+  } else {
+    ResolveClientName(client_addr, true, &client_name);
+  }
+  std::string qtype = QTypeToString(question.qtype);
+  if (result.source == RESOLVE_BLOCKLIST) {
+    logger_->LogBlock(client_ip, client_name, question.qname, qtype);
+  } else {
+    std::string resolved_by;
+    if (result.source == RESOLVE_LOCAL) {
+      resolved_by = "local";
+    } else if (result.source == RESOLVE_CACHE) {
+      resolved_by = "cache";
+    } else if (result.source == RESOLVE_STALE) {
+      resolved_by = "stale";
+    } else {
+      resolved_by = "external";
+    }
+    logger_->LogPass(client_ip, client_name, question.qname, qtype,
+                     resolved_by, result.upstream);
+  }
+}
+
+bool DnsServer::HandleQuery(int sock, PacketBuffer *packet,
+                            const struct sockaddr_in &client_addr,
+                            socklen_t client_len, UdpSendBatch *replies,
+                            QueryScratch *scratch) {
+  bool answered = AnswerQuery(*packet, scratch);
+  if (!answered && scratch->result.source == RESOLVE_UPSTREAM) {
+    if (ForwardQuery(*packet, client_addr, client_len, sock, 0, *scratch)) {
+      pool_.Release(packet);
+      return true;
+    }
+    // The lookup can block for a whole upstream timeout; answers batched
+    // earlier must not wait on it.
+    if (replies) {
+      replies->Flush(sock);
+    }
+    AnswerMiss(*packet, scratch);
+    answered = true;
+  }
+  if (!answered) {
+    pool_.Release(packet);
+    return false;
+  }
+  SendUdpAnswer(sock, packet, client_addr, client_len, replies, *scratch);
+  if (!logger_ || upstream_) {
+    LogAnswered(client_addr, *scratch);
+    return true;
+  }
+  // Without the async engine an unknown client name is looked up inline,
+  // which blocks the same way.
+  std::string client_name;
+  bool named = ResolveClientName(client_addr, false, &client_name);
+  if (!named && replies) {
+    replies->Flush(sock);
+  }
+  LogQuery(client_addr, *scratch, named ? &client_name : NULL);
+  return true;
+}
+
+// Answers blocklist, local and cache hits on the calling thread. Returns
+// false, with `packet` still owned by the caller, when the query needs an
+// upstream round trip (for the answer or for the client name in the query
+// log) and should go to a worker instead. Malformed queries are deferred
+// too; the worker logs and drops them.
+bool DnsServer::AnswerInline(int sock, PacketBuffer *packet,
+                             const struct sockaddr_in &client_addr,
+                             socklen_t client_len, UdpSendBatch *replies,
+                             QueryScratch *scratch) {
+  // Without the async engine only a worker may block on the client name.
+  // That is settled before answering, so a deferred query is looked up and
+  // counted once, by the worker.
+  std::string client_name;
+  bool named = !logger_ || ResolveClientName(client_addr, false, &client_name);
+  if (!named && !upstream_) {
+    return false;
+  }
+  if (!AnswerQuery(*packet, scratch)) {
+    return false;
+  }
+  SendUdpAnswer(sock, packet, client_addr, client_len, replies, *scratch);
+  if (named) {
+    LogQuery(client_addr, *scratch, &client_name);
+  } else {
+    LogAnswered(client_addr, *scratch);
+  }
+  return true;
+}
+
+// Always consumes `packet`.
+void DnsServer::SendUdpAnswer(int sock, PacketBuffer *packet,
+                              const struct sockaddr_in &client_addr,
+                              socklen_t client_len, UdpSendBatch *replies,
+                              const QueryScratch &scratch) {
+  const ResolveResult &result = scratch.result;
+  if (!result.response.empty() && rrl_) {
+    unsigned int rcode = result.response.size() > 3
+                             ? (result.response[3] & 0x0f)
+                             : DNS_RCODE_NOERROR;
+    unsigned long limited = 0;
+    if (!rrl_->Allow(ResponseKey(client_addr, scratch.question, rcode),
+                     MonotonicMicros(), &limited)) {
+      // Every rrl_slip-th refused answer goes out truncated instead, so a
+      // real client behind a spoofed flood can still get through over TCP.
+      if (config_.rrl_slip > 0 && limited % config_.rrl_slip == 0 &&
+          RewriteAsTruncatedResponse(packet->data, &packet->len, rcode)) {
+        AtomicFetchAddRelaxed(&rrl_slipped_, 1UL);
+        SendPacket(sock, packet, client_addr, client_len, replies);
+      } else {
+        AtomicFetchAddRelaxed(&rrl_dropped_, 1UL);
+        pool_.Release(packet);
+      }
+      return;
+    }
+  }
+  if (!result.response.empty()) {
+    if (result.response.size() <= packet->cap && replies) {
+      // The query is no longer needed; write the answer over it and let the
+      // send batch return the buffer to the pool after sendmmsg().
+      std::memcpy(packet->data, &result.response[0], result.response.size());
+      packet->len = result.response.size();
+      if (replies->full()) {
+        replies->Flush(sock);
+      }
+      replies->Add(packet, client_addr, client_len);
+      packet = NULL;
+    } else {
+      sendto(sock, &result.response[0], result.response.size(), 0,
+             reinterpret_cast<const struct sockaddr *>(&client_addr),
+             client_len);
+    }
+  }
+  pool_.Release(packet);
+}
+
+void DnsServer::HandleTcpQuery(Job *job, QueryScratch *scratch) {
+  bool answered = AnswerQuery(*job->packet, scratch);
+  if (!answered && scratch->result.source == RESOLVE_UPSTREAM) {
+    if (ForwardQuery(*job->packet, job->client_addr, job->client_len, -1,
+                     job->tcp_conn, *scratch)) {
+      pool_.Release(job->packet);
+      job->packet = NULL;
+      return;
+    }
+    AnswerMiss(*job->packet, scratch);
+    answered = true;
+  }
+  pool_.Release(job->packet);
+  job->packet = NULL;
+  std::vector<unsigned char> message;
+  if (answered) {
+    message = scratch->result.response;
+  }
+  PostTcpReply(job->tcp_conn, &message);
+  if (answered) {
+    LogAnswered(job->client_addr, *scratch);
+  }
+}
+
+// Hands a query that needs an upstream to the async engine; the answer is
+// delivered from UpstreamDone. Returns false when there is no engine or it
+// is shutting down, leaving the query to the caller.
+bool DnsServer::ForwardQuery(const PacketBuffer &packet,
+                             const struct sockaddr_in &client_addr,
+                             socklen_t client_len, int sock,
+                             unsigned long tcp_conn,
+                             const QueryScratch &scratch) {
+  if (!upstream_) {
+    return false;
+  }
+  PendingQuery *pending = new PendingQuery();
+  pending->server = this;
+  pending->client_addr = client_addr;
+  pending->client_len = client_len;
+  pending->sock = sock;
+  pending->tcp_conn = tcp_conn;
+  pending->log_only = false;
+  pending->prefetch = false;
+  pending->answered = false;
+  pending->key = scratch.question.key;
+  pending->scratch.header = scratch.header;
+  pending->scratch.question = scratch.question;
+  return SubmitPending(pending, packet.data, packet.len);
+}
+
+// Logs an answered query. Without the async engine the client's PTR name is
+// resolved inline as before; with it, a name that is not cached yet is
+// looked up in the background and the line is written when it arrives.
+void DnsServer::LogAnswered(const struct sockaddr_in &client_addr,
+                            const QueryScratch &scratch) {
+  if (!logger_) {
+    return;
+  }
+  std::string client_name;
+  if (!upstream_ || ResolveClientName(client_addr, false, &client_name)) {
+    LogQuery(client_addr, scratch, upstream_ ? &client_name : NULL);
+    return;
+  }
+  std::vector<unsigned char> query;
+  DnsHeader header;
+  DnsQuestion question;
+  if (!BuildPtrQuery(client_addr, &query) ||
+      !ParseDnsQuery(query, &header, &question)) {
+    LogQuery(client_addr, scratch, &client_name);
+    return;
+  }
+  PendingQuery *pending = new PendingQuery();
+  pending->server = this;
+  pending->client_addr = client_addr;
+  pending->client_len = sizeof(client_addr);
+  pending->sock = -1;
+  pending->tcp_conn = 0;
+  pending->log_only = true;
+  pending->prefetch = false;
+  pending->answered = false;
+  pending->key = question.key;
+  pending->scratch = scratch;
+  if (!SubmitPending(pending, &query[0], query.size())) {
+    LogQuery(client_addr, scratch, &client_name);
+  }
+}
+
+// Sends `pending` upstream, or parks it behind a lookup already in flight
+// for the same key. On failure `pending` has been deleted.
+bool DnsServer::SubmitPending(PendingQuery *pending,
+                              const unsigned char *query, size_t len) {
+  bool late = false;
+  if (AttachToFlight(pending, &late)) {
+    return true;
+  }
+  if (late) {
+    // The lookup already overran the stale deadline; don't queue behind it.
+    ResolveResult stale;
+    if (LookupStale(pending->key, &stale)) {
+      CompletePending(pending, stale);
+      delete pending;
+      return true;
+    }
+    if (AttachToFlight(pending, NULL)) {
+      return true;
+    }
+  }
+  if (upstream_->Submit(query, len, UpstreamDone, pending)) {
+    return true;
+  }
+  DropFlight(pending->key);
+  delete pending;
+  return false;
+}
+
+void DnsServer::UpstreamDone(void *ctx, UpstreamStatus status,
+                             const unsigned char *response, size_t len,
+                             const std::string &server) {
+  PendingQuery *pending = static_cast<PendingQuery *>(ctx);
+  DnsServer *self = pending->server;
+  if (status == UPSTREAM_LATE) {
+    self->ServeLate(pending);
+    return;
+  }
+  if (status == UPSTREAM_CANCELLED) {
+    self->DropFlight(pending->key);
+  } else {
+    self->FinishUpstream(pending, status == UPSTREAM_OK, response, len,
+                         server);
+  }
+  if (pending->prefetch) {
+    self->ReleaseRefresh();
+  }
+  delete pending;
+}
+
+// Runs on the engine thread, so it must never block: answers go out with
+// sendto() or through the TCP reply list.
+void DnsServer::FinishUpstream(PendingQuery *pending, bool ok,
+                               const unsigned char *response, size_t len,
+                               const std::string &server) {
+  DnsHeader header = pending->scratch.header;
+  DnsQuestion question = pending->scratch.question;
+  bool parsed = true;
+  if (pending->log_only) {
+    // The scratch describes the client's own query; what went upstream was
+    // the PTR lookup for its address.
+    std::vector<unsigned char> query;
+    parsed = BuildPtrQuery(pending->client_addr, &query) &&
+             ParseDnsQuery(query, &header, &question);
+  }
+  ResolveResult result;
+  result.source = RESOLVE_UPSTREAM;
+  result.upstream = server;
+  bool fresh = true;
+  if (ok) {
+    DebugLog("Upstream resolution success");
+    result.response.assign(response, response + len);
+  } else {
+    DebugLog("Upstream resolution failed");
+    // A failed refresh leaves the cached answer alone.
+    if (LookupStale(pending->key, &result)) {
+      fresh = false;
+    } else if (!pending->log_only && !pending->prefetch) {
+      result.response = BuildEmptyResponse(header, question);
+    }
+  }
+  if (parsed && fresh) {
+    StoreUpstreamAnswer(header, question, &result);
+  }
+  if (!pending->answered) {
+    CompletePending(pending, result);
+  }
+  FinishFlight(pending->key, result);
+}
+
+// The lookup behind `pending` overran stale_answer_timeout_ms. If there is a
+// stale answer, everyone waiting on it gets that now; the lookup carries on
+// and refreshes the cache when it lands.
+void DnsServer::ServeLate(PendingQuery *pending) {
+  ResolveResult stale;
+  if (!LookupStale(pending->key, &stale)) {
+    return;
+  }
+  DebugLog("Upstream slow; answering from the stale cache");
+  std::vector<PendingQuery *> waiters;
+  pthread_mutex_lock(&flight_mutex_);
+  std::map<std::string, Flight *>::iterator it = flights_.find(pending->key.bytes);
+  if (it != flights_.end()) {
+    it->second->late = true;
+    waiters.swap(it->second->waiters);
+  }
+  pthread_mutex_unlock(&flight_mutex_);
+  CompletePending(pending, stale);
+  pending->answered = true;
+  for (size_t i = 0; i < waiters.size(); ++i) {
+    CompletePending(waiters[i], stale);
+    delete waiters[i];
+  }
+}
+
+// Copies the stale entry for `key`, if serve-stale is on and there is one,
+// with its TTLs cut to stale_answer_ttl. A stale NXDOMAIN for the name
+// answers every type, as a fresh one does.
+bool DnsServer::LookupStale(const WireKey &key, ResolveResult *result) {
+  if (!cache_ || config_.serve_stale_sec == 0) {
+    return false;
+  }
+  bool found = cache_->GetStale(key, config_.stale_answer_ttl,
+                                &result->response);
+  if (!found && cache_->GetStale(MakeNxDomainKey(key),
+                                 config_.stale_answer_ttl,
+                                 &result->response)) {
+    found = SetQuestionType(&result->response, WireKeyType(key));
+  }
+  if (!found) {
+    return false;
+  }
+  result->source = RESOLVE_STALE;
+  result->upstream.clear();
+  return true;
+}
+
+// Delivers an upstream answer to one query that was waiting for it, under
+// that query's own ID.
+void DnsServer::CompletePending(PendingQuery *pending,
+                                const ResolveResult &result) {
+  if (pending->prefetch) {
+    return;
+  }
+  if (pending->log_only) {
+    std::string client_name = "-";
+    std::string ptr_name;
+    if (ExtractFirstPtrTarget(result.response, &ptr_name) &&
+        !ptr_name.empty()) {
+      client_name = ptr_name;
+    }
+    LogQuery(pending->client_addr, pending->scratch, &client_name);
+    return;
+  }
+  QueryScratch &scratch = pending->scratch;
+  scratch.result = result;
+  if (result.source == RESOLVE_STALE) {
+    AtomicFetchAddRelaxed(&stale_answers_, 1UL);
+  }
+  if (scratch.result.response.empty()) {
+    scratch.result.response =
+        BuildEmptyResponse(scratch.header, scratch.question);
+  } else {
+    PatchResponseId(&scratch.result.response, scratch.header.id);
+  }
+  const std::vector<unsigned char> &message = scratch.result.response;
+  if (pending->tcp_conn != 0) {
+    std::vector<unsigned char> copy = message;
+    PostTcpReply(pending->tcp_conn, &copy);
+  } else {
+    // SendUdpAnswer wants the message in a pool buffer (RRL truncates it in
+    // place); the answer carries the question, so it serves as well as the
+    // query would.
+    PacketBuffer *packet = pool_.Acquire();
+    if (!packet || message.size() > packet->cap) {
+      pool_.Release(packet);
+      sendto(pending->sock, &message[0], message.size(), 0,
+             reinterpret_cast<const struct sockaddr *>(&pending->client_addr),
+             pending->client_len);
+    } else {
+      std::memcpy(packet->data, &message[0], message.size());
+      packet->len = message.size();
+      SendUdpAnswer(pending->sock, packet, pending->client_addr,
+                    pending->client_len, NULL, scratch);
+    }
+  }
+  LogAnswered(pending->client_addr, scratch);
+}
+
+// Returns true when a lookup for pending->key is already in flight and
+// `pending` has been queued behind it. Otherwise records a new flight that
+// the caller now leads. With `late` set, a flight that already overran the
+// stale deadline is neither joined nor replaced; *late reports it.
+bool DnsServer::AttachToFlight(PendingQuery *pending, bool *late) {
+  pthread_mutex_lock(&flight_mutex_);
+  std::map<std::string, Flight *>::iterator it = flights_.find(pending->key.bytes);
+  if (it != flights_.end() && late && it->second->late) {
+    pthread_mutex_unlock(&flight_mutex_);
+    *late = true;
+    return false;
+  }
+  if (it != flights_.end()) {
+    it->second->waiters.push_back(pending);
+    pthread_mutex_unlock(&flight_mutex_);
+    AtomicFetchAddRelaxed(&coalesced_, 1UL);
+    return true;
+  }
+  flights_[pending->key.bytes] = new Flight();
+  pthread_mutex_unlock(&flight_mutex_);
+  return false;
+}
+
+// Blocking counterpart of AttachToFlight for the synchronous resolvers:
+// waits out a lookup already in flight for `key`, for at most `timeout_ms`
+// when that is non-zero, and copies its answer. On FLIGHT_LEAD the caller
+// resolves the key itself and must land the flight when done.
+DnsServer::FlightWait DnsServer::WaitForFlight(const WireKey &key,
+                                               unsigned int timeout_ms,
+                                               ResolveResult *result) {
+  struct timespec deadline;
+  if (timeout_ms > 0) {
+    DeadlineAfter(timeout_ms, &deadline);
+  }
+  pthread_mutex_lock(&flight_mutex_);
+  for (;;) {
+    std::map<std::string, Flight *>::iterator it = flights_.find(key.bytes);
+    if (it == flights_.end()) {
+      flights_[key.bytes] = new Flight();
+      pthread_mutex_unlock(&flight_mutex_);
+      return FLIGHT_LEAD;
+    }
+    Flight *flight = it->second;
+    ++flight->blocked;
+    FlightWait wait =
+        AwaitFlight(flight, timeout_ms > 0 ? &deadline : NULL, result);
+    // A dropped flight has no answer; go around and take the lead.
+    if (wait != FLIGHT_LEAD) {
+      pthread_mutex_unlock(&flight_mutex_);
+      if (wait == FLIGHT_ANSWERED) {
+        AtomicFetchAddRelaxed(&coalesced_, 1UL);
+      }
+      return wait;
+    }
+  }
+}
+
+// Waits, with flight_mutex_ held and this thread already counted in
+// `blocked`, until `flight` lands or `deadline` passes. FLIGHT_LEAD means it
+// landed without an answer.
+DnsServer::FlightWait DnsServer::AwaitFlight(Flight *flight,
+                                             const struct timespec *deadline,
+                                             ResolveResult *result) {
+  while (!flight->done) {
+    if (!deadline) {
+      pthread_cond_wait(&flight_cv_, &flight_mutex_);
+    } else if (pthread_cond_timedwait(&flight_cv_, &flight_mutex_, deadline) ==
+               ETIMEDOUT) {
+      break;
+    }
+  }
+  --flight->blocked;
+  if (!flight->done) {
+    return FLIGHT_EXPIRED;
+  }
+  bool answered = !flight->result.response.empty();
+  if (answered) {
+    *result = flight->result;
+  }
+  if (flight->blocked == 0) {
+    delete flight;
+  }
+  return answered ? FLIGHT_ANSWERED : FLIGHT_LEAD;
+}
+
+// Lets the refresh thread resolve a key this thread leads, so the client
+// can be given the stale answer once `timeout_ms` passes. FLIGHT_LEAD means
+// the hand-off was not possible and the caller should resolve it inline.
+DnsServer::FlightWait DnsServer::HandOffRefresh(const WireKey &key,
+                                                const unsigned char *packet,
+                                                size_t packet_len,
+                                                unsigned int timeout_ms,
+                                                ResolveResult *result) {
+  if (!ReserveRefresh()) {
+    return FLIGHT_LEAD;
+  }
+  pthread_mutex_lock(&flight_mutex_);
+  Flight *flight = flights_[key.bytes];
+  ++flight->blocked;
+  pthread_mutex_unlock(&flight_mutex_);
+  if (!QueueRefresh(key, packet, packet_len)) {
+    pthread_mutex_lock(&flight_mutex_);
+    --flight->blocked;
+    pthread_mutex_unlock(&flight_mutex_);
+    ReleaseRefresh();
+    return FLIGHT_LEAD;
+  }
+  struct timespec deadline;
+  DeadlineAfter(timeout_ms, &deadline);
+  pthread_mutex_lock(&flight_mutex_);
+  FlightWait wait = AwaitFlight(flight, &deadline, result);
+  pthread_mutex_unlock(&flight_mutex_);
+  // A refresh that failed outright is as good as a late one.
+  return wait == FLIGHT_LEAD ? FLIGHT_EXPIRED : wait;
+}
+
+// Ends the flight for `key`: blocked threads get a copy of `result` and the
+// parked async queries are handed to the caller to answer.
+void DnsServer::LandFlight(const WireKey &key, const ResolveResult &result,
+                           std::vector<PendingQuery *> *waiters) {
+  pthread_mutex_lock(&flight_mutex_);
+  std::map<std::string, Flight *>::iterator it = flights_.find(key.bytes);
+  if (it == flights_.end()) {
+    pthread_mutex_unlock(&flight_mutex_);
+    return;
+  }
+  Flight *flight = it->second;
+  flights_.erase(it);
+  waiters->swap(flight->waiters);
+  flight->done = true;
+  if (flight->blocked > 0) {
+    flight->result = result;
+    pthread_cond_broadcast(&flight_cv_);
+  } else {
+    delete flight;
+  }
+  pthread_mutex_unlock(&flight_mutex_);
+}
+
+// Lands the flight for `key` and answers everything parked behind it.
+void DnsServer::FinishFlight(const WireKey &key,
+                             const ResolveResult &result) {
+  std::vector<PendingQuery *> waiters;
+  LandFlight(key, result, &waiters);
+  for (size_t i = 0; i < waiters.size(); ++i) {
+    CompletePending(waiters[i], result);
+    delete waiters[i];
+  }
+}
+
+// Records a flight for `key` unless one is already in progress.
+bool DnsServer::LeadFlight(const WireKey &key) {
+  pthread_mutex_lock(&flight_mutex_);
+  bool lead = flights_.find(key.bytes) == flights_.end();
+  if (lead) {
+    flights_[key.bytes] = new Flight();
+  }
+  pthread_mutex_unlock(&flight_mutex_);
+  return lead;
+}
+
+// The leader's query never went out or was cancelled at shutdown. Queries
+// parked behind it are dropped with it; blocked threads retry on their own.
+void DnsServer::DropFlight(const WireKey &key) {
+  std::vector<PendingQuery *> waiters;
+  LandFlight(key, ResolveResult(), &waiters);
+  for (size_t i = 0; i < waiters.size(); ++i) {
+    delete waiters[i];
+  }
+}
+
+void DnsServer::StartUpstream() {
+  if (upstream_ && !upstream_->Start()) {
+    LogWarn("Async upstream engine failed to start; resolving inline");
+    delete upstream_;
+    upstream_ = NULL;
+  } else if (upstream_) {
+    std::ostringstream out;
+    out << "Async upstream engine started: " << resolver_.udp_servers().size()
+        << " server(s), " << config_.upstream_sockets << " socket(s) each";
+    DebugLog(out.str());
+  }
+  // Prefetches and stale refreshes go through the engine when there is one.
+  if (!upstream_ && cache_ &&
+      (config_.prefetch_percent > 0 || config_.serve_stale_sec > 0)) {
+    prefetch_stop_ = false;
+    prefetch_started_ =
+        pthread_create(&prefetch_thread_, NULL, PrefetchEntry, this) == 0;
+    if (!prefetch_started_) {
+      LogWarn("Prefetch thread failed to start; prefetching disabled");
+    }
+  }
+}
+
+void DnsServer::StopUpstream() {
+  if (upstream_) {
+    upstream_->Stop();
+  }
+  if (!prefetch_started_) {
+    return;
+  }
+  pthread_mutex_lock(&prefetch_mutex_);
+  prefetch_stop_ = true;
+  pthread_cond_signal(&prefetch_cv_);
+  pthread_mutex_unlock(&prefetch_mutex_);
+  pthread_join(prefetch_thread_, NULL);
+  prefetch_started_ = false;
+  while (!prefetch_queue_.empty()) {
+    DropFlight(prefetch_queue_.front().key);
+    prefetch_queue_.pop_front();
+    ReleaseRefresh();
+  }
+}
+
+// An empty message still settles the query so the connection's in-flight
+// count stays accurate.
+void DnsServer::PostTcpReply(unsigned long conn,
+                             std::vector<unsigned char> *message) {
+  pthread_mutex_lock(&tcp_mutex_);
+  bool was_empty = tcp_replies_.empty();
+  tcp_replies_.push_back(TcpReply());
+  tcp_replies_.back().conn = conn;
+  tcp_replies_.back().message.swap(*message);
+  if (was_empty && tcp_loop_) {
+    tcp_loop_->Wake();
+  }
+  pthread_mutex_unlock(&tcp_mutex_);
+}
+
+// Runs the question past the blocklist and the local records, and points
+// `*answer` at the reply for either.
+Decision DnsServer::Decide(const DnsQuestion &question,
+                           const ResponseTemplate **answer) const {
+  if (blocklist_ && blocklist_->IsBlocked(question.qname)) {
+    *answer = &block_other_;
+    if (question.qtype == DNS_TYPE_A) {
+      *answer = &block_a_;
+    } else if (question.qtype == DNS_TYPE_AAAA) {
+      *answer = &block_aaaa_;
+    }
+    return DECISION_BLOCKED;
+  }
+  *answer = local_records_.Answer(question.key);
+  return *answer ? DECISION_LOCAL : DECISION_PASS;
+}
+
+bool DnsServer::ResolveQuery(const unsigned char *packet, size_t packet_len,
+                             const DnsHeader &header,
+                             const DnsQuestion &question,
+                             ResolveResult *result, bool allow_upstream) {
+  if (!result) {
+    return false;
+  }
+  result->response.clear();
+  result->upstream.clear();
+  result->source = RESOLVE_NONE;
+
+  // The generation is read before deciding, so an outcome reached against
+  // a blocklist that is being replaced is filed under the old one.
+  uint32_t generation = local_records_.generation() +
+                        (blocklist_ ? blocklist_->generation() : 0);
+  const ResponseTemplate *answer = NULL;
+  Decision decision = DECISION_NONE;
+  if (decisions_) {
+    decision = decisions_->Lookup(question.key, generation, &answer);
+  }
+  if (decision != DECISION_NONE) {
+    AtomicFetchAddRelaxed(&decision_hits_, 1UL);
+  } else {
+    decision = Decide(question, &answer);
+    if (decisions_) {
+      decisions_->Store(question.key, generation, decision, answer);
+    }
+  }
+  if (decision == DECISION_BLOCKED || decision == DECISION_LOCAL) {
+    DebugLog(decision == DECISION_BLOCKED ? "Blocklist match"
+                                          : "Local record match");
+    result->source =
+        decision == DECISION_BLOCKED ? RESOLVE_BLOCKLIST : RESOLVE_LOCAL;
+    BuildTemplateResponse(packet, header, question, *answer,
+                          &result->response);
+    return true;
+  }
+
+  const WireKey &key = question.key;
+  if (cache_) {
+    bool prefetch = false;
+    bool hit = cache_->Get(key, &result->response, &prefetch);
+    if (!hit && cache_->Get(MakeNxDomainKey(key), &result->response,
+                            &prefetch)) {
+      hit = SetQuestionType(&result->response, question.qtype);
+    }
+    if (hit) {
+      DebugLog("Cache hit");
+      result->source = RESOLVE_CACHE;
+      if (prefetch) {
+        StartPrefetch(packet, packet_len, header, question, key);
+      }
+      return true;
+    }
+    DebugLog("Cache miss");
+  }
+  // Left set when we return false, so callers can tell "needs an upstream"
+  // from a query that could not be parsed.
+  result->source = RESOLVE_UPSTREAM;
+  if (config_.stale_answer_timeout_ms == 0 && LookupStale(key, result)) {
+    // No client deadline: answer stale right away and refresh behind it.
+    DebugLog("Answered from the stale cache");
+    StartPrefetch(packet, packet_len, header, question, key);
+    return true;
+  }
+  if (!allow_upstream) {
+    return false;
+  }
+  ResolveMiss(packet, packet_len, header, question, result);
+  return true;
+}
+
+// The part of ResolveQuery that blocks: joins or leads the upstream lookup
+// for the key, falling back to a stale or empty answer.
+void DnsServer::ResolveMiss(const unsigned char *packet, size_t packet_len,
+                            const DnsHeader &header,
+                            const DnsQuestion &question,
+                            ResolveResult *result) {
+  const WireKey &key = question.key;
+  result->source = RESOLVE_UPSTREAM;
+  ResolveResult stale;
+  bool have_stale =
+      config_.stale_answer_timeout_ms > 0 && LookupStale(key, &stale);
+  unsigned int timeout_ms = have_stale ? config_.stale_answer_timeout_ms : 0;
+  FlightWait wait = WaitForFlight(key, timeout_ms, result);
+  if (wait == FLIGHT_LEAD && have_stale) {
+    wait = HandOffRefresh(key, packet, packet_len, timeout_ms, result);
+  }
+  if (wait == FLIGHT_ANSWERED) {
+    DebugLog("Answered by a concurrent upstream lookup");
+    PatchResponseId(&result->response, header.id);
+    return;
+  }
+  if (wait == FLIGHT_EXPIRED) {
+    DebugLog("Upstream slow; answering from the stale cache");
+    *result = stale;
+    return;
+  }
+  std::vector<unsigned char> query(packet, packet + packet_len);
+  if (QueryUpstreams(query, result)) {
+    StoreUpstreamAnswer(header, question, result);
+  } else if (have_stale) {
+    *result = stale;
+  } else {
+    result->response = BuildEmptyResponse(header, question);
+    StoreUpstreamAnswer(header, question, result);
+  }
+  FinishFlight(key, *result);
+}
+
+// Synchronous resolution: DoT servers first, then plain UDP.
+bool DnsServer::QueryUpstreams(const std::vector<unsigned char> &query,
+                               ResolveResult *result) {
+  if (resolver_.ResolveDot(query, &result->response, &result->upstream)) {
+    DebugLog("DoT resolution success");
+    return true;
+  }
+  if (resolver_.ResolveUdp(query, &result->response, &result->upstream)) {
+    DebugLog("Upstream resolution success");
+    return true;
+  }
+  DebugLog("Upstream resolution failed");
+  return false;
+}
+
+// Refreshes a hot cache entry before it expires so clients keep hitting.
+// At most prefetch_max_inflight refreshes run at once and extra ones are
+// skipped, as is a key that is already being looked up.
+void DnsServer::StartPrefetch(const unsigned char *packet, size_t packet_len,
+                              const DnsHeader &header,
+                              const DnsQuestion &question,
+                              const WireKey &key) {
+  if (!ReserveRefresh()) {
+    return;
+  }
+  if (!LeadFlight(key)) {
+    ReleaseRefresh();
+    return;
+  }
+  bool started = false;
+  if (upstream_) {
+    PendingQuery *pending = new PendingQuery();
+    pending->server = this;
+    std::memset(&pending->client_addr, 0, sizeof(pending->client_addr));
+    pending->client_len = 0;
+    pending->sock = -1;
+    pending->tcp_conn = 0;
+    pending->log_only = false;
+    pending->prefetch = true;
+    pending->answered = false;
+    pending->key = key;
+    pending->scratch.header = header;
+    pending->scratch.question = question;
+    started = upstream_->Submit(packet, packet_len, UpstreamDone, pending);
+    if (!started) {
+      delete pending;
+    }
+  } else {
+    started = QueueRefresh(key, packet, packet_len);
+  }
+  if (!started) {
+    DropFlight(key);
+    ReleaseRefresh();
+    return;
+  }
+  AtomicFetchAddRelaxed(&prefetches_, 1UL);
+  DebugLog("Prefetching " + question.qname);
+}
+
+// Background refreshes are capped at prefetch_max_inflight.
+bool DnsServer::ReserveRefresh() {
+  if (AtomicFetchAddRelaxed(&prefetch_inflight_, static_cast<size_t>(1)) >=
+      config_.prefetch_max_inflight) {
+    ReleaseRefresh();
+    return false;
+  }
+  return true;
+}
+
+void DnsServer::ReleaseRefresh() {
+  AtomicFetchSub(&prefetch_inflight_, static_cast<size_t>(1));
+}
+
+// Queues a lookup for the refresh thread, which lands the caller's flight
+// for `key` when it is done.
+bool DnsServer::QueueRefresh(const WireKey &key,
+                             const unsigned char *packet, size_t packet_len) {
+  pthread_mutex_lock(&prefetch_mutex_);
+  bool queued = prefetch_started_ && !prefetch_stop_;
+  if (queued) {
+    prefetch_queue_.push_back(PrefetchRequest());
+    prefetch_queue_.back().key = key;
+    prefetch_queue_.back().query.assign(packet, packet + packet_len);
+    pthread_cond_signal(&prefetch_cv_);
+  }
+  pthread_mutex_unlock(&prefetch_mutex_);
+  return queued;
+}
+
+void *DnsServer::PrefetchEntry(void *arg) {
+  static_cast<DnsServer *>(arg)->PrefetchLoop();
+  return NULL;
+}
+
+void DnsServer::PrefetchLoop() {
+  pthread_mutex_lock(&prefetch_mutex_);
+  for (;;) {
+    while (prefetch_queue_.empty() && !prefetch_stop_) {
+      pthread_cond_wait(&prefetch_cv_, &prefetch_mutex_);
+    }
+    if (prefetch_stop_) {
+      break;
+    }
+    PrefetchRequest request;
+    request.key.bytes.swap(prefetch_queue_.front().key.bytes);
+    request.key.hash = prefetch_queue_.front().key.hash;
+    request.query.swap(prefetch_queue_.front().query);
+    prefetch_queue_.pop_front();
+    pthread_mutex_unlock(&prefetch_mutex_);
+    RefreshEntry(request);
+    ReleaseRefresh();
+    pthread_mutex_lock(&prefetch_mutex_);
+  }
+  pthread_mutex_unlock(&prefetch_mutex_);
+}
+
+void DnsServer::RefreshEntry(const PrefetchRequest &request) {
+  DnsHeader header;
+  DnsQuestion question;
+  ResolveResult result;
+  if (!ParseDnsQuery(request.query, &header, &question) ||
+      !QueryUpstreams(request.query, &result)) {
+    DropFlight(request.key);
+    return;
+  }
+  result.source = RESOLVE_UPSTREAM;
+  StoreUpstreamAnswer(header, question, &result);
+  FinishFlight(request.key, result);
+}
+
+// Applies rebind protection to a fresh upstream answer and caches it.
+void DnsServer::StoreUpstreamAnswer(const DnsHeader &header,
+                                    const DnsQuestion &question,
+                                    ResolveResult *result) {
+  if (!result->response.empty() && config_.rebind_protection) {
+    bool rewritten = false;
+    if (!RewritePrivateARecordsToZero(&result->response, &rewritten)) {
+      DebugLog("Upstream response parse failed during rebind protection");
+      result->response = BuildEmptyResponse(header, question);
+    } else if (rewritten) {
+      DebugLog("Rebind protection rewrote upstream private A record(s) to 0.0.0.0");
+    }
+  }
+  if (!result->response.empty() && cache_) {
+    bool nxdomain = false;
+    if (IsNegativeResponse(result->response, &nxdomain) && nxdomain) {
+      cache_->Put(MakeNxDomainKey(question.key), result->response);
+    } else {
+      cache_->Put(question.key, result->response);
+    }
+  }
+}
+
+// Looks up the client's PTR name for the query log. Returns false only when
+// the answer would need an upstream round trip and allow_upstream is false.
+bool DnsServer::ResolveClientName(const struct sockaddr_in &client_addr,
+                                  bool allow_upstream, std::string *out) {
+  *out = "-";
+  std::vector<unsigned char> query;
+  DnsHeader header;
+  DnsQuestion question;
+  if (!BuildPtrQuery(client_addr, &query) ||
+      !ParseDnsQuery(query, &header, &question)) {
+    return true;
+  }
+  ResolveResult result;
+  if (!ResolveQuery(&query[0], query.size(), header, question, &result,
+                    allow_upstream)) {
+    return allow_upstream;
+  }
+  std::string ptr_name;
+  if (!ExtractFirstPtrTarget(result.response, &ptr_name)) {
+    return true;
+  }
+  if (!ptr_name.empty()) {
+    *out = ptr_name;
+  }
+  return true;
+}
+
+bool DnsServer::StartTcp() {
+  if (!config_.tcp_listen || tcp_started_) {
+    return tcp_started_;
+  }
+  int sock = OpenTcpSocket(config_.listen_addr, config_.listen_port);
+  if (sock < 0) {
+    LogWarn("TCP listener unavailable; serving UDP only");
+    return false;
+  }
+  EventLoop *loop = new EventLoop(event_backend_);
+  if (!loop->ok() || !loop->Add(sock, EVENT_READ) ||
+      !loop->Add(g_shutdown_pipe[0], EVENT_READ)) {
+    LogWarn("TCP event loop setup failed; serving UDP only");
+    delete loop;
+    close(sock);
+    return false;
+  }
+  tcp_sock_ = sock;
+  tcp_loop_ = loop;
+  if (pthread_create(&tcp_thread_, NULL, TcpEntry, this) != 0) {
+    LogWarn("TCP listener thread failed to start; serving UDP only");
+    tcp_loop_ = NULL;
+    delete loop;
+    close(sock);
+    tcp_sock_ = -1;
+    return false;
+  }
+  tcp_started_ = true;
+  std::ostringstream out;
+  out << "Listening on TCP " << config_.listen_addr << ":"
+      << config_.listen_port;
+  DebugLog(out.str());
+  return true;
+}
+
+// Runs after the listener loops have seen g_running drop. Workers may still
+// post replies; they find no loop to wake and the replies are discarded.
+void DnsServer::StopTcp() {
+  if (!tcp_started_) {
+    return;
+  }
+  pthread_join(tcp_thread_, NULL);
+  tcp_started_ = false;
+  close(tcp_sock_);
+  tcp_sock_ = -1;
+  pthread_mutex_lock(&tcp_mutex_);
+  delete tcp_loop_;
+  tcp_loop_ = NULL;
+  tcp_replies_.clear();
+  pthread_mutex_unlock(&tcp_mutex_);
+}
+
+void *DnsServer::TcpEntry(void *arg) {
+  static_cast<DnsServer *>(arg)->TcpLoop();
+  return NULL;
+}
+
+void DnsServer::TcpLoop() {
+  std::map<int, TcpConnection *> conns;
+  std::map<unsigned long, TcpConnection *> by_id;
+  std::vector<Job> jobs(batch_size_);
+  std::vector<TcpReply> replies;
+  std::vector<LoopEvent> events;
+  time_t last_sweep = std::time(NULL);
+  while (AtomicLoadRelaxed(&g_running)) {
+    if (tcp_loop_->Wait(conns.empty() ? -1 : 1000, &events) < 0) {
+      DebugLog(std::string("event loop wait failed: ") + std::strerror(errno));
+      continue;
+    }
+    time_t now = std::time(NULL);
+    size_t count = 0;
+    for (size_t i = 0; i < events.size(); ++i) {
+      int fd = events[i].fd;
+      if (fd == tcp_sock_) {
+        AcceptTcp(&conns, &by_id);
+        continue;
+      }
+      std::map<int, TcpConnection *>::iterator it = conns.find(fd);
+      if (it == conns.end()) {
+        continue;
+      }
+      TcpConnection *conn = it->second;
+      unsigned int ev = events[i].events;
+      bool ok = true;
+      if ((ev & EVENT_ERROR) && conn->peer_closed) {
+        ok = false;
+      } else if (ev & (EVENT_READ | EVENT_ERROR)) {
+        if (!conn->stream.ReadAvailable()) {
+          conn->peer_closed = true;
+        }
+        conn->last_active = now;
+        ok = QueueTcpMessages(conn, &jobs, &count);
+      }
+      if (ok && (ev & EVENT_WRITE)) {
+        // Draining output may unblock messages already buffered.
+        ok = conn->stream.Flush() && QueueTcpMessages(conn, &jobs, &count);
+      }
+      if (!ok || (conn->peer_closed && conn->pending == 0 &&
+                  !conn->stream.write_pending())) {
+        CloseTcp(conn, &conns, &by_id);
+        continue;
+      }
+      UpdateTcpInterest(conn);
+    }
+    if (count > 0) {
+      EnqueueBatch(&jobs, count, NULL);
+      count = 0;
+    }
+
+    pthread_mutex_lock(&tcp_mutex_);
+    replies.swap(tcp_replies_);
+    pthread_mutex_unlock(&tcp_mutex_);
+    for (size_t i = 0; i < replies.size(); ++i) {
+      std::map<unsigned long, TcpConnection *>::iterator it =
+          by_id.find(replies[i].conn);
+      if (it == by_id.end()) {
+        continue;
+      }
+      TcpConnection *conn = it->second;
+      --conn->pending;
+      conn->last_active = now;
+      const std::vector<unsigned char> &message = replies[i].message;
+      if (!message.empty()) {
+        conn->stream.QueueMessage(&message[0], message.size());
+      }
+      // Answers go out as soon as each one resolves, in whatever order the
+      // workers finish them.
+      bool ok = conn->stream.Flush() && QueueTcpMessages(conn, &jobs, &count);
+      if (!ok || (conn->peer_closed && conn->pending == 0 &&
+                  !conn->stream.write_pending())) {
+        CloseTcp(conn, &conns, &by_id);
+        continue;
+      }
+      UpdateTcpInterest(conn);
+    }
+    replies.clear();
+    if (count > 0) {
+      EnqueueBatch(&jobs, count, NULL);
+    }
+
+    if (now != last_sweep) {
+      last_sweep = now;
+      count = 0;
+      std::vector<TcpConnection *> expired;
+      for (std::map<int, TcpConnection *>::iterator it = conns.begin();
+           it != conns.end(); ++it) {
+        TcpConnection *conn = it->second;
+        if (!QueueTcpMessages(conn, &jobs, &count)) {
+          expired.push_back(conn);
+        } else if (conn->pending == 0 && !conn->stream.write_pending() &&
+                   now - conn->last_active >=
+                       static_cast<time_t>(config_.tcp_idle_timeout_sec)) {
+          DebugLog("Closing idle TCP connection");
+          expired.push_back(conn);
+        } else {
+          UpdateTcpInterest(conn);
+        }
+      }
+      if (count > 0) {
+        EnqueueBatch(&jobs, count, NULL);
+      }
+      for (size_t i = 0; i < expired.size(); ++i) {
+        CloseTcp(expired[i], &conns, &by_id);
+      }
+    }
+  }
+  while (!conns.empty()) {
+    CloseTcp(conns.begin()->second, &conns, &by_id);
+  }
+}
+
+void DnsServer::AcceptTcp(std::map<int, TcpConnection *> *conns,
+                          std::map<unsigned long, TcpConnection *> *by_id) {
+  for (;;) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int fd = accept(tcp_sock_, reinterpret_cast<struct sockaddr *>(&addr),
+                    &addr_len);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        DebugLog(std::string("accept() failed: ") + std::strerror(errno));
+      }
+      return;
+    }
+    if (conns->size() >= config_.tcp_max_connections) {
+      DebugLog("TCP connection limit reached, refusing connection");
+      close(fd);
+      continue;
+    }
+    int enable = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    if (!SetNonBlocking(fd) || !tcp_loop_->Add(fd, EVENT_READ)) {
+      close(fd);
+      continue;
+    }
+    TcpConnection *conn = new TcpConnection(fd);
+    conn->id = ++next_tcp_id_;
+    conn->addr = addr;
+    conn->last_active = std::time(NULL);
+    conn->interest = EVENT_READ;
+    (*conns)[fd] = conn;
+    (*by_id)[conn->id] = conn;
+    AtomicStoreRelaxed(&tcp_connections_, conns->size());
+  }
+}
+
+// Turns complete messages into worker jobs until the connection reaches its
+// pipelining limit or has too much unread output. Returns false if the
+// connection should be dropped.
+bool DnsServer::QueueTcpMessages(TcpConnection *conn, std::vector<Job> *jobs,
+                                 size_t *count) {
+  const unsigned char *data = NULL;
+  size_t len = 0;
+  while (conn->pending < config_.tcp_pipeline_depth &&
+         !conn->stream.output_full() &&
+         conn->stream.PeekMessage(&data, &len)) {
+    if (len < 12 || len > pool_.buffer_size()) {
+      DebugLog("Malformed TCP query, closing connection");
+      return false;
+    }
+    PacketBuffer *packet = pool_.Acquire();
+    if (!packet) {
+      // Leave the message buffered; the once-a-second sweep retries it.
+      break;
+    }
+    std::memcpy(packet->data, data, len);
+    packet->len = len;
+    conn->stream.PopMessage();
+    LogReceived(conn->addr, len);
+
+    Job &job = (*jobs)[*count];
+    job.packet = packet;
+    job.client_addr = conn->addr;
+    job.client_len = sizeof(conn->addr);
+    job.tcp_conn = conn->id;
+    ++conn->pending;
+    AtomicFetchAddRelaxed(&tcp_queries_, 1UL);
+    if (++*count == jobs->size()) {
+      EnqueueBatch(jobs, *count, NULL);
+      *count = 0;
+    }
+  }
+  return true;
+}
+
+void DnsServer::UpdateTcpInterest(TcpConnection *conn) {
+  unsigned int want = 0;
+  // A client that pipelines queries but never reads its answers stops
+  // being read until it drains them.
+  if (!conn->peer_closed && conn->pending < config_.tcp_pipeline_depth &&
+      !conn->stream.output_full()) {
+    want |= EVENT_READ;
+  }
+  if (conn->stream.write_pending()) {
+    want |= EVENT_WRITE;
+  }
+  if (want != conn->interest) {
+    tcp_loop_->Modify(conn->stream.fd(), want);
+    conn->interest = want;
+  }
+}
+
+void DnsServer::CloseTcp(TcpConnection *conn,
+                         std::map<int, TcpConnection *> *conns,
+                         std::map<unsigned long, TcpConnection *> *by_id) {
+  int fd = conn->stream.fd();
+  tcp_loop_->Remove(fd);
+  close(fd);
+  conns->erase(fd);
+  by_id->erase(conn->id);
+  delete conn;
+  AtomicStoreRelaxed(&tcp_connections_, conns->size());
+}
+
+void DnsServer::StartWorkers() {
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    workers_[i].started =
+        pthread_create(&workers_[i].thread, NULL, WorkerEntry, &workers_[i]) == 0;
+  }
+}
+
+void DnsServer::StopWorkers() {
+  pthread_mutex_lock(&park_mutex_);
+  running_ = false;
+  pthread_cond_broadcast(&park_cv_);
+  pthread_cond_broadcast(&standby_cv_);
+  pthread_mutex_unlock(&park_mutex_);
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    if (workers_[i].started) {
+      pthread_join(workers_[i].thread, NULL);
+      workers_[i].started = false;
+    }
+  }
+}
+
+size_t DnsServer::QueueDepth() const {
+  size_t depth = 0;
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    depth += workers_[i].ring->ApproxSize();
+  }
+  return depth;
+}
+
+// True while queued work has been waiting longer than queue_target_ms on
+// average. An empty queue always admits, so fresh samples can pull the
+// average back down once the backlog clears.
+bool DnsServer::Overloaded() const {
+  if (config_.queue_target_ms == 0 || QueueDepth() == 0) {
+    return false;
+  }
+  return AtomicLoadRelaxed(&queue_wait_us_) >
+         static_cast<unsigned long>(config_.queue_target_ms) * 1000;
+}
+
+// Answers a job we will not resolve according to queue_full_policy. UDP
+// answers join `replies` when given; TCP ones go back to their connection
+// (an empty reply for "drop" so its in-flight count still settles).
+void DnsServer::ShedJob(Job *job, UdpSendBatch *replies) {
+  PacketBuffer *packet = job->packet;
+  job->packet = NULL;
+  bool answer = shed_rcode_ >= 0 &&
+                RewriteAsErrorResponse(packet->data, &packet->len,
+                                       static_cast<unsigned int>(shed_rcode_));
+  if (job->tcp_conn != 0) {
+    std::vector<unsigned char> message;
+    if (answer) {
+      message.assign(packet->data, packet->data + packet->len);
+    }
+    pool_.Release(packet);
+    PostTcpReply(job->tcp_conn, &message);
+    return;
+  }
+  if (!answer) {
+    pool_.Release(packet);
+    return;
+  }
+  SendPacket(sock_, packet, job->client_addr, job->client_len, replies);
+}
+
+// Sends a reply already built in `packet`, batched when `replies` is given.
+// Always consumes `packet`.
+void DnsServer::SendPacket(int sock, PacketBuffer *packet,
+                           const struct sockaddr_in &client_addr,
+                           socklen_t client_len, UdpSendBatch *replies) {
+  if (replies) {
+    if (replies->full()) {
+      replies->Flush(sock);
+    }
+    replies->Add(packet, client_addr, client_len);
+    return;
+  }
+  sendto(sock, packet->data, packet->len, 0,
+         reinterpret_cast<const struct sockaddr *>(&client_addr), client_len);
+  pool_.Release(packet);
+}
+
+// Client limits are checked before a packet costs any parsing. Returns false
+// when the source has no tokens left.
+bool DnsServer::AdmitClient(const struct sockaddr_in &client_addr,
+                            uint64_t now_us) {
+  if (!client_limiter_ ||
+      client_limiter_->Allow(client_addr.sin_addr.s_addr, now_us, NULL)) {
+    return true;
+  }
+  AtomicFetchAddRelaxed(&ratelimited_, 1UL);
+  return false;
+}
+
+void DnsServer::EnqueueBatch(std::vector<Job> *jobs, size_t count,
+                             UdpSendBatch *replies) {
+  if (count == 0 || workers_.empty()) {
+    return;
+  }
+  bool overloaded = Overloaded();
+  uint64_t now = MonotonicMicros();
+  size_t ring_count = AtomicLoadRelaxed(&active_workers_);
+  for (size_t i = 0; i < count; ++i) {
+    Job &job = (*jobs)[i];
+    if (overloaded) {
+      AtomicFetchAddRelaxed(&shed_, 1UL);
+      ShedJob(&job, replies);
+      continue;
+    }
+    job.queued_at = now;
+    size_t start = AtomicFetchAddRelaxed(&next_ring_, static_cast<size_t>(1));
+    bool queued = false;
+    for (size_t attempt = 0; attempt < ring_count && !queued; ++attempt) {
+      queued = workers_[(start + attempt) % ring_count].ring->TryPush(&job);
+    }
+    if (!queued && ring_count < workers_.size()) {
+      // Every active ring is full: bring a standby worker in now instead of
+      // waiting for the next sample.
+      ResizeWorkers(ring_count, ring_count + 1);
+      ring_count = AtomicLoadRelaxed(&active_workers_);
+      queued = workers_[ring_count - 1].ring->TryPush(&job);
+    }
+    if (queued) {
+      AtomicFetchAddRelaxed(&enqueued_, 1UL);
+    } else {
+      AtomicFetchAddRelaxed(&dropped_, 1UL);
+      DebugLog("Job rings full, shedding query");
+      ShedJob(&job, replies);
+    }
+  }
+  WakeWorkers(count);
+  ScaleWorkers(now);
+}
+
+void DnsServer::WakeWorkers(size_t count) {
+  // Pairs with the fence in DequeueBatch: either the parked worker sees the
+  // new jobs when it rechecks, or we see it as idle here and signal it.
+  AtomicFence();
+  if (AtomicLoad(&idle_workers_) > 0) {
+    pthread_mutex_lock(&park_mutex_);
+    if (count == 1) {
+      pthread_cond_signal(&park_cv_);
+    } else {
+      pthread_cond_broadcast(&park_cv_);
+    }
+    pthread_mutex_unlock(&park_mutex_);
+  }
+}
+
+// Pushes jobs [from, count) back onto the worker's own ring so idle
+// siblings can steal them, and returns how many stay in the batch (those
+// that did not fit).
+size_t DnsServer::ReturnJobs(size_t index, std::vector<Job> *jobs,
+                             size_t from, size_t count) {
+  JobRing<Job> *ring = workers_[index].ring;
+  size_t kept = from;
+  for (size_t i = from; i < count; ++i) {
+    if (!ring->TryPush(&(*jobs)[i])) {
+      if (kept != i) {
+        (*jobs)[kept].Swap((*jobs)[i]);
+      }
+      ++kept;
+    }
+  }
+  if (kept < count) {
+    WakeWorkers(count - kept);
+  }
+  return kept;
+}
+
+// Samples the backlog every kScaleIntervalUs from whichever producer or
+// worker gets there first, and grows or shrinks the active set when the
+// trend holds. Workers sample too, so a backlog stuck behind slow upstreams
+// is noticed even when no new queries arrive.
+void DnsServer::ScaleWorkers(uint64_t now_us) {
+  if (!config_.worker_autoscale ||
+      now_us < AtomicLoadRelaxed(&next_scale_us_) ||
+      pthread_mutex_trylock(&scale_mutex_) != 0) {
+    return;
+  }
+  if (now_us >= next_scale_us_) {
+    AtomicStoreRelaxed(&next_scale_us_, now_us + kScaleIntervalUs);
+    size_t active = AtomicLoadRelaxed(&active_workers_);
+    size_t backlog = QueueDepth();
+    for (size_t i = 0; i < workers_.size(); ++i) {
+      backlog += AtomicLoadRelaxed(&workers_[i].held);
+    }
+    if (backlog > active) {
+      quiet_samples_ = 0;
+      if (++busy_samples_ >= kGrowSamples) {
+        busy_samples_ = 0;
+        // Grow by half again so a big box catches up in a few steps.
+        size_t grown = active + (active + 1) / 2;
+        if (grown > workers_.size()) {
+          grown = workers_.size();
+        }
+        if (grown > active) {
+          ResizeWorkers(active, grown);
+        }
+      }
+    } else if (backlog < active && AtomicLoadRelaxed(&idle_workers_) > 1) {
+      busy_samples_ = 0;
+      if (++quiet_samples_ >= kShrinkSamples) {
+        quiet_samples_ = 0;
+        if (active > kMinActiveWorkers) {
+          ResizeWorkers(active, active - 1);
+        }
+      }
+    } else {
+      busy_samples_ = 0;
+      quiet_samples_ = 0;
+    }
+  }
+  pthread_mutex_unlock(&scale_mutex_);
+}
+
+// Moves the active count from `from` to `to`, unless someone else changed it
+// first. Workers at index >= the active count finish their own ring and go on
+// standby; anything pushed to them late is stolen by the active ones.
+void DnsServer::ResizeWorkers(size_t from, size_t to) {
+  pthread_mutex_lock(&park_mutex_);
+  if (AtomicLoadRelaxed(&active_workers_) == from) {
+    AtomicStoreRelaxed(&active_workers_, to);
+    // A parked worker that was just retired must move to standby rather than
+    // soak up the wakeup meant for an active one.
+    pthread_cond_broadcast(to > from ? &standby_cv_ : &park_cv_);
+    std::ostringstream out;
+    out << "Active workers: " << from << " -> " << to;
+    DebugLog(out.str());
+  }
+  pthread_mutex_unlock(&park_mutex_);
+}
+
+size_t DnsServer::DequeueBatch(size_t index, std::vector<Job> *jobs) {
+  JobRing<Job> *ring = workers_[index].ring;
+  for (;;) {
+    // Take half of our own backlog, like a thief would, so siblings that
+    // run dry (or were just activated) still have something to steal.
+    size_t want = (ring->ApproxSize() + 1) / 2;
+    if (want == 0) {
+      want = 1;
+    }
+    if (want > jobs->size()) {
+      want = jobs->size();
+    }
+    size_t count = 0;
+    while (count < want && ring->TryPop(&(*jobs)[count])) {
+      ++count;
+    }
+    bool standby = index >= AtomicLoadRelaxed(&active_workers_);
+    if (count == 0 && !standby) {
+      count = StealBatch(index, jobs);
+    }
+    if (count > 0) {
+      return count;
+    }
+    if (standby) {
+      pthread_mutex_lock(&park_mutex_);
+      while (running_ && index >= AtomicLoadRelaxed(&active_workers_)) {
+        pthread_cond_wait(&standby_cv_, &park_mutex_);
+      }
+      bool stop = !running_;
+      pthread_mutex_unlock(&park_mutex_);
+      if (stop && ring->ApproxSize() == 0) {
+        return 0;
+      }
+      continue;
+    }
+    // Nothing is waiting, so neither is the average.
+    AtomicStoreRelaxed(&queue_wait_us_, 0UL);
+    pthread_mutex_lock(&park_mutex_);
+    AtomicFetchAdd(&idle_workers_, 1U);
+    AtomicFence();
+    while (running_ && QueueDepth() == 0 &&
+           index < AtomicLoadRelaxed(&active_workers_)) {
+      pthread_cond_wait(&park_cv_, &park_mutex_);
+    }
+    AtomicFetchSub(&idle_workers_, 1U);
+    bool stop = !running_ && QueueDepth() == 0;
+    pthread_mutex_unlock(&park_mutex_);
+    if (stop) {
+      return 0;
+    }
+  }
+}
+
+size_t DnsServer::StealBatch(size_t index, std::vector<Job> *jobs) {
+  size_t victim = index;
+  size_t victim_depth = 0;
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    if (i == index) {
+      continue;
+    }
+    size_t depth = workers_[i].ring->ApproxSize();
+    if (depth > victim_depth) {
+      victim = i;
+      victim_depth = depth;
+    }
+  }
+  if (victim == index) {
+    return 0;
+  }
+  // Take half so the victim keeps working through the rest of its backlog.
+  size_t want = (victim_depth + 1) / 2;
+  if (want > jobs->size()) {
+    want = jobs->size();
+  }
+  size_t count = 0;
+  while (count < want && workers_[victim].ring->TryPop(&(*jobs)[count])) {
+    ++count;
+  }
+  if (count > 0) {
+    AtomicFetchAddRelaxed(&workers_[index].steals,
+                          static_cast<unsigned long>(count));
+  }
+  return count;
+}
+
+void *DnsServer::WorkerEntry(void *arg) {
+  Worker *worker = static_cast<Worker *>(arg);
+  if (worker->server->config_.worker_cpu_affinity &&
+      !PinToCpu(worker->index)) {
+    std::ostringstream out;
+    out << "Could not pin worker " << worker->index << " to a CPU";
+    LogWarn(out.str());
+  }
+  worker->server->WorkerLoop(worker->index);
+  return NULL;
+}
+
+void DnsServer::WorkerLoop(size_t index) {
+  std::vector<Job> jobs(batch_size_);
+  UdpSendBatch replies(batch_size_, &pool_);
+  QueryScratch scratch;
+  for (;;) {
+    size_t count = DequeueBatch(index, &jobs);
+    if (count == 0) {
+      break;
+    }
+    uint64_t target = static_cast<uint64_t>(config_.queue_target_ms) * 1000;
+    for (size_t i = 0; i < count; ++i) {
+      // Measured per job: the rest of this batch keeps waiting while earlier
+      // jobs block on upstream round trips.
+      uint64_t now = MonotonicMicros();
+      uint64_t waited = now > jobs[i].queued_at ? now - jobs[i].queued_at : 0;
+      unsigned long average = AtomicLoadRelaxed(&queue_wait_us_);
+      average = average - average / 8 + static_cast<unsigned long>(waited / 8);
+      AtomicStoreRelaxed(&queue_wait_us_, average);
+      AtomicStoreRelaxed(&workers_[index].held, count - i);
+      ScaleWorkers(now);
+      if (target > 0 && waited > target) {
+        // The client has likely given up or retried; answer per policy
+        // rather than spend an upstream round trip on it.
+        AtomicFetchAddRelaxed(&shed_, 1UL);
+        ShedJob(&jobs[i], &replies);
+      } else if (jobs[i].tcp_conn != 0) {
+        HandleTcpQuery(&jobs[i], &scratch);
+      } else {
+        HandleQuery(sock_, jobs[i].packet, jobs[i].client_addr,
+                    jobs[i].client_len, &replies, &scratch);
+        jobs[i].packet = NULL;
+      }
+      if (i + 1 < count && AtomicLoadRelaxed(&idle_workers_) > 0) {
+        // A sibling went idle while we still hold jobs that may each wait
+        // on an upstream; give the rest back for it to steal.
+        count = ReturnJobs(index, &jobs, i + 1, count);
+      }
     }
-    HandleQuery(sock_, job.packet, job.client_addr, job.client_len);
+    AtomicStoreRelaxed(&workers_[index].held, static_cast<size_t>(0));
+    replies.Flush(sock_);
   }
 }
 
@@ -4,14 +4,24 @@
 #include "blocklist.h"
 #include "cache.h"
 #include "config.h"
+#include "decision_cache.h"
 #include "dns_packet.h"
+#include "event_loop.h"
+#include "job_ring.h"
 #include "local_records.h"
+#include "packet_pool.h"
+#include "rate_limiter.h"
+#include "upstream_engine.h"
 #include "upstream_resolver.h"
 #include "query_logger.h"
+#include "tcp_stream.h"
+#include "udp_batch.h"
 
+#include <ctime>
+#include <deque>
+#include <map>
 #include <netinet/in.h>
 #include <pthread.h>
-#include <deque>
 #include <vector>
 
 namespace gravastar {
@@ -28,12 +38,51 @@ public:
 
     bool Run();
 
+    struct Stats {
+        size_t workers_active;
+        size_t queue_depth;
+        unsigned long enqueued;
+        unsigned long dropped;
+        unsigned long shed;
+        unsigned long queue_wait_ms;
+        unsigned long steals;
+        size_t buffers_in_use;
+        size_t buffers_high_water;
+        unsigned long buffers_exhausted;
+        unsigned long buffers_discarded;
+        size_t tcp_connections;
+        unsigned long tcp_queries;
+        size_t upstream_inflight;
+        unsigned long upstream_timeouts;
+        size_t cache_bytes;
+        // Share of the cache's slab memory not holding entry data.
+        unsigned int cache_fragmentation_pct;
+        // Returning keys the cache kept out of its main queue (TinyLFU).
+        unsigned long cache_rejected;
+        // Queries whose blocklist and local-record outcome was remembered.
+        unsigned long decision_hits;
+        unsigned long cache_hits;
+        unsigned long negative_hits;
+        unsigned long coalesced;
+        unsigned long prefetches;
+        unsigned long stale_answers;
+        unsigned long ratelimited;
+        unsigned long rrl_dropped;
+        unsigned long rrl_slipped;
+        unsigned long inline_answers;
+        unsigned long deferred;
+    };
+    Stats GetStats() const;
+
 private:
     enum ResolveSource {
         RESOLVE_BLOCKLIST,
         RESOLVE_LOCAL,
         RESOLVE_CACHE,
         RESOLVE_UPSTREAM,
+        // An expired cache entry, served because the upstream failed or
+        // was too slow.
+        RESOLVE_STALE,
         RESOLVE_NONE
     };
 
@@ -43,40 +92,299 @@ private:
         std::string upstream;
     };
 
+    // Per-thread parse and resolve state, reused across queries so their
+    // strings and vectors keep their capacity.
+    struct QueryScratch {
+        DnsHeader header;
+        DnsQuestion question;
+        ResolveResult result;
+    };
+
+    // A query waiting on the async upstream engine. `log_only` marks a
+    // background PTR lookup for the query log of an already answered query.
+    struct PendingQuery {
+        DnsServer *server;
+        struct sockaddr_in client_addr;
+        socklen_t client_len;
+        int sock;
+        unsigned long tcp_conn;
+        bool log_only;
+        // Refreshes a cache entry ahead of expiry; nobody is waiting on it.
+        bool prefetch;
+        // Already answered from the stale tier while the lookup goes on.
+        bool answered;
+        // Cache key of the question on the wire (the PTR lookup for
+        // log_only); names the Flight this query leads or waits on.
+        WireKey key;
+        QueryScratch scratch;
+    };
+
+    // An upstream lookup in progress. Misses for the same cache key that
+    // arrive meanwhile wait on it instead of sending their own query: async
+    // ones are parked in `waiters`, synchronous ones block on flight_cv_.
+    struct Flight {
+        Flight() : blocked(0), done(false), late(false) {}
+        std::vector<PendingQuery *> waiters;
+        size_t blocked;
+        bool done;
+        // Overran stale_answer_timeout_ms; new misses take the stale answer
+        // rather than wait.
+        bool late;
+        // Only filled in when `blocked` threads need it.
+        ResolveResult result;
+    };
+
+    enum FlightWait {
+        // No lookup in flight; the caller now leads one.
+        FLIGHT_LEAD,
+        FLIGHT_ANSWERED,
+        // The deadline passed first.
+        FLIGHT_EXPIRED
+    };
+
+    struct PrefetchRequest {
+        WireKey key;
+        std::vector<unsigned char> query;
+    };
+
+    struct Shard {
+        DnsServer *server;
+        int sock;
+        pthread_t thread;
+        bool started;
+    };
+
     struct Job {
-        std::vector<unsigned char> packet;
+        PacketBuffer *packet;
         struct sockaddr_in client_addr;
         socklen_t client_len;
+        // Non-zero for queries that arrived over TCP; names the connection
+        // the answer goes back to.
+        unsigned long tcp_conn;
+        uint64_t queued_at;
+
+        Job() : packet(NULL), client_len(0), tcp_conn(0), queued_at(0) {}
+        void Swap(Job &other);
+    };
+
+    struct Worker {
+        DnsServer *server;
+        size_t index;
+        pthread_t thread;
+        bool started;
+        JobRing<Job> *ring;
+        unsigned long steals;
+        // Jobs dequeued but not yet handled; counted as backlog when scaling.
+        size_t held;
+    };
+
+    // Owned by the TCP listener thread; workers only ever see the id.
+    struct TcpConnection {
+        unsigned long id;
+        TcpStream stream;
+        struct sockaddr_in addr;
+        size_t pending;
+        time_t last_active;
+        bool peer_closed;
+        unsigned int interest;
+
+        explicit TcpConnection(int fd) : id(0), stream(fd), pending(0),
+            last_active(0), peer_closed(false), interest(0) {}
+    };
+
+    struct TcpReply {
+        unsigned long conn;
+        std::vector<unsigned char> message;
     };
 
-    bool HandleQuery(int sock, const std::vector<unsigned char> &packet,
-                     const struct sockaddr_in &client_addr, socklen_t client_len);
-    bool ResolveQuery(const std::vector<unsigned char> &packet,
+    bool AnswerQuery(const PacketBuffer &packet, QueryScratch *scratch);
+    void AnswerMiss(const PacketBuffer &packet, QueryScratch *scratch);
+    void CountAnswer(QueryScratch *scratch);
+    void LogQuery(const struct sockaddr_in &client_addr,
+                  const QueryScratch &scratch, const std::string *known_name);
+    bool HandleQuery(int sock, PacketBuffer *packet,
+                     const struct sockaddr_in &client_addr, socklen_t client_len,
+                     UdpSendBatch *replies, QueryScratch *scratch);
+    bool AnswerInline(int sock, PacketBuffer *packet,
+                      const struct sockaddr_in &client_addr,
+                      socklen_t client_len, UdpSendBatch *replies,
+                      QueryScratch *scratch);
+    void SendUdpAnswer(int sock, PacketBuffer *packet,
+                       const struct sockaddr_in &client_addr,
+                       socklen_t client_len, UdpSendBatch *replies,
+                       const QueryScratch &scratch);
+    void SendPacket(int sock, PacketBuffer *packet,
+                    const struct sockaddr_in &client_addr,
+                    socklen_t client_len, UdpSendBatch *replies);
+    bool AdmitClient(const struct sockaddr_in &client_addr, uint64_t now_us);
+    void HandleTcpQuery(Job *job, QueryScratch *scratch);
+    bool ForwardQuery(const PacketBuffer &packet,
+                      const struct sockaddr_in &client_addr,
+                      socklen_t client_len, int sock, unsigned long tcp_conn,
+                      const QueryScratch &scratch);
+    void LogAnswered(const struct sockaddr_in &client_addr,
+                     const QueryScratch &scratch);
+    static void UpstreamDone(void *ctx, UpstreamStatus status,
+                             const unsigned char *response, size_t len,
+                             const std::string &server);
+    void FinishUpstream(PendingQuery *pending, bool ok,
+                        const unsigned char *response, size_t len,
+                        const std::string &server);
+    void CompletePending(PendingQuery *pending, const ResolveResult &result);
+    bool SubmitPending(PendingQuery *pending, const unsigned char *query,
+                       size_t len);
+    bool AttachToFlight(PendingQuery *pending, bool *late);
+    FlightWait WaitForFlight(const WireKey &key, unsigned int timeout_ms,
+                             ResolveResult *result);
+    FlightWait AwaitFlight(Flight *flight, const struct timespec *deadline,
+                           ResolveResult *result);
+    FlightWait HandOffRefresh(const WireKey &key,
+                              const unsigned char *packet, size_t packet_len,
+                              unsigned int timeout_ms, ResolveResult *result);
+    void ServeLate(PendingQuery *pending);
+    bool LookupStale(const WireKey &key, ResolveResult *result);
+    void LandFlight(const WireKey &key, const ResolveResult &result,
+                    std::vector<PendingQuery *> *waiters);
+    void DropFlight(const WireKey &key);
+    void FinishFlight(const WireKey &key, const ResolveResult &result);
+    bool LeadFlight(const WireKey &key);
+    void StartPrefetch(const unsigned char *packet, size_t packet_len,
+                       const DnsHeader &header, const DnsQuestion &question,
+                       const WireKey &key);
+    bool ReserveRefresh();
+    void ReleaseRefresh();
+    bool QueueRefresh(const WireKey &key, const unsigned char *packet,
+                      size_t packet_len);
+    static void *PrefetchEntry(void *arg);
+    void PrefetchLoop();
+    void RefreshEntry(const PrefetchRequest &request);
+    void StartUpstream();
+    void StopUpstream();
+    void PostTcpReply(unsigned long conn, std::vector<unsigned char> *message);
+    bool ResolveQuery(const unsigned char *packet, size_t packet_len,
                       const DnsHeader &header,
                       const DnsQuestion &question,
-                      ResolveResult *result);
-    std::string ResolveClientName(const struct sockaddr_in &client_addr);
+                      ResolveResult *result, bool allow_upstream);
+    void ResolveMiss(const unsigned char *packet, size_t packet_len,
+                     const DnsHeader &header, const DnsQuestion &question,
+                     ResolveResult *result);
+    Decision Decide(const DnsQuestion &question,
+                    const ResponseTemplate **answer) const;
+    bool QueryUpstreams(const std::vector<unsigned char> &query,
+                        ResolveResult *result);
+    void StoreUpstreamAnswer(const DnsHeader &header,
+                             const DnsQuestion &question,
+                             ResolveResult *result);
+    bool ResolveClientName(const struct sockaddr_in &client_addr,
+                           bool allow_upstream, std::string *out);
+    bool RunSharded(size_t shard_count);
+    static void *ShardEntry(void *arg);
+    void ShardLoop(int sock);
+    bool StartTcp();
+    void StopTcp();
+    static void *TcpEntry(void *arg);
+    void TcpLoop();
+    void AcceptTcp(std::map<int, TcpConnection *> *conns,
+                   std::map<unsigned long, TcpConnection *> *by_id);
+    bool QueueTcpMessages(TcpConnection *conn, std::vector<Job> *jobs,
+                          size_t *count);
+    void UpdateTcpInterest(TcpConnection *conn);
+    void CloseTcp(TcpConnection *conn, std::map<int, TcpConnection *> *conns,
+                  std::map<unsigned long, TcpConnection *> *by_id);
     void StartWorkers();
     void StopWorkers();
-    void Enqueue(const Job &job);
-    bool Dequeue(Job *job);
+    bool Overloaded() const;
+    void ShedJob(Job *job, UdpSendBatch *replies);
+    void EnqueueBatch(std::vector<Job> *jobs, size_t count,
+                      UdpSendBatch *replies);
+    void ScaleWorkers(uint64_t now_us);
+    void ResizeWorkers(size_t from, size_t to);
+    void WakeWorkers(size_t count);
+    size_t ReturnJobs(size_t index, std::vector<Job> *jobs, size_t from,
+                      size_t count);
+    size_t DequeueBatch(size_t index, std::vector<Job> *jobs);
+    size_t StealBatch(size_t index, std::vector<Job> *jobs);
+    size_t QueueDepth() const;
+    void LogStats() const;
     static void *WorkerEntry(void *arg);
-    void WorkerLoop();
+    void WorkerLoop(size_t index);
 
     ServerConfig config_;
     Blocklist *blocklist_;
     LocalRecords local_records_;
+    // What blocked A, AAAA and other queries are answered with, built once
+    // from block_mode.
+    ResponseTemplate block_a_;
+    ResponseTemplate block_aaaa_;
+    ResponseTemplate block_other_;
+    // NULL when decision_cache_size is 0.
+    DecisionCache *decisions_;
+    unsigned long decision_hits_;
     DnsCache *cache_;
     UpstreamResolver resolver_;
     QueryLogger *logger_;
     int sock_;
     bool running_;
     size_t worker_count_;
-    std::deque<Job> queue_;
-    pthread_mutex_t queue_mutex_;
-    pthread_cond_t queue_cv_;
-    pthread_mutex_t cache_mutex_;
-    std::vector<pthread_t> workers_;
+    size_t batch_size_;
+    EventBackend event_backend_;
+    PacketPool pool_;
+    int shed_rcode_;
+    std::vector<Worker> workers_;
+    size_t next_ring_;
+    unsigned int idle_workers_;
+    unsigned long enqueued_;
+    unsigned long dropped_;
+    unsigned long shed_;
+    // Moving average of how long jobs sit in the rings, in microseconds.
+    unsigned long queue_wait_us_;
+    unsigned long discarded_;
+    unsigned long inline_answers_;
+    unsigned long deferred_;
+    pthread_mutex_t park_mutex_;
+    pthread_cond_t park_cv_;
+    std::vector<Shard> shards_;
+    int tcp_sock_;
+    EventLoop *tcp_loop_;
+    pthread_t tcp_thread_;
+    bool tcp_started_;
+    unsigned long next_tcp_id_;
+    size_t tcp_connections_;
+    unsigned long tcp_queries_;
+    pthread_mutex_t tcp_mutex_;
+    std::vector<TcpReply> tcp_replies_;
+    RateLimiter *client_limiter_;
+    RateLimiter *rrl_;
+    unsigned long ratelimited_;
+    unsigned long rrl_dropped_;
+    unsigned long rrl_slipped_;
+    // Workers at index >= active_workers_ are on standby. Written under
+    // park_mutex_; the sampling state below is guarded by scale_mutex_.
+    size_t active_workers_;
+    pthread_cond_t standby_cv_;
+    pthread_mutex_t scale_mutex_;
+    uint64_t next_scale_us_;
+    unsigned int busy_samples_;
+    unsigned int quiet_samples_;
+    UpstreamEngine *upstream_;
+    pthread_mutex_t flight_mutex_;
+    pthread_cond_t flight_cv_;
+    // Keyed by WireKey::bytes.
+    std::map<std::string, Flight *> flights_;
+    unsigned long cache_hits_;
+    unsigned long negative_hits_;
+    unsigned long coalesced_;
+    // Refresh-ahead lookups. Without the async engine they are resolved on
+    // their own thread, fed through prefetch_queue_.
+    size_t prefetch_inflight_;
+    unsigned long prefetches_;
+    unsigned long stale_answers_;
+    pthread_mutex_t prefetch_mutex_;
+    pthread_cond_t prefetch_cv_;
+    std::deque<PrefetchRequest> prefetch_queue_;
+    pthread_t prefetch_thread_;
+    bool prefetch_started_;
+    bool prefetch_stop_;
 };
 
 } // namespace gravastar
@@ -0,0 +1,396 @@
+#include "event_loop.h"
+
+#include "util.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#define GRAVASTAR_HAVE_EPOLL 1
+#include <sys/epoll.h>
+#endif
+
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || \
+    defined(__NetBSD__) || defined(__DragonFly__)
+#define GRAVASTAR_HAVE_KQUEUE 1
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+
+namespace gravastar {
+
+namespace {
+
+const int kMaxEventsPerWait = 64;
+
+bool SetNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+EventBackend ResolveBackend(EventBackend requested) {
+    if (requested != EVENT_BACKEND_AUTO && EventLoop::BackendAvailable(requested)) {
+        return requested;
+    }
+#if defined(GRAVASTAR_HAVE_EPOLL)
+    return EVENT_BACKEND_EPOLL;
+#elif defined(GRAVASTAR_HAVE_KQUEUE)
+    return EVENT_BACKEND_KQUEUE;
+#else
+    return EVENT_BACKEND_POLL;
+#endif
+}
+
+} // namespace
+
+EventLoop::EventLoop(EventBackend backend)
+    : backend_(ResolveBackend(backend)),
+      ok_(false),
+      backend_fd_(-1),
+      poll_dirty_(true) {
+    wake_pipe_[0] = -1;
+    wake_pipe_[1] = -1;
+    if (pipe(wake_pipe_) != 0) {
+        DebugLog(std::string("event loop pipe() failed: ") + std::strerror(errno));
+        return;
+    }
+    SetNonBlocking(wake_pipe_[0]);
+    SetNonBlocking(wake_pipe_[1]);
+#if defined(GRAVASTAR_HAVE_EPOLL)
+    if (backend_ == EVENT_BACKEND_EPOLL) {
+        backend_fd_ = epoll_create(kMaxEventsPerWait);
+        if (backend_fd_ < 0) {
+            DebugLog(std::string("epoll_create() failed: ") + std::strerror(errno));
+            return;
+        }
+        fcntl(backend_fd_, F_SETFD, FD_CLOEXEC);
+    }
+#endif
+#if defined(GRAVASTAR_HAVE_KQUEUE)
+    if (backend_ == EVENT_BACKEND_KQUEUE) {
+        backend_fd_ = kqueue();
+        if (backend_fd_ < 0) {
+            DebugLog(std::string("kqueue() failed: ") + std::strerror(errno));
+            return;
+        }
+    }
+#endif
+    ok_ = Register(wake_pipe_[0], EVENT_READ, 0);
+}
+
+EventLoop::~EventLoop() {
+    if (backend_fd_ >= 0) {
+        close(backend_fd_);
+    }
+    if (wake_pipe_[0] >= 0) {
+        close(wake_pipe_[0]);
+    }
+    if (wake_pipe_[1] >= 0) {
+        close(wake_pipe_[1]);
+    }
+}
+
+bool EventLoop::Add(int fd, unsigned int events) {
+    std::map<int, unsigned int>::iterator it = registered_.find(fd);
+    if (it != registered_.end()) {
+        return Modify(fd, events);
+    }
+    if (!Register(fd, events, 0)) {
+        return false;
+    }
+    registered_[fd] = events;
+    return true;
+}
+
+bool EventLoop::Modify(int fd, unsigned int events) {
+    std::map<int, unsigned int>::iterator it = registered_.find(fd);
+    if (it == registered_.end()) {
+        return Add(fd, events);
+    }
+    if (it->second == events) {
+        return true;
+    }
+    if (!Register(fd, events, it->second)) {
+        return false;
+    }
+    it->second = events;
+    return true;
+}
+
+bool EventLoop::Remove(int fd) {
+    std::map<int, unsigned int>::iterator it = registered_.find(fd);
+    if (it == registered_.end()) {
+        return false;
+    }
+    bool ok = Register(fd, 0, it->second);
+    registered_.erase(it);
+    return ok;
+}
+
+bool EventLoop::Register(int fd, unsigned int events, unsigned int previous) {
+#if defined(GRAVASTAR_HAVE_EPOLL)
+    if (backend_ == EVENT_BACKEND_EPOLL) {
+        struct epoll_event ev;
+        std::memset(&ev, 0, sizeof(ev));
+        ev.data.fd = fd;
+        if (events & EVENT_READ) {
+            ev.events |= EPOLLIN;
+        }
+        if (events & EVENT_WRITE) {
+            ev.events |= EPOLLOUT;
+        }
+        // An fd with no interest is kept out of the kernel set, where it
+        // would still report hang-ups and errors. It is in the set exactly
+        // when its mask is non-zero.
+        if (previous == 0 && events == 0) {
+            return true;
+        }
+        int op = EPOLL_CTL_MOD;
+        if (previous == 0) {
+            op = EPOLL_CTL_ADD;
+        } else if (events == 0) {
+            op = EPOLL_CTL_DEL;
+        }
+        if (epoll_ctl(backend_fd_, op, fd, &ev) != 0) {
+            DebugLog(std::string("epoll_ctl() failed: ") + std::strerror(errno));
+            return false;
+        }
+        return true;
+    }
+#endif
+#if defined(GRAVASTAR_HAVE_KQUEUE)
+    if (backend_ == EVENT_BACKEND_KQUEUE) {
+        struct kevent changes[2];
+        int count = 0;
+        if ((events & EVENT_READ) && !(previous & EVENT_READ)) {
+            EV_SET(&changes[count++], fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+        } else if (!(events & EVENT_READ) && (previous & EVENT_READ)) {
+            EV_SET(&changes[count++], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+        }
+        if ((events & EVENT_WRITE) && !(previous & EVENT_WRITE)) {
+            EV_SET(&changes[count++], fd, EVFILT_WRITE, EV_ADD, 0, 0, NULL);
+        } else if (!(events & EVENT_WRITE) && (previous & EVENT_WRITE)) {
+            EV_SET(&changes[count++], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+        }
+        if (count > 0 && kevent(backend_fd_, changes, count, NULL, 0, NULL) != 0) {
+            DebugLog(std::string("kevent() failed: ") + std::strerror(errno));
+            return false;
+        }
+        return true;
+    }
+#endif
+    (void)fd;
+    (void)events;
+    (void)previous;
+    poll_dirty_ = true;
+    return true;
+}
+
+int EventLoop::Wait(int timeout_ms, std::vector<LoopEvent> *out) {
+    out->clear();
+#if defined(GRAVASTAR_HAVE_EPOLL)
+    if (backend_ == EVENT_BACKEND_EPOLL) {
+        struct epoll_event evs[kMaxEventsPerWait];
+        int n = epoll_wait(backend_fd_, evs, kMaxEventsPerWait, timeout_ms);
+        if (n < 0) {
+            return errno == EINTR ? 0 : -1;
+        }
+        for (int i = 0; i < n; ++i) {
+            if (evs[i].data.fd == wake_pipe_[0]) {
+                DrainWake();
+                continue;
+            }
+            LoopEvent ev;
+            ev.fd = evs[i].data.fd;
+            ev.events = 0;
+            if (evs[i].events & EPOLLIN) {
+                ev.events |= EVENT_READ;
+            }
+            if (evs[i].events & EPOLLOUT) {
+                ev.events |= EVENT_WRITE;
+            }
+            if (evs[i].events & (EPOLLERR | EPOLLHUP)) {
+                ev.events |= EVENT_ERROR;
+            }
+            out->push_back(ev);
+        }
+        return static_cast<int>(out->size());
+    }
+#endif
+#if defined(GRAVASTAR_HAVE_KQUEUE)
+    if (backend_ == EVENT_BACKEND_KQUEUE) {
+        struct kevent evs[kMaxEventsPerWait];
+        struct timespec ts;
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = static_cast<long>(timeout_ms % 1000) * 1000000L;
+        int n = kevent(backend_fd_, NULL, 0, evs, kMaxEventsPerWait,
+                       timeout_ms < 0 ? NULL : &ts);
+        if (n < 0) {
+            return errno == EINTR ? 0 : -1;
+        }
+        for (int i = 0; i < n; ++i) {
+            int fd = static_cast<int>(evs[i].ident);
+            if (fd == wake_pipe_[0]) {
+                DrainWake();
+                continue;
+            }
+            LoopEvent ev;
+            ev.fd = fd;
+            ev.events = 0;
+            if (evs[i].filter == EVFILT_READ) {
+                ev.events |= EVENT_READ;
+            } else if (evs[i].filter == EVFILT_WRITE) {
+                ev.events |= EVENT_WRITE;
+            }
+            if (evs[i].flags & (EV_EOF | EV_ERROR)) {
+                ev.events |= EVENT_ERROR;
+            }
+            out->push_back(ev);
+        }
+        return static_cast<int>(out->size());
+    }
+#endif
+    if (poll_dirty_) {
+        poll_fds_.clear();
+        struct pollfd wake;
+        wake.fd = wake_pipe_[0];
+        wake.events = POLLIN;
+        wake.revents = 0;
+        poll_fds_.push_back(wake);
+        for (std::map<int, unsigned int>::const_iterator it = registered_.begin();
+             it != registered_.end(); ++it) {
+            struct pollfd p;
+            p.fd = it->first;
+            p.events = 0;
+            p.revents = 0;
+            if (it->second & EVENT_READ) {
+                p.events |= POLLIN;
+            }
+            if (it->second & EVENT_WRITE) {
+                p.events |= POLLOUT;
+            }
+            poll_fds_.push_back(p);
+        }
+        poll_dirty_ = false;
+    }
+    int n = poll(&poll_fds_[0], static_cast<nfds_t>(poll_fds_.size()), timeout_ms);
+    if (n < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    for (size_t i = 0; i < poll_fds_.size() && n > 0; ++i) {
+        short revents = poll_fds_[i].revents;
+        if (revents == 0) {
+            continue;
+        }
+        --n;
+        if (i == 0) {
+            DrainWake();
+            continue;
+        }
+        LoopEvent ev;
+        ev.fd = poll_fds_[i].fd;
+        ev.events = 0;
+        if (revents & POLLIN) {
+            ev.events |= EVENT_READ;
+        }
+        if (revents & POLLOUT) {
+            ev.events |= EVENT_WRITE;
+        }
+        if (revents & (POLLERR | POLLHUP | POLLNVAL)) {
+            ev.events |= EVENT_ERROR;
+        }
+        out->push_back(ev);
+    }
+    return static_cast<int>(out->size());
+}
+
+void EventLoop::Wake() {
+    if (wake_pipe_[1] < 0) {
+        return;
+    }
+    unsigned char byte = 1;
+    ssize_t rc = write(wake_pipe_[1], &byte, 1);
+    (void)rc;
+}
+
+void EventLoop::DrainWake() {
+    unsigned char buf[64];
+    while (read(wake_pipe_[0], buf, sizeof(buf)) > 0) {
+    }
+}
+
+bool EventLoop::BackendAvailable(EventBackend backend) {
+    switch (backend) {
+    case EVENT_BACKEND_AUTO:
+    case EVENT_BACKEND_POLL:
+        return true;
+    case EVENT_BACKEND_EPOLL:
+#if defined(GRAVASTAR_HAVE_EPOLL)
+        return true;
+#else
+        return false;
+#endif
+    case EVENT_BACKEND_KQUEUE:
+#if defined(GRAVASTAR_HAVE_KQUEUE)
+        return true;
+#else
+        return false;
+#endif
+    }
+    return false;
+}
+
+bool EventLoop::ParseBackend(const std::string &name, EventBackend *out) {
+    EventBackend backend;
+    if (name == "auto") {
+        backend = EVENT_BACKEND_AUTO;
+    } else if (name == "epoll") {
+        backend = EVENT_BACKEND_EPOLL;
+    } else if (name == "kqueue") {
+        backend = EVENT_BACKEND_KQUEUE;
+    } else if (name == "poll") {
+        backend = EVENT_BACKEND_POLL;
+    } else {
+        return false;
+    }
+    if (!BackendAvailable(backend)) {
+        return false;
+    }
+    if (out) {
+        *out = backend;
+    }
+    return true;
+}
+
+const char *EventLoop::BackendName(EventBackend backend) {
+    switch (backend) {
+    case EVENT_BACKEND_AUTO:
+        return "auto";
+    case EVENT_BACKEND_EPOLL:
+        return "epoll";
+    case EVENT_BACKEND_KQUEUE:
+        return "kqueue";
+    case EVENT_BACKEND_POLL:
+        return "poll";
+    }
+    return "unknown";
+}
+
+bool EventLoop::WaitForFd(int fd, bool want_write, int timeout_ms) {
+    struct pollfd p;
+    p.fd = fd;
+    p.events = want_write ? POLLOUT : POLLIN;
+    p.revents = 0;
+    for (;;) {
+        int ready = poll(&p, 1, timeout_ms);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        return ready > 0 && p.revents != 0;
+    }
+}
+
+} // namespace gravastar
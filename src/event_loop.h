@@ -0,0 +1,75 @@
+#ifndef GRAVASTAR_EVENT_LOOP_H
+#define GRAVASTAR_EVENT_LOOP_H
+
+#include <map>
+#include <poll.h>
+#include <string>
+#include <vector>
+
+namespace gravastar {
+
+enum EventBackend {
+    EVENT_BACKEND_AUTO,
+    EVENT_BACKEND_EPOLL,
+    EVENT_BACKEND_KQUEUE,
+    EVENT_BACKEND_POLL
+};
+
+enum {
+    EVENT_READ = 1,
+    EVENT_WRITE = 2,
+    EVENT_ERROR = 4
+};
+
+struct LoopEvent {
+    int fd;
+    unsigned int events;
+};
+
+// Readiness multiplexer over epoll (Linux), kqueue (BSD/macOS) or poll().
+// Registration and Wait() belong to the owning thread; Wake() may be called
+// from any thread to interrupt a blocked Wait().
+class EventLoop {
+public:
+    explicit EventLoop(EventBackend backend = EVENT_BACKEND_AUTO);
+    ~EventLoop();
+
+    bool ok() const { return ok_; }
+    EventBackend backend() const { return backend_; }
+
+    bool Add(int fd, unsigned int events);
+    bool Modify(int fd, unsigned int events);
+    bool Remove(int fd);
+
+    // Blocks for up to timeout_ms (negative waits forever) and fills `out`
+    // with ready descriptors. Returns the number of events, 0 on timeout or
+    // wake-up, and -1 on error.
+    int Wait(int timeout_ms, std::vector<LoopEvent> *out);
+    void Wake();
+
+    static bool BackendAvailable(EventBackend backend);
+    static bool ParseBackend(const std::string &name, EventBackend *out);
+    static const char *BackendName(EventBackend backend);
+
+    // One-shot wait on a single descriptor, free of FD_SETSIZE limits.
+    static bool WaitForFd(int fd, bool want_write, int timeout_ms);
+
+private:
+    EventLoop(const EventLoop &);
+    EventLoop &operator=(const EventLoop &);
+
+    bool Register(int fd, unsigned int events, unsigned int previous);
+    void DrainWake();
+
+    EventBackend backend_;
+    bool ok_;
+    int backend_fd_;
+    int wake_pipe_[2];
+    std::map<int, unsigned int> registered_;
+    std::vector<struct pollfd> poll_fds_;
+    bool poll_dirty_;
+};
+
+} // namespace gravastar
+
+#endif // GRAVASTAR_EVENT_LOOP_H
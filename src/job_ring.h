@@ -0,0 +1,108 @@
+#ifndef GRAVASTAR_JOB_RING_H
+#define GRAVASTAR_JOB_RING_H
+
+#include "atomic_ops.h"
+
+#include <cstddef>
+#include <vector>
+
+namespace gravastar {
+
+// Bounded lock-free ring (Vyukov's sequence-numbered MPMC design). Each
+// worker owns one: the listener pushes, the owner pops, and idle siblings
+// steal from the same end. Slots are allocated once up front; items move in
+// and out with T::Swap(), so a T that owns a buffer hands an empty one back
+// instead of copying.
+template <typename T>
+class JobRing {
+public:
+    explicit JobRing(size_t min_capacity)
+        : mask_(RoundUpPow2(min_capacity) - 1),
+          cells_(mask_ + 1),
+          enqueue_pos_(0),
+          dequeue_pos_(0) {
+        for (size_t i = 0; i < cells_.size(); ++i) {
+            cells_[i].seq = i;
+        }
+    }
+
+    size_t capacity() const { return mask_ + 1; }
+
+    bool TryPush(T *item) {
+        size_t pos = AtomicLoadRelaxed(&enqueue_pos_);
+        for (;;) {
+            Cell &cell = cells_[pos & mask_];
+            size_t seq = AtomicLoad(&cell.seq);
+            long diff = static_cast<long>(seq) - static_cast<long>(pos);
+            if (diff == 0) {
+                if (AtomicCompareExchange(&enqueue_pos_, &pos, pos + 1)) {
+                    cell.data.Swap(*item);
+                    AtomicStore(&cell.seq, pos + 1);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = AtomicLoadRelaxed(&enqueue_pos_);
+            }
+        }
+    }
+
+    bool TryPop(T *out) {
+        size_t pos = AtomicLoadRelaxed(&dequeue_pos_);
+        for (;;) {
+            Cell &cell = cells_[pos & mask_];
+            size_t seq = AtomicLoad(&cell.seq);
+            long diff = static_cast<long>(seq) - static_cast<long>(pos + 1);
+            if (diff == 0) {
+                if (AtomicCompareExchange(&dequeue_pos_, &pos, pos + 1)) {
+                    cell.data.Swap(*out);
+                    AtomicStore(&cell.seq, pos + mask_ + 1);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = AtomicLoadRelaxed(&dequeue_pos_);
+            }
+        }
+    }
+
+    // Racy snapshot; good enough for load balancing and stats.
+    size_t ApproxSize() const {
+        size_t head = AtomicLoadRelaxed(&dequeue_pos_);
+        size_t tail = AtomicLoadRelaxed(&enqueue_pos_);
+        return tail > head ? tail - head : 0;
+    }
+
+private:
+    JobRing(const JobRing &);
+    JobRing &operator=(const JobRing &);
+
+    struct Cell {
+        size_t seq;
+        T data;
+    };
+
+    static size_t RoundUpPow2(size_t n) {
+        size_t v = 2;
+        while (v < n) {
+            v <<= 1;
+        }
+        return v;
+    }
+
+    size_t mask_;
+    std::vector<Cell> cells_;
+    // Producers and consumers hammer different counters; keep them on
+    // separate cache lines.
+    char pad0_[64];
+    size_t enqueue_pos_;
+    char pad1_[64];
+    size_t dequeue_pos_;
+    char pad2_[64];
+};
+
+} // namespace gravastar
+
+#endif // GRAVASTAR_JOB_RING_H
@@ -1,24 +1,19 @@
 #include "local_records.h"
 
+#include <sstream>
+
 #include "dns_packet.h"
 #include "util.h"
 
-#include <cstdio>
-
 namespace gravastar {
 
 namespace {
 
+// Local records only answer class IN.
 std::string MakeKey(const std::string &name, unsigned short qtype) {
-    std::string key = ToLower(name);
-    if (!key.empty() && key[key.size() - 1] == '.') {
-        key.resize(key.size() - 1);
-    }
-    key.append("|");
-    char buf[16];
-    std::snprintf(buf, 16, "%u", static_cast<unsigned int>(qtype));
-    key.append(buf);
-    return key;
+    WireKey key;
+    MakeWireKey(name, qtype, 1, &key);
+    return key.bytes;
 }
 
 unsigned short TypeFromString(const std::string &type) {
@@ -43,8 +38,34 @@ unsigned short TypeFromString(const std::string &type) {
     return 0;
 }
 
+// MX values are "preference exchange"; a bare name gets preference 10.
+void ParseMxValue(const std::string &value,
+                  unsigned short *preference,
+                  std::string *exchange) {
+    unsigned short pref = 10;
+    std::string target = Trim(value);
+    std::istringstream iss(value);
+    unsigned long parsed_pref = 0;
+    std::string parsed_target;
+    if ((iss >> parsed_pref) && (iss >> parsed_target)) {
+        if (parsed_pref <= 65535) {
+            pref = static_cast<unsigned short>(parsed_pref);
+        }
+        target = parsed_target;
+    }
+    if (preference) {
+        *preference = pref;
+    }
+    if (exchange) {
+        *exchange = target;
+    }
+}
+
 } // namespace
 
+LocalRecords::LocalRecords() : generation_(0) {
+}
+
 void LocalRecords::Load(const std::vector<LocalRecord> &records) {
     records_.clear();
     for (size_t i = 0; i < records.size(); ++i) {
@@ -53,22 +74,60 @@ void LocalRecords::Load(const std::vector<LocalRecord> &records) {
         if (qtype == 0) {
             continue;
         }
-        records_[MakeKey(rec.name, qtype)] = rec;
+        Entry &entry = records_[MakeKey(rec.name, qtype)];
+        entry.record = rec;
+        unsigned short preference = 0;
+        std::string value = rec.value;
+        if (qtype == DNS_TYPE_MX) {
+            ParseMxValue(rec.value, &preference, &value);
+        }
+        MakeRecordTemplate(qtype, value, preference, 60, &entry.answer);
     }
+    ++generation_;
 }
 
 bool LocalRecords::Resolve(const std::string &name, unsigned short qtype, std::string *value, unsigned short *rtype) const {
-    std::map<std::string, LocalRecord>::const_iterator it = records_.find(MakeKey(name, qtype));
-    if (it == records_.end()) {
+    WireKey key;
+    MakeWireKey(name, qtype, 1, &key);
+    return Resolve(key, value, rtype);
+}
+
+bool LocalRecords::Resolve(const WireKey &key, std::string *value, unsigned short *rtype) const {
+    const Entry *entry = Find(key);
+    if (!entry) {
         return false;
     }
     if (value) {
-        *value = it->second.value;
+        *value = entry->record.value;
     }
     if (rtype) {
-        *rtype = qtype;
+        size_t at = key.bytes.size() - 5;
+        *rtype = static_cast<unsigned short>(
+            (static_cast<unsigned char>(key.bytes[at]) << 8) |
+            static_cast<unsigned char>(key.bytes[at + 1]));
     }
     return true;
 }
 
+const ResponseTemplate *LocalRecords::Answer(const WireKey &key) const {
+    const Entry *entry = Find(key);
+    return entry ? &entry->answer : NULL;
+}
+
+const LocalRecords::Entry *LocalRecords::Find(const WireKey &key) const {
+    // Root name, QTYPE, QCLASS and the flag byte at the least.
+    if (key.bytes.size() < 6) {
+        return NULL;
+    }
+    std::map<std::string, Entry>::const_iterator it;
+    if (key.bytes[key.bytes.size() - 1] == 0) {
+        it = records_.find(key.bytes);
+    } else {
+        std::string bare(key.bytes);
+        bare[bare.size() - 1] = 0;
+        it = records_.find(bare);
+    }
+    return it == records_.end() ? NULL : &it->second;
+}
+
 } // namespace gravastar
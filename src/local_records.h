@@ -6,16 +6,35 @@
 #include <vector>
 
 #include "config.h"
+#include "dns_packet.h"
 
 namespace gravastar {
 
 class LocalRecords {
 public:
+    LocalRecords();
+
     void Load(const std::vector<LocalRecord> &records);
     bool Resolve(const std::string &name, unsigned short qtype, std::string *value, unsigned short *rtype) const;
+    // Looks up a question by its wire key; query flag bits are ignored.
+    bool Resolve(const WireKey &key, std::string *value, unsigned short *rtype) const;
+    // The answer to the question, prepared by Load(), or NULL. It stays
+    // valid until the next Load().
+    const ResponseTemplate *Answer(const WireKey &key) const;
+    // Bumped by every Load().
+    uint32_t generation() const { return generation_; }
 
 private:
-    std::map<std::string, LocalRecord> records_;
+    struct Entry {
+        LocalRecord record;
+        ResponseTemplate answer;
+    };
+
+    const Entry *Find(const WireKey &key) const;
+
+    // Keyed by WireKey::bytes with the flag bits clear.
+    std::map<std::string, Entry> records_;
+    uint32_t generation_;
 };
 
 } // namespace gravastar
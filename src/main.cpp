@@ -11,6 +11,7 @@
 
 #include <sys/stat.h>
 #include <cstdlib>
+#include <fstream>
 #include <iostream>
 #include <sstream>
 #include <set>
@@ -31,6 +32,29 @@ std::string JoinPath(const std::string &dir, const std::string &path) {
     return dir + "/" + path;
 }
 
+// FNV-1a over the contents of every file an answer depends on, so that a
+// cache snapshot is only reused under the configuration that built it.
+// A missing file hashes as empty.
+uint64_t HashFiles(const std::vector<std::string> &paths) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < paths.size(); ++i) {
+        std::ifstream in(paths[i].c_str(), std::ios::binary);
+        char buf[4096];
+        while (in) {
+            in.read(buf, sizeof(buf));
+            std::streamsize got = in.gcount();
+            for (std::streamsize j = 0; j < got; ++j) {
+                hash ^= static_cast<unsigned char>(buf[j]);
+                hash *= 1099511628211ULL;
+            }
+        }
+        // Separates the files, so moving lines between two of them counts.
+        hash ^= 0xff;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
 void PrintUsage(const char *argv0) {
     std::cerr << "Usage: " << argv0 << " [-c config_dir] [-u upstream_blocklists] [-d]\n";
 }
@@ -111,12 +135,13 @@ int main(int argc, char **argv) {
         std::cerr << "Blocklist error: " << err << "\n";
         return 1;
     }
+    blocklist.SetDomains(block_domains);
     {
         std::ostringstream out;
-        out << "Blocklist loaded: " << block_domains.size() << " domains";
+        out << "Blocklist loaded: " << blocklist.size() << " domains, "
+            << blocklist.memory_bytes() / 1024 << " KiB indexed";
         gravastar::LogInfo(out.str());
     }
-    blocklist.SetDomains(block_domains);
 
     std::vector<gravastar::LocalRecord> local_records_vec;
     std::string local_path = JoinPath(config_dir, config.local_records_file);
@@ -144,7 +169,45 @@ int main(int argc, char **argv) {
     gravastar::LocalRecords local_records;
     local_records.Load(local_records_vec);
 
-    gravastar::DnsCache cache(config.cache_size_bytes, config.cache_ttl_sec);
+    gravastar::DnsCache cache(config.cache_size_bytes, config.cache_ttl_sec,
+                              config.cache_shards);
+    cache.SetTtlClamp(config.cache_min_ttl, config.cache_max_ttl);
+    cache.SetNegativeTtlCap(config.cache_max_negative_ttl);
+    cache.SetPrefetch(config.prefetch_percent, config.prefetch_min_hits);
+    cache.SetStaleWindow(config.serve_stale_sec);
+    gravastar::CachePolicy cache_policy = gravastar::CACHE_POLICY_S3FIFO;
+    gravastar::DnsCache::ParsePolicy(config.cache_policy, &cache_policy);
+    cache.SetPolicy(cache_policy);
+    if (cache.shards() < config.cache_shards) {
+        std::ostringstream out;
+        out << "cache_size_mb is too small for " << config.cache_shards
+            << " cache shards; using " << cache.shards();
+        gravastar::LogWarn(out.str());
+    }
+    std::string snapshot_path;
+    uint64_t snapshot_tag = 0;
+    if (!config.cache_snapshot_file.empty()) {
+        snapshot_path = JoinPath(config_dir, config.cache_snapshot_file);
+        std::vector<std::string> answer_files;
+        answer_files.push_back(main_path);
+        answer_files.push_back(block_path);
+        answer_files.push_back(local_path);
+        answer_files.push_back(upstream_path);
+        if (upstream_mode) {
+            answer_files.push_back(upstream_blocklists_path);
+        }
+        snapshot_tag = HashFiles(answer_files);
+    }
+    if (!snapshot_path.empty() && stat(snapshot_path.c_str(), &st) == 0) {
+        size_t loaded = 0;
+        bool ok = cache.Load(snapshot_path, snapshot_tag, &loaded, &err);
+        std::ostringstream out;
+        out << "Cache snapshot loaded: " << loaded << " entries";
+        gravastar::LogInfo(out.str());
+        if (!ok) {
+            gravastar::LogWarn("Cache snapshot error: " + err);
+        }
+    }
 
     gravastar::UpstreamResolver resolver;
     resolver.SetUdpServers(udp_servers);
@@ -184,5 +247,15 @@ int main(int argc, char **argv) {
         updater->Stop();
         delete updater;
     }
+    if (!snapshot_path.empty()) {
+        size_t saved = 0;
+        if (cache.Save(snapshot_path, snapshot_tag, &saved, &err)) {
+            std::ostringstream out;
+            out << "Cache snapshot saved: " << saved << " entries";
+            gravastar::LogInfo(out.str());
+        } else {
+            gravastar::LogWarn("Cache snapshot error: " + err);
+        }
+    }
     return 0;
 }
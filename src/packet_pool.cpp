@@ -0,0 +1,62 @@
+#include "packet_pool.h"
+
+#include "atomic_ops.h"
+
+namespace gravastar {
+
+PacketPool::PacketPool(size_t count, size_t buffer_size)
+    : buffer_size_(buffer_size),
+      storage_(count * buffer_size),
+      buffers_(count),
+      free_(count),
+      in_use_(0),
+      high_water_(0),
+      exhausted_(0) {
+    for (size_t i = 0; i < buffers_.size(); ++i) {
+        buffers_[i].data = &storage_[i * buffer_size];
+        buffers_[i].len = 0;
+        buffers_[i].cap = buffer_size;
+        Slot slot;
+        slot.buffer = &buffers_[i];
+        free_.TryPush(&slot);
+    }
+}
+
+PacketBuffer *PacketPool::Acquire() {
+    Slot slot;
+    slot.buffer = NULL;
+    if (!free_.TryPop(&slot)) {
+        AtomicFetchAddRelaxed(&exhausted_, 1UL);
+        return NULL;
+    }
+    size_t used = AtomicFetchAdd(&in_use_, static_cast<size_t>(1)) + 1;
+    size_t peak = AtomicLoadRelaxed(&high_water_);
+    while (used > peak && !AtomicCompareExchange(&high_water_, &peak, used)) {
+    }
+    slot.buffer->len = 0;
+    return slot.buffer;
+}
+
+void PacketPool::Release(PacketBuffer *buffer) {
+    if (!buffer) {
+        return;
+    }
+    Slot slot;
+    slot.buffer = buffer;
+    AtomicFetchSub(&in_use_, static_cast<size_t>(1));
+    free_.TryPush(&slot);
+}
+
+size_t PacketPool::in_use() const {
+    return AtomicLoadRelaxed(&in_use_);
+}
+
+size_t PacketPool::high_water() const {
+    return AtomicLoadRelaxed(&high_water_);
+}
+
+unsigned long PacketPool::exhausted() const {
+    return AtomicLoadRelaxed(&exhausted_);
+}
+
+} // namespace gravastar
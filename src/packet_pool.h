@@ -0,0 +1,61 @@
+#ifndef GRAVASTAR_PACKET_POOL_H
+#define GRAVASTAR_PACKET_POOL_H
+
+#include "job_ring.h"
+
+#include <cstddef>
+#include <vector>
+
+namespace gravastar {
+
+struct PacketBuffer {
+    unsigned char *data;
+    size_t len;
+    size_t cap;
+};
+
+// Fixed set of equally sized packet buffers carved from one allocation at
+// startup. A received datagram lives in one buffer from recvmmsg() through
+// the worker and back out through sendmmsg(); the response is written over
+// the query in place. Acquire/Release are lock-free and callable from any
+// thread.
+class PacketPool {
+public:
+    PacketPool(size_t count, size_t buffer_size);
+
+    // Returns NULL when every buffer is in flight.
+    PacketBuffer *Acquire();
+    void Release(PacketBuffer *buffer);
+
+    size_t count() const { return buffers_.size(); }
+    size_t buffer_size() const { return buffer_size_; }
+    size_t in_use() const;
+    size_t high_water() const;
+    unsigned long exhausted() const;
+
+private:
+    PacketPool(const PacketPool &);
+    PacketPool &operator=(const PacketPool &);
+
+    struct Slot {
+        PacketBuffer *buffer;
+
+        void Swap(Slot &other) {
+            PacketBuffer *tmp = buffer;
+            buffer = other.buffer;
+            other.buffer = tmp;
+        }
+    };
+
+    size_t buffer_size_;
+    std::vector<unsigned char> storage_;
+    std::vector<PacketBuffer> buffers_;
+    JobRing<Slot> free_;
+    size_t in_use_;
+    size_t high_water_;
+    unsigned long exhausted_;
+};
+
+} // namespace gravastar
+
+#endif // GRAVASTAR_PACKET_POOL_H
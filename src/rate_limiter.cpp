@@ -0,0 +1,91 @@
+#include "rate_limiter.h"
+
+namespace gravastar {
+
+namespace {
+
+size_t RoundUpPow2(size_t n) {
+    size_t v = 1;
+    while (v < n) {
+        v <<= 1;
+    }
+    return v;
+}
+
+uint64_t MixKey(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key;
+}
+
+} // namespace
+
+RateLimiter::RateLimiter(size_t entries, unsigned int rate, unsigned int burst)
+    : rate_(rate),
+      burst_(static_cast<uint64_t>(burst == 0 ? rate : burst) * 1000) {
+    size_t sets = RoundUpPow2((entries + kWays - 1) / kWays);
+    if (sets < kStripes) {
+        sets = kStripes;
+    }
+    set_mask_ = sets - 1;
+    Bucket empty;
+    empty.key = 0;
+    empty.last_us = 0;
+    empty.tokens = 0;
+    empty.limited = 0;
+    buckets_.assign(sets * kWays, empty);
+    for (size_t i = 0; i < kStripes; ++i) {
+        pthread_mutex_init(&locks_[i], NULL);
+    }
+}
+
+RateLimiter::~RateLimiter() {
+    for (size_t i = 0; i < kStripes; ++i) {
+        pthread_mutex_destroy(&locks_[i]);
+    }
+}
+
+bool RateLimiter::Allow(uint64_t key, uint64_t now_us, unsigned long *limited) {
+    size_t set = static_cast<size_t>(MixKey(key)) & set_mask_;
+    Bucket *ways = &buckets_[set * kWays];
+    pthread_mutex_t *lock = &locks_[set % kStripes];
+    pthread_mutex_lock(lock);
+    Bucket *bucket = NULL;
+    Bucket *oldest = &ways[0];
+    for (size_t i = 0; i < kWays; ++i) {
+        if (ways[i].last_us != 0 && ways[i].key == key) {
+            bucket = &ways[i];
+            break;
+        }
+        if (ways[i].last_us < oldest->last_us) {
+            oldest = &ways[i];
+        }
+    }
+    if (!bucket) {
+        bucket = oldest;
+        bucket->key = key;
+        bucket->tokens = static_cast<uint32_t>(burst_);
+        bucket->limited = 0;
+    } else if (now_us > bucket->last_us) {
+        // rate tokens per second is rate thousandths per millisecond.
+        uint64_t refill = (now_us - bucket->last_us) * rate_ / 1000;
+        uint64_t tokens = bucket->tokens + refill;
+        bucket->tokens = static_cast<uint32_t>(tokens > burst_ ? burst_ : tokens);
+    }
+    bucket->last_us = now_us == 0 ? 1 : now_us;
+    bool allowed = bucket->tokens >= 1000;
+    if (allowed) {
+        bucket->tokens -= 1000;
+        bucket->limited = 0;
+    } else {
+        ++bucket->limited;
+        if (limited) {
+            *limited = bucket->limited;
+        }
+    }
+    pthread_mutex_unlock(lock);
+    return allowed;
+}
+
+} // namespace gravastar
@@ -0,0 +1,52 @@
+#ifndef GRAVASTAR_RATE_LIMITER_H
+#define GRAVASTAR_RATE_LIMITER_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <vector>
+
+namespace gravastar {
+
+// Token buckets in a fixed, 4-way set-associative table sized at startup.
+// A key that is not present evicts the least recently seen bucket of its
+// set, so a flood of spoofed sources recycles entries instead of growing
+// the table. Sets are guarded by a small number of striped mutexes, making
+// Allow() safe to call from every listener thread.
+class RateLimiter {
+public:
+    // `rate` tokens per second, at most `burst` saved up; `entries` is
+    // rounded up to a power of two.
+    RateLimiter(size_t entries, unsigned int rate, unsigned int burst);
+    ~RateLimiter();
+
+    // Spends one token for `key`. When the bucket is empty returns false and,
+    // if `limited` is non-NULL, stores how many times in a row this key has
+    // now been refused.
+    bool Allow(uint64_t key, uint64_t now_us, unsigned long *limited);
+
+    size_t entries() const { return buckets_.size(); }
+
+private:
+    RateLimiter(const RateLimiter &);
+    RateLimiter &operator=(const RateLimiter &);
+
+    struct Bucket {
+        uint64_t key;
+        uint64_t last_us;
+        uint32_t tokens;  // thousandths of a token
+        uint32_t limited;
+    };
+
+    static const size_t kWays = 4;
+    static const size_t kStripes = 16;
+
+    uint64_t rate_;
+    uint64_t burst_;
+    size_t set_mask_;
+    std::vector<Bucket> buckets_;
+    pthread_mutex_t locks_[kStripes];
+};
+
+} // namespace gravastar
+
+#endif // GRAVASTAR_RATE_LIMITER_H
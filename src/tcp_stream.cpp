@@ -0,0 +1,107 @@
+#include "tcp_stream.h"
+
+#include <cerrno>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace gravastar {
+
+namespace {
+
+const size_t kReadChunk = 4096;
+// Two maximum-size messages; beyond that the peer is not waiting for us.
+const size_t kMaxBuffered = 2 * (65535 + 2);
+// Unsent answers a peer may leave queued before we stop reading from it.
+const size_t kMaxQueuedOutput = 64 * 1024;
+
+} // namespace
+
+TcpStream::TcpStream(int fd)
+    : fd_(fd), in_start_(0), out_start_(0) {}
+
+bool TcpStream::ReadAvailable() {
+    if (in_start_ > 0 && in_start_ * 2 >= in_.size()) {
+        in_.erase(in_.begin(), in_.begin() + in_start_);
+        in_start_ = 0;
+    }
+    while (in_.size() - in_start_ < kMaxBuffered) {
+        size_t used = in_.size();
+        in_.resize(used + kReadChunk);
+        ssize_t got = recv(fd_, &in_[used], kReadChunk, 0);
+        if (got > 0) {
+            in_.resize(used + static_cast<size_t>(got));
+            continue;
+        }
+        in_.resize(used);
+        if (got == 0) {
+            return false;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    return true;
+}
+
+bool TcpStream::PeekMessage(const unsigned char **data, size_t *len) const {
+    size_t avail = in_.size() - in_start_;
+    if (avail < 2) {
+        return false;
+    }
+    size_t msg_len = (static_cast<size_t>(in_[in_start_]) << 8) |
+                     in_[in_start_ + 1];
+    if (avail < msg_len + 2) {
+        return false;
+    }
+    *data = msg_len > 0 ? &in_[in_start_ + 2] : NULL;
+    *len = msg_len;
+    return true;
+}
+
+void TcpStream::PopMessage() {
+    const unsigned char *data = NULL;
+    size_t len = 0;
+    if (PeekMessage(&data, &len)) {
+        in_start_ += len + 2;
+    }
+}
+
+bool TcpStream::output_full() const {
+    return out_.size() - out_start_ >= kMaxQueuedOutput;
+}
+
+void TcpStream::QueueMessage(const unsigned char *data, size_t len) {
+    if (len > 65535) {
+        return;
+    }
+    if (out_start_ > 0 && out_start_ == out_.size()) {
+        out_.clear();
+        out_start_ = 0;
+    }
+    out_.push_back(static_cast<unsigned char>((len >> 8) & 0xff));
+    out_.push_back(static_cast<unsigned char>(len & 0xff));
+    out_.insert(out_.end(), data, data + len);
+}
+
+bool TcpStream::Flush() {
+    while (out_start_ < out_.size()) {
+        ssize_t sent = send(fd_, &out_[out_start_], out_.size() - out_start_, 0);
+        if (sent > 0) {
+            out_start_ += static_cast<size_t>(sent);
+            continue;
+        }
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        return false;
+    }
+    out_.clear();
+    out_start_ = 0;
+    return true;
+}
+
+} // namespace gravastar
@@ -0,0 +1,46 @@
+#ifndef GRAVASTAR_TCP_STREAM_H
+#define GRAVASTAR_TCP_STREAM_H
+
+#include <cstddef>
+#include <vector>
+
+namespace gravastar {
+
+// Non-blocking DNS-over-TCP framing (RFC 1035 4.2.2): every message is
+// preceded by a two-byte big-endian length. Input is accumulated until whole
+// messages are available; output is queued and written as the socket allows,
+// so several answers can be in flight on one connection.
+class TcpStream {
+public:
+    explicit TcpStream(int fd);
+
+    int fd() const { return fd_; }
+
+    // Reads until the socket would block or enough input is buffered.
+    // Returns false on EOF or a hard error.
+    bool ReadAvailable();
+
+    // Points at the next complete message without consuming it.
+    bool PeekMessage(const unsigned char **data, size_t *len) const;
+    void PopMessage();
+
+    void QueueMessage(const unsigned char *data, size_t len);
+    // Writes as much queued output as the socket accepts. Returns false on a
+    // hard error.
+    bool Flush();
+    bool write_pending() const { return out_start_ < out_.size(); }
+    // True once the peer has left enough unread output that no further
+    // messages should be read from it until Flush() drains some.
+    bool output_full() const;
+
+private:
+    int fd_;
+    std::vector<unsigned char> in_;
+    size_t in_start_;
+    std::vector<unsigned char> out_;
+    size_t out_start_;
+};
+
+} // namespace gravastar
+
+#endif // GRAVASTAR_TCP_STREAM_H
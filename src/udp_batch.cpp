@@ -0,0 +1,212 @@
+#if defined(GRAVASTAR_HAVE_MMSG) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "udp_batch.h"
+
+#include "util.h"
+
+#include <cerrno>
+#include <cstring>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace gravastar {
+
+#ifdef GRAVASTAR_HAVE_MMSG
+namespace {
+
+struct MsgVector {
+    std::vector<struct mmsghdr> hdrs;
+    std::vector<struct iovec> iovs;
+};
+
+} // namespace
+#endif
+
+UdpRecvBatch::UdpRecvBatch(size_t capacity, PacketPool *pool)
+    : pool_(pool),
+      slots_(capacity == 0 ? 1 : capacity, static_cast<PacketBuffer *>(NULL)),
+      addrs_(slots_.size()),
+      addr_lens_(slots_.size(), 0),
+      discarded_(0),
+      msgs_(NULL) {
+#ifdef GRAVASTAR_HAVE_MMSG
+    MsgVector *msgs = new MsgVector();
+    msgs->hdrs.resize(slots_.size());
+    msgs->iovs.resize(slots_.size());
+    msgs_ = msgs;
+#endif
+}
+
+UdpRecvBatch::~UdpRecvBatch() {
+    for (size_t i = 0; i < slots_.size(); ++i) {
+        pool_->Release(slots_[i]);
+    }
+#ifdef GRAVASTAR_HAVE_MMSG
+    delete static_cast<MsgVector *>(msgs_);
+#endif
+}
+
+PacketBuffer *UdpRecvBatch::Take(size_t i) {
+    PacketBuffer *buffer = slots_[i];
+    slots_[i] = NULL;
+    return buffer;
+}
+
+size_t UdpRecvBatch::Refill() {
+    size_t ready = 0;
+    while (ready < slots_.size()) {
+        if (!slots_[ready]) {
+            slots_[ready] = pool_->Acquire();
+            if (!slots_[ready]) {
+                break;
+            }
+        }
+        ++ready;
+    }
+    return ready;
+}
+
+int UdpRecvBatch::Receive(int sock) {
+    size_t ready = Refill();
+    if (ready == 0) {
+        // Every buffer is in flight. Read and drop one datagram so the
+        // socket does not stay readable forever while workers catch up.
+        unsigned char scratch[512];
+        if (recv(sock, scratch, sizeof(scratch), 0) >= 0) {
+            ++discarded_;
+        }
+        return 0;
+    }
+#ifdef GRAVASTAR_HAVE_MMSG
+    MsgVector *msgs = static_cast<MsgVector *>(msgs_);
+    for (size_t i = 0; i < ready; ++i) {
+        msgs->iovs[i].iov_base = slots_[i]->data;
+        msgs->iovs[i].iov_len = slots_[i]->cap;
+        std::memset(&msgs->hdrs[i], 0, sizeof(msgs->hdrs[i]));
+        msgs->hdrs[i].msg_hdr.msg_name = &addrs_[i];
+        msgs->hdrs[i].msg_hdr.msg_namelen = sizeof(addrs_[i]);
+        msgs->hdrs[i].msg_hdr.msg_iov = &msgs->iovs[i];
+        msgs->hdrs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int got = recvmmsg(sock, &msgs->hdrs[0], static_cast<unsigned int>(ready),
+                       MSG_DONTWAIT, NULL);
+    if (got < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return 0;
+        }
+        DebugLog(std::string("recvmmsg() failed: ") + std::strerror(errno));
+        return -1;
+    }
+    for (int i = 0; i < got; ++i) {
+        slots_[i]->len = msgs->hdrs[i].msg_len;
+        addr_lens_[i] = msgs->hdrs[i].msg_hdr.msg_namelen;
+    }
+    return got;
+#else
+    size_t count = 0;
+    while (count < ready) {
+        addr_lens_[count] = sizeof(addrs_[count]);
+        ssize_t received = recvfrom(
+            sock, slots_[count]->data, slots_[count]->cap, 0,
+            reinterpret_cast<struct sockaddr *>(&addrs_[count]),
+            &addr_lens_[count]);
+        if (received < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                break;
+            }
+            DebugLog(std::string("recvfrom() failed: ") + std::strerror(errno));
+            return count > 0 ? static_cast<int>(count) : -1;
+        }
+        slots_[count]->len = static_cast<size_t>(received);
+        ++count;
+    }
+    return static_cast<int>(count);
+#endif
+}
+
+UdpSendBatch::UdpSendBatch(size_t capacity, PacketPool *pool)
+    : pool_(pool),
+      count_(0),
+      buffers_(capacity == 0 ? 1 : capacity, static_cast<PacketBuffer *>(NULL)),
+      addrs_(buffers_.size()),
+      addr_lens_(buffers_.size(), 0),
+      msgs_(NULL) {
+#ifdef GRAVASTAR_HAVE_MMSG
+    MsgVector *msgs = new MsgVector();
+    msgs->hdrs.resize(buffers_.size());
+    msgs->iovs.resize(buffers_.size());
+    msgs_ = msgs;
+#endif
+}
+
+UdpSendBatch::~UdpSendBatch() {
+    for (size_t i = 0; i < count_; ++i) {
+        pool_->Release(buffers_[i]);
+    }
+#ifdef GRAVASTAR_HAVE_MMSG
+    delete static_cast<MsgVector *>(msgs_);
+#endif
+}
+
+bool UdpSendBatch::Add(PacketBuffer *buffer,
+                       const struct sockaddr_in &addr, socklen_t addr_len) {
+    if (count_ >= buffers_.size()) {
+        return false;
+    }
+    buffers_[count_] = buffer;
+    addrs_[count_] = addr;
+    addr_lens_[count_] = addr_len;
+    ++count_;
+    return true;
+}
+
+void UdpSendBatch::Flush(int sock) {
+    if (count_ == 0) {
+        return;
+    }
+#ifdef GRAVASTAR_HAVE_MMSG
+    MsgVector *msgs = static_cast<MsgVector *>(msgs_);
+    for (size_t i = 0; i < count_; ++i) {
+        msgs->iovs[i].iov_base = buffers_[i]->data;
+        msgs->iovs[i].iov_len = buffers_[i]->len;
+        std::memset(&msgs->hdrs[i], 0, sizeof(msgs->hdrs[i]));
+        msgs->hdrs[i].msg_hdr.msg_name = &addrs_[i];
+        msgs->hdrs[i].msg_hdr.msg_namelen = addr_lens_[i];
+        msgs->hdrs[i].msg_hdr.msg_iov = &msgs->iovs[i];
+        msgs->hdrs[i].msg_hdr.msg_iovlen = 1;
+    }
+    size_t sent = 0;
+    while (sent < count_) {
+        int rc = sendmmsg(sock, &msgs->hdrs[sent],
+                          static_cast<unsigned int>(count_ - sent), 0);
+        if (rc <= 0) {
+            if (rc < 0 && errno == EINTR) {
+                continue;
+            }
+            if (rc < 0) {
+                DebugLog(std::string("sendmmsg() failed: ") + std::strerror(errno));
+            }
+            // Skip the datagram that failed so one bad peer cannot wedge the
+            // rest of the batch.
+            sent += 1;
+            continue;
+        }
+        sent += static_cast<size_t>(rc);
+    }
+#else
+    for (size_t i = 0; i < count_; ++i) {
+        sendto(sock, buffers_[i]->data, buffers_[i]->len, 0,
+               reinterpret_cast<const struct sockaddr *>(&addrs_[i]),
+               addr_lens_[i]);
+    }
+#endif
+    for (size_t i = 0; i < count_; ++i) {
+        pool_->Release(buffers_[i]);
+        buffers_[i] = NULL;
+    }
+    count_ = 0;
+}
+
+} // namespace gravastar
@@ -0,0 +1,74 @@
+#ifndef GRAVASTAR_UDP_BATCH_H
+#define GRAVASTAR_UDP_BATCH_H
+
+#include "packet_pool.h"
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <vector>
+
+namespace gravastar {
+
+// Fixed set of datagram slots filled by one recvmmsg() call, or by a
+// recvfrom() loop on platforms without it (OpenBSD, macOS). Slots hold
+// buffers borrowed from a PacketPool; Take() hands one over to the caller
+// and the next Receive() refills the gap.
+class UdpRecvBatch {
+public:
+    UdpRecvBatch(size_t capacity, PacketPool *pool);
+    ~UdpRecvBatch();
+
+    // Returns the number of datagrams received, 0 when the socket would block
+    // (or the pool is empty and one datagram was discarded), or -1 on error.
+    int Receive(int sock);
+
+    size_t capacity() const { return slots_.size(); }
+    PacketBuffer *Take(size_t i);
+    const struct sockaddr_in &addr(size_t i) const { return addrs_[i]; }
+    socklen_t addr_len(size_t i) const { return addr_lens_[i]; }
+    unsigned long discarded() const { return discarded_; }
+
+private:
+    UdpRecvBatch(const UdpRecvBatch &);
+    UdpRecvBatch &operator=(const UdpRecvBatch &);
+
+    size_t Refill();
+
+    PacketPool *pool_;
+    std::vector<PacketBuffer *> slots_;
+    std::vector<struct sockaddr_in> addrs_;
+    std::vector<socklen_t> addr_lens_;
+    unsigned long discarded_;
+    void *msgs_;
+};
+
+// Responses queued for a single sendmmsg() flush. Add() takes ownership of
+// the buffer and Flush() returns it to the pool once it has been sent.
+class UdpSendBatch {
+public:
+    UdpSendBatch(size_t capacity, PacketPool *pool);
+    ~UdpSendBatch();
+
+    // Returns false when the batch is full; the caller should Flush() first.
+    bool Add(PacketBuffer *buffer,
+             const struct sockaddr_in &addr, socklen_t addr_len);
+    void Flush(int sock);
+
+    size_t size() const { return count_; }
+    bool full() const { return count_ >= buffers_.size(); }
+
+private:
+    UdpSendBatch(const UdpSendBatch &);
+    UdpSendBatch &operator=(const UdpSendBatch &);
+
+    PacketPool *pool_;
+    size_t count_;
+    std::vector<PacketBuffer *> buffers_;
+    std::vector<struct sockaddr_in> addrs_;
+    std::vector<socklen_t> addr_lens_;
+    void *msgs_;
+};
+
+} // namespace gravastar
+
+#endif // GRAVASTAR_UDP_BATCH_H
@@ -0,0 +1,447 @@
+#include "upstream_engine.h"
+
+#include "atomic_ops.h"
+#include "upstream_resolver.h"
+#include "util.h"
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace gravastar {
+
+namespace {
+
+const size_t kIdSpace = 65536;
+
+// Offset just past the question of a single-question query, or 0. Queries
+// never use compression, so plain label walking is enough.
+size_t QuestionEnd(const unsigned char *data, size_t len) {
+    if (len < 12 || data[4] != 0 || data[5] != 1) {
+        return 0;
+    }
+    size_t pos = 12;
+    while (pos < len && data[pos] != 0) {
+        if ((data[pos] & 0xC0) != 0) {
+            return 0;
+        }
+        pos += 1 + data[pos];
+    }
+    pos += 1 + 4;
+    return pos <= len ? pos : 0;
+}
+
+bool SameQuestion(const unsigned char *a, const unsigned char *b, size_t end) {
+    for (size_t i = 12; i < end; ++i) {
+        unsigned char x = a[i];
+        unsigned char y = b[i];
+        if (x >= 'A' && x <= 'Z') {
+            x = static_cast<unsigned char>(x - 'A' + 'a');
+        }
+        if (y >= 'A' && y <= 'Z') {
+            y = static_cast<unsigned char>(y - 'A' + 'a');
+        }
+        if (x != y) {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint64_t RandomSeed() {
+    uint64_t seed = 0;
+    FILE *f = std::fopen("/dev/urandom", "rb");
+    if (f) {
+        if (std::fread(&seed, sizeof(seed), 1, f) != 1) {
+            seed = 0;
+        }
+        std::fclose(f);
+    }
+    if (seed == 0) {
+        seed = MonotonicMicros() ^ (static_cast<uint64_t>(std::time(NULL)) << 20) ^
+               static_cast<uint64_t>(getpid());
+    }
+    return seed == 0 ? 0x9E3779B97F4A7C15ULL : seed;
+}
+
+} // namespace
+
+UpstreamEngine::UpstreamEngine(const std::vector<std::string> &servers,
+                               size_t sockets_per_server,
+                               unsigned int timeout_ms, size_t max_inflight,
+                               EventBackend backend)
+    : server_names_(servers),
+      sockets_per_server_(sockets_per_server == 0 ? 1 : sockets_per_server),
+      timeout_us_(static_cast<uint64_t>(timeout_ms) * 1000),
+      late_us_(0),
+      loop_(backend),
+      started_(false),
+      stopping_(0),
+      slots_(max_inflight == 0 ? 1 : max_inflight),
+      by_id_(kIdSpace, 0),
+      next_serial_(0),
+      recv_buf_(65535),
+      random_state_(RandomSeed()),
+      inflight_(0),
+      timeouts_(0) {
+    pthread_mutex_init(&mutex_, NULL);
+    free_slots_.reserve(slots_.size());
+    for (size_t i = slots_.size(); i > 0; --i) {
+        slots_[i - 1].active = false;
+        slots_[i - 1].generation = 0;
+        free_slots_.push_back(i - 1);
+    }
+    free_ids_.reserve(kIdSpace);
+    for (size_t i = 0; i < kIdSpace; ++i) {
+        free_ids_.push_back(static_cast<uint16_t>(i));
+    }
+}
+
+UpstreamEngine::~UpstreamEngine() {
+    Stop();
+    pthread_mutex_destroy(&mutex_);
+}
+
+bool UpstreamEngine::Start() {
+    if (started_ || AtomicLoadRelaxed(&stopping_) || !loop_.ok()) {
+        return false;
+    }
+    for (size_t i = 0; i < server_names_.size(); ++i) {
+        std::string host;
+        int port = 53;
+        Server server;
+        std::memset(&server.addr, 0, sizeof(server.addr));
+        server.addr.sin_family = AF_INET;
+        if (!ParseHostPort(server_names_[i], 53, &host, &port) ||
+            inet_pton(AF_INET, host.c_str(), &server.addr.sin_addr) != 1) {
+            DebugLog(std::string("upstream inet_pton failed for: ") +
+                     server_names_[i]);
+            continue;
+        }
+        server.addr.sin_port = htons(static_cast<unsigned short>(port));
+        server.name = server_names_[i];
+        server.next_sock = 0;
+        for (size_t j = 0; j < sockets_per_server_; ++j) {
+            int sock = socket(AF_INET, SOCK_DGRAM, 0);
+            if (sock < 0) {
+                DebugLog(std::string("upstream socket() failed: ") +
+                         std::strerror(errno));
+                break;
+            }
+            int flags = fcntl(sock, F_GETFL, 0);
+            if (flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) != 0 ||
+                connect(sock, reinterpret_cast<struct sockaddr *>(&server.addr),
+                        sizeof(server.addr)) != 0 ||
+                !loop_.Add(sock, EVENT_READ)) {
+                DebugLog(std::string("upstream socket setup failed: ") +
+                         std::strerror(errno));
+                close(sock);
+                break;
+            }
+            server.socks.push_back(sock);
+        }
+        if (!server.socks.empty()) {
+            servers_.push_back(server);
+        }
+    }
+    if (servers_.empty()) {
+        DebugLog("No usable upstream UDP servers for the async engine");
+        return false;
+    }
+    pthread_mutex_lock(&mutex_);
+    started_ = pthread_create(&thread_, NULL, ThreadEntry, this) == 0;
+    pthread_mutex_unlock(&mutex_);
+    return started_;
+}
+
+void UpstreamEngine::Stop() {
+    pthread_mutex_lock(&mutex_);
+    AtomicStore(&stopping_, 1);
+    bool joinable = started_;
+    started_ = false;
+    pthread_mutex_unlock(&mutex_);
+    if (joinable) {
+        loop_.Wake();
+        pthread_join(thread_, NULL);
+    }
+    for (size_t i = 0; i < slots_.size(); ++i) {
+        if (slots_[i].active) {
+            Finish(i, UPSTREAM_CANCELLED, NULL, 0);
+        }
+    }
+    std::vector<Submission> pending;
+    pthread_mutex_lock(&mutex_);
+    pending.swap(submissions_);
+    pthread_mutex_unlock(&mutex_);
+    for (size_t i = 0; i < pending.size(); ++i) {
+        pending[i].callback(pending[i].ctx, UPSTREAM_CANCELLED, NULL, 0,
+                            std::string());
+    }
+    for (size_t i = 0; i < servers_.size(); ++i) {
+        for (size_t j = 0; j < servers_[i].socks.size(); ++j) {
+            loop_.Remove(servers_[i].socks[j]);
+            close(servers_[i].socks[j]);
+        }
+    }
+    servers_.clear();
+    deadlines_.clear();
+    late_.clear();
+}
+
+void UpstreamEngine::SetLateNotice(unsigned int ms) {
+    late_us_ = static_cast<uint64_t>(ms) * 1000;
+}
+
+bool UpstreamEngine::Submit(const unsigned char *query, size_t len,
+                            UpstreamCallback callback, void *ctx) {
+    pthread_mutex_lock(&mutex_);
+    if (!started_) {
+        pthread_mutex_unlock(&mutex_);
+        return false;
+    }
+    bool was_empty = submissions_.empty();
+    submissions_.push_back(Submission());
+    submissions_.back().query.assign(query, query + len);
+    submissions_.back().callback = callback;
+    submissions_.back().ctx = ctx;
+    if (was_empty) {
+        loop_.Wake();
+    }
+    pthread_mutex_unlock(&mutex_);
+    return true;
+}
+
+size_t UpstreamEngine::inflight() const {
+    return AtomicLoadRelaxed(&inflight_);
+}
+
+unsigned long UpstreamEngine::timeouts() const {
+    return AtomicLoadRelaxed(&timeouts_);
+}
+
+void *UpstreamEngine::ThreadEntry(void *arg) {
+    static_cast<UpstreamEngine *>(arg)->Loop();
+    return NULL;
+}
+
+void UpstreamEngine::Loop() {
+    std::vector<LoopEvent> events;
+    std::vector<Submission> batch;
+    while (!AtomicLoad(&stopping_)) {
+        int timeout_ms = -1;
+        if (!deadlines_.empty() || !late_.empty()) {
+            uint64_t now = MonotonicMicros();
+            uint64_t at = deadlines_.empty() ? late_.front().at_us
+                                             : deadlines_.front().at_us;
+            if (!late_.empty() && late_.front().at_us < at) {
+                at = late_.front().at_us;
+            }
+            timeout_ms = at > now ? static_cast<int>((at - now) / 1000) + 1 : 0;
+        }
+        int ready = loop_.Wait(timeout_ms, &events);
+        for (int i = 0; i < ready; ++i) {
+            if (events[i].events & (EVENT_READ | EVENT_ERROR)) {
+                ReadSocket(events[i].fd);
+            }
+        }
+        pthread_mutex_lock(&mutex_);
+        batch.swap(submissions_);
+        pthread_mutex_unlock(&mutex_);
+        uint64_t now = MonotonicMicros();
+        for (size_t i = 0; i < batch.size(); ++i) {
+            Dispatch(&batch[i], now);
+        }
+        batch.clear();
+        now = MonotonicMicros();
+        Expire(now);
+        NoticeLate(now);
+    }
+}
+
+void UpstreamEngine::Dispatch(Submission *submission, uint64_t now_us) {
+    size_t question_end =
+        submission->query.empty()
+            ? 0
+            : QuestionEnd(&submission->query[0], submission->query.size());
+    if (question_end == 0 || free_slots_.empty()) {
+        if (question_end != 0) {
+            DebugLog("Upstream transaction table full");
+        }
+        submission->callback(submission->ctx, UPSTREAM_FAILED, NULL, 0,
+                             std::string());
+        return;
+    }
+    size_t slot = free_slots_.back();
+    free_slots_.pop_back();
+    Transaction &txn = slots_[slot];
+    txn.active = true;
+    txn.id = TakeId();
+    txn.client_id = static_cast<uint16_t>((submission->query[0] << 8) |
+                                          submission->query[1]);
+    txn.callback = submission->callback;
+    txn.ctx = submission->ctx;
+    txn.query.swap(submission->query);
+    txn.query[0] = static_cast<unsigned char>(txn.id >> 8);
+    txn.query[1] = static_cast<unsigned char>(txn.id & 0xff);
+    txn.question_end = question_end;
+    txn.server = 0;
+    txn.tries = 0;
+    txn.sock = -1;
+    txn.serial = ++next_serial_;
+    by_id_[txn.id] = static_cast<uint32_t>(slot + 1);
+    if (late_us_ > 0) {
+        Deadline late;
+        late.slot = slot;
+        late.generation = static_cast<uint32_t>(txn.serial);
+        late.at_us = now_us + late_us_;
+        late_.push_back(late);
+    }
+    AtomicFetchAddRelaxed(&inflight_, static_cast<size_t>(1));
+    Send(slot, now_us);
+}
+
+// Sends (or resends) a transaction to its current server. A server whose
+// sockets refuse the datagram counts as a timed-out try.
+void UpstreamEngine::Send(size_t slot, uint64_t now_us) {
+    Transaction &txn = slots_[slot];
+    while (txn.tries < servers_.size()) {
+        Server &server = servers_[txn.server];
+        int sock = server.socks[server.next_sock];
+        server.next_sock = (server.next_sock + 1) % server.socks.size();
+        if (send(sock, &txn.query[0], txn.query.size(), 0) >= 0) {
+            txn.sock = sock;
+            Deadline deadline;
+            deadline.slot = slot;
+            deadline.generation = txn.generation;
+            deadline.at_us = now_us + timeout_us_;
+            deadlines_.push_back(deadline);
+            if (DebugEnabled()) {
+                std::ostringstream out;
+                out << "Upstream query sent to " << server.name;
+                DebugLog(out.str());
+            }
+            return;
+        }
+        DebugLog(std::string("upstream send failed: ") + std::strerror(errno));
+        ++txn.tries;
+        txn.server = (txn.server + 1) % servers_.size();
+    }
+    Finish(slot, UPSTREAM_FAILED, NULL, 0);
+}
+
+void UpstreamEngine::ReadSocket(int fd) {
+    for (;;) {
+        ssize_t got = recv(fd, &recv_buf_[0], recv_buf_.size(), 0);
+        if (got < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                // ICMP errors on connected sockets surface here; the
+                // transaction will time out and fail over.
+                DebugLog(std::string("upstream recv failed: ") +
+                         std::strerror(errno));
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        size_t len = static_cast<size_t>(got);
+        if (len < 12) {
+            continue;
+        }
+        uint16_t id = static_cast<uint16_t>((recv_buf_[0] << 8) | recv_buf_[1]);
+        uint32_t entry = by_id_[id];
+        if (entry == 0) {
+            continue;
+        }
+        size_t slot = entry - 1;
+        Transaction &txn = slots_[slot];
+        // Only the socket we sent on, with our question echoed back, counts;
+        // anything else is a late answer or a spoofing attempt.
+        if (txn.sock != fd || (recv_buf_[2] & 0x80) == 0 ||
+            len < txn.question_end ||
+            std::memcmp(&recv_buf_[4], &txn.query[4], 2) != 0 ||
+            !SameQuestion(&recv_buf_[0], &txn.query[0], txn.question_end)) {
+            continue;
+        }
+        recv_buf_[0] = static_cast<unsigned char>(txn.client_id >> 8);
+        recv_buf_[1] = static_cast<unsigned char>(txn.client_id & 0xff);
+        if (DebugEnabled()) {
+            std::ostringstream out;
+            out << "Upstream response received: " << len << " bytes";
+            DebugLog(out.str());
+        }
+        Finish(slot, UPSTREAM_OK, &recv_buf_[0], len);
+    }
+}
+
+void UpstreamEngine::Expire(uint64_t now_us) {
+    while (!deadlines_.empty() && deadlines_.front().at_us <= now_us) {
+        Deadline deadline = deadlines_.front();
+        deadlines_.pop_front();
+        Transaction &txn = slots_[deadline.slot];
+        if (!txn.active || txn.generation != deadline.generation) {
+            continue;
+        }
+        AtomicFetchAddRelaxed(&timeouts_, 1UL);
+        DebugLog("upstream wait timed out");
+        // Bump the generation so the deadline of this try can never match
+        // the retry.
+        ++txn.generation;
+        ++txn.tries;
+        txn.server = (txn.server + 1) % servers_.size();
+        Send(deadline.slot, now_us);
+    }
+}
+
+void UpstreamEngine::NoticeLate(uint64_t now_us) {
+    while (!late_.empty() && late_.front().at_us <= now_us) {
+        Deadline late = late_.front();
+        late_.pop_front();
+        Transaction &txn = slots_[late.slot];
+        if (!txn.active || static_cast<uint32_t>(txn.serial) != late.generation) {
+            continue;
+        }
+        txn.callback(txn.ctx, UPSTREAM_LATE, NULL, 0, servers_[txn.server].name);
+    }
+}
+
+void UpstreamEngine::Finish(size_t slot, UpstreamStatus status,
+                            const unsigned char *response, size_t len) {
+    Transaction &txn = slots_[slot];
+    UpstreamCallback callback = txn.callback;
+    void *ctx = txn.ctx;
+    const std::string &server = servers_[txn.server].name;
+    txn.active = false;
+    ++txn.generation;
+    by_id_[txn.id] = 0;
+    free_ids_.push_back(txn.id);
+    free_slots_.push_back(slot);
+    AtomicFetchSub(&inflight_, static_cast<size_t>(1));
+    callback(ctx, status, response, len, server);
+}
+
+// Picks a random free ID, so IDs on the wire stay unpredictable no matter
+// how the callers number their queries.
+uint16_t UpstreamEngine::TakeId() {
+    size_t index = static_cast<size_t>(NextRandom() % free_ids_.size());
+    uint16_t id = free_ids_[index];
+    free_ids_[index] = free_ids_.back();
+    free_ids_.pop_back();
+    return id;
+}
+
+uint64_t UpstreamEngine::NextRandom() {
+    // xorshift64*
+    random_state_ ^= random_state_ >> 12;
+    random_state_ ^= random_state_ << 25;
+    random_state_ ^= random_state_ >> 27;
+    return random_state_ * 2685821657736338717ULL;
+}
+
+} // namespace gravastar
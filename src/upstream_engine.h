@@ -0,0 +1,148 @@
+#ifndef GRAVASTAR_UPSTREAM_ENGINE_H
+#define GRAVASTAR_UPSTREAM_ENGINE_H
+
+#include "event_loop.h"
+
+#include <deque>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace gravastar {
+
+enum UpstreamStatus {
+    UPSTREAM_OK,
+    // Every server timed out, or the transaction table was full.
+    UPSTREAM_FAILED,
+    // The engine stopped before an answer arrived.
+    UPSTREAM_CANCELLED,
+    // No answer yet after the late-notice interval. The query keeps going
+    // and a final status follows.
+    UPSTREAM_LATE
+};
+
+// Completion for UpstreamEngine::Submit(). Runs on the engine thread (or on
+// the thread calling Stop() for cancellations). `response` carries the
+// caller's original query ID and is only valid during the call.
+typedef void (*UpstreamCallback)(void *ctx, UpstreamStatus status,
+                                 const unsigned char *response, size_t len,
+                                 const std::string &server);
+
+// Event-driven UDP forwarder. Each upstream server gets a few long-lived
+// connected sockets; one thread multiplexes them and matches answers through
+// a table of in-flight transactions keyed by a randomly chosen rewritten
+// query ID. A query that times out is retried on the next server in
+// configuration order before it fails.
+class UpstreamEngine {
+public:
+    UpstreamEngine(const std::vector<std::string> &servers,
+                   size_t sockets_per_server, unsigned int timeout_ms,
+                   size_t max_inflight, EventBackend backend);
+    ~UpstreamEngine();
+
+    // Opens the sockets and starts the thread. Servers are "ip" or
+    // "ip:port"; ones that do not parse are skipped.
+    bool Start();
+    // Stops the thread and cancels whatever is still in flight.
+    void Stop();
+    // Reports UPSTREAM_LATE for queries still unanswered `ms` after they
+    // were submitted. 0 (the default) disables it. Call before Start().
+    void SetLateNotice(unsigned int ms);
+
+    // Copies `query` and sends it from the engine thread. Safe to call from
+    // any thread. Returns false, without calling `callback`, when the engine
+    // is not running.
+    bool Submit(const unsigned char *query, size_t len,
+                UpstreamCallback callback, void *ctx);
+
+    size_t inflight() const;
+    unsigned long timeouts() const;
+
+private:
+    UpstreamEngine(const UpstreamEngine &);
+    UpstreamEngine &operator=(const UpstreamEngine &);
+
+    struct Server {
+        std::string name;
+        struct sockaddr_in addr;
+        std::vector<int> socks;
+        size_t next_sock;
+    };
+
+    struct Transaction {
+        bool active;
+        uint16_t id;
+        uint16_t client_id;
+        uint32_t generation;
+        // Identifies this use of the slot for the late notice, which
+        // outlives retries.
+        uint64_t serial;
+        UpstreamCallback callback;
+        void *ctx;
+        std::vector<unsigned char> query;
+        size_t question_end;
+        size_t server;
+        size_t tries;
+        int sock;
+    };
+
+    struct Submission {
+        std::vector<unsigned char> query;
+        UpstreamCallback callback;
+        void *ctx;
+    };
+
+    struct Deadline {
+        size_t slot;
+        uint32_t generation;
+        uint64_t at_us;
+    };
+
+    static void *ThreadEntry(void *arg);
+    void Loop();
+    void Dispatch(Submission *submission, uint64_t now_us);
+    void Send(size_t slot, uint64_t now_us);
+    void ReadSocket(int fd);
+    void Expire(uint64_t now_us);
+    void NoticeLate(uint64_t now_us);
+    void Finish(size_t slot, UpstreamStatus status,
+                const unsigned char *response, size_t len);
+    uint16_t TakeId();
+    uint64_t NextRandom();
+
+    std::vector<std::string> server_names_;
+    size_t sockets_per_server_;
+    uint64_t timeout_us_;
+    uint64_t late_us_;
+    EventLoop loop_;
+    pthread_t thread_;
+    bool started_;
+    int stopping_;
+    pthread_mutex_t mutex_;
+    std::vector<Submission> submissions_;
+
+    // Engine-thread state.
+    std::vector<Server> servers_;
+    std::vector<Transaction> slots_;
+    std::vector<size_t> free_slots_;
+    // Slot index + 1 for every ID in use, 0 for free ones.
+    std::vector<uint32_t> by_id_;
+    std::vector<uint16_t> free_ids_;
+    // Sends are appended in time order and the timeout is fixed, so the
+    // front is always the next deadline to fire.
+    std::deque<Deadline> deadlines_;
+    // Same for late notices; `generation` holds the low bits of the serial.
+    std::deque<Deadline> late_;
+    uint64_t next_serial_;
+    std::vector<unsigned char> recv_buf_;
+    uint64_t random_state_;
+
+    size_t inflight_;
+    unsigned long timeouts_;
+};
+
+} // namespace gravastar
+
+#endif // GRAVASTAR_UPSTREAM_ENGINE_H
@@ -1,5 +1,6 @@
 #include "upstream_resolver.h"
 
+#include "event_loop.h"
 #include "util.h"
 
 #include <arpa/inet.h>
@@ -9,7 +10,6 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <sstream>
-#include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -34,15 +34,7 @@ bool IsDir(const std::string &path) {
 }
 
 bool WaitForSocket(int fd, bool want_write, int timeout_sec) {
-    fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(fd, &fds);
-    struct timeval tv;
-    tv.tv_sec = timeout_sec;
-    tv.tv_usec = 0;
-    int ready = select(fd + 1, want_write ? NULL : &fds,
-                       want_write ? &fds : NULL, NULL, &tv);
-    return ready > 0;
+    return EventLoop::WaitForFd(fd, want_write, timeout_sec * 1000);
 }
 
 bool TlsWriteAll(struct tls *ctx, int fd,
@@ -368,16 +360,8 @@ bool UpstreamResolver::ResolveUdp(const std::vector<unsigned char> &query,
         DebugLog(out.str());
     }
 
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(sock, &readfds);
-    struct timeval tv;
-    tv.tv_sec = 2;
-    tv.tv_usec = 0;
-
-    int ready = select(sock + 1, &readfds, NULL, NULL, &tv);
-    if (ready <= 0) {
-        DebugLog("upstream select timed out or failed");
+    if (!WaitForSocket(sock, false, 2)) {
+        DebugLog("upstream wait timed out or failed");
         close(sock);
         return false;
     }
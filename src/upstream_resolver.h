@@ -12,6 +12,8 @@ public:
     void SetUdpServers(const std::vector<std::string> &servers);
     void SetDotServers(const std::vector<std::string> &servers);
     void SetDotVerify(bool verify);
+    const std::vector<std::string> &udp_servers() const { return udp_servers_; }
+    const std::vector<std::string> &dot_servers() const { return dot_servers_; }
 
     bool ResolveUdp(const std::vector<unsigned char> &query,
                     std::vector<unsigned char> *response,
@@ -3,6 +3,7 @@
 #include "controller_logger.h"
 
 #include <cctype>
+#include <ctime>
 #include <iostream>
 
 namespace gravastar {
@@ -64,6 +65,13 @@ bool StartsWith(const std::string &s, const std::string &prefix) {
     return true;
 }
 
+uint64_t MonotonicMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 +
+           static_cast<uint64_t>(ts.tv_nsec) / 1000;
+}
+
 void SetDebugEnabled(bool enabled) {
     g_debug_enabled = enabled;
     if (enabled) {
@@ -4,6 +4,8 @@
 #include <string>
 #include <vector>
 
+#include <stdint.h>
+
 namespace gravastar {
 
 enum LogLevel {
@@ -17,6 +19,8 @@ std::string Trim(const std::string &s);
 std::string ToLower(const std::string &s);
 std::vector<std::string> Split(const std::string &s, char delim);
 bool StartsWith(const std::string &s, const std::string &prefix);
+// Microseconds on a clock that never jumps; only differences are meaningful.
+uint64_t MonotonicMicros();
 void SetDebugEnabled(bool enabled);
 bool DebugEnabled();
 void DebugLog(const std::string &msg);
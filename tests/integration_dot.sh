@@ -30,6 +30,7 @@ listen_addr = "127.0.0.1"
 listen_port = 18054
 cache_size_mb = 1
 cache_ttl_sec = 30
+cache_snapshot_file = ""
 dot_verify = false
 blocklist_file = "blocklist.toml"
 local_records_file = "local_records.toml"
@@ -0,0 +1,189 @@
+#!/bin/sh
+set -eu
+
+if ! command -v dig >/dev/null 2>&1; then
+  echo "SKIP: dig not found"
+  exit 0
+fi
+
+if ! command -v python3 >/dev/null 2>&1; then
+  echo "SKIP: python3 not found"
+  exit 0
+fi
+
+if [ "$#" -lt 1 ]; then
+  echo "Usage: $0 /path/to/gravastar"
+  exit 1
+fi
+
+GRAVASTAR_BIN="$1"
+PORT=18057
+WORKDIR="$(mktemp -d)"
+LOGDIR="$WORKDIR/logs"
+MOCK_LOG="$WORKDIR/mock_upstream.log"
+SERVER_LOG="$WORKDIR/server.out"
+
+cleanup() {
+  if [ -n "${PID:-}" ]; then
+    kill "$PID" 2>/dev/null || true
+    wait "$PID" 2>/dev/null || true
+  fi
+  if [ -n "${UPSTREAM_PID:-}" ]; then
+    kill "$UPSTREAM_PID" 2>/dev/null || true
+    wait "$UPSTREAM_PID" 2>/dev/null || true
+  fi
+  rm -rf "$WORKDIR"
+}
+trap cleanup EXIT INT TERM
+
+cat > "$WORKDIR/blocklist.toml" <<'CONF'
+domains = []
+CONF
+
+cat > "$WORKDIR/local_records.toml" <<'CONF'
+[[record]]
+name = "router.local"
+type = "A"
+value = "192.168.0.1"
+CONF
+
+cat > "$WORKDIR/upstreams.toml" <<'CONF'
+udp_servers = ["127.0.0.1"]
+CONF
+
+cat > "$WORKDIR/gravastar.toml" <<CONF
+listen_addr = "127.0.0.1"
+listen_port = $PORT
+cache_size_mb = 1
+cache_ttl_sec = 30
+cache_snapshot_file = ""
+serve_stale_sec = 60
+stale_answer_ttl = 30
+stale_answer_timeout_ms = 0
+blocklist_file = "blocklist.toml"
+local_records_file = "local_records.toml"
+upstreams_file = "upstreams.toml"
+CONF
+
+cat > "$WORKDIR/mock_dns.py" <<'PY'
+#!/usr/bin/env python3
+import socket
+import struct
+
+BIND_ADDR = "127.0.0.1"
+BIND_PORT = 53
+
+
+def question_end(packet):
+    if len(packet) < 12:
+        return None
+    qdcount = struct.unpack("!H", packet[4:6])[0]
+    if qdcount < 1:
+        return None
+    pos = 12
+    while pos < len(packet):
+        ln = packet[pos]
+        pos += 1
+        if ln == 0:
+            break
+        if ln & 0xC0:
+            return None
+        pos += ln
+    if pos + 4 > len(packet):
+        return None
+    return pos + 4
+
+
+def make_response(query):
+    qend = question_end(query)
+    if qend is None:
+        return None
+    response = bytearray()
+    response.extend(query[0:2])  # transaction ID
+    response.extend(struct.pack("!H", 0x8183))  # response, NXDOMAIN
+    response.extend(query[4:6])  # qdcount
+    response.extend(b"\x00\x00")  # ancount
+    response.extend(struct.pack("!H", 1))  # nscount
+    response.extend(b"\x00\x00")  # arcount
+    response.extend(query[12:qend])  # original question
+    # SOA for the root with a one-second TTL and MINIMUM, so the negative
+    # answer goes stale almost at once.
+    rdata = b"\x00\x00" + struct.pack("!IIIII", 1, 60, 60, 60, 1)
+    response.extend(b"\x00")  # root
+    response.extend(struct.pack("!H", 6))  # type SOA
+    response.extend(struct.pack("!H", 1))  # class IN
+    response.extend(struct.pack("!I", 1))  # ttl
+    response.extend(struct.pack("!H", len(rdata)))
+    response.extend(rdata)
+    return bytes(response)
+
+
+def main():
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind((BIND_ADDR, BIND_PORT))
+    while True:
+        data, addr = sock.recvfrom(4096)
+        resp = make_response(data)
+        if resp is not None:
+            sock.sendto(resp, addr)
+
+
+if __name__ == "__main__":
+    main()
+PY
+
+query_status() {
+  dig @127.0.0.1 -p "$PORT" "$1" "$2" +time=1 +tries=1 +noall +comments \
+    | sed -n 's/.*status: \([A-Z]*\),.*/\1/p'
+}
+
+: > "$MOCK_LOG"
+python3 "$WORKDIR/mock_dns.py" >"$MOCK_LOG" 2>&1 &
+UPSTREAM_PID=$!
+sleep 0.2
+if ! kill -0 "$UPSTREAM_PID" 2>/dev/null; then
+  echo "SKIP: unable to start mock upstream on 127.0.0.1:53"
+  if [ -s "$MOCK_LOG" ]; then
+    cat "$MOCK_LOG"
+  fi
+  exit 0
+fi
+
+mkdir -p "$LOGDIR"
+GRAVASTAR_LOG_DIR="$LOGDIR" "$GRAVASTAR_BIN" -c "$WORKDIR" >"$SERVER_LOG" 2>&1 &
+PID=$!
+
+ATTEMPTS=20
+STATUS=""
+while [ "$ATTEMPTS" -gt 0 ]; do
+  STATUS="$(query_status "gone.example.test" A)"
+  if [ "$STATUS" = "NXDOMAIN" ]; then
+    break
+  fi
+  ATTEMPTS=$((ATTEMPTS - 1))
+  sleep 0.2
+done
+if [ "$STATUS" != "NXDOMAIN" ]; then
+  echo "Expected NXDOMAIN from upstream, got: $STATUS"
+  [ -f "$SERVER_LOG" ] && cat "$SERVER_LOG"
+  [ -f "$MOCK_LOG" ] && cat "$MOCK_LOG"
+  exit 1
+fi
+
+# With the upstream gone and the negative TTL run out, the name is still
+# known not to exist, for every type.
+kill "$UPSTREAM_PID" 2>/dev/null || true
+wait "$UPSTREAM_PID" 2>/dev/null || true
+UPSTREAM_PID=""
+sleep 2
+
+for QTYPE in A AAAA; do
+  STATUS="$(query_status "gone.example.test" "$QTYPE")"
+  if [ "$STATUS" != "NXDOMAIN" ]; then
+    echo "Expected stale NXDOMAIN for $QTYPE, got: $STATUS"
+    [ -f "$SERVER_LOG" ] && cat "$SERVER_LOG"
+    exit 1
+  fi
+done
+
+echo "integration stale nxdomain ok"
@@ -1,8 +1,15 @@
 #include <iostream>
 
+bool TestBlocklist();
 bool TestCache();
 bool TestConfig();
+bool TestDecisionCache();
 bool TestDnsPacket();
+bool TestEventLoop();
+bool TestJobRing();
+bool TestRateLimiter();
+bool TestTcpStream();
+bool TestUpstreamEngine();
 bool TestLoggingRotation();
 bool TestLoggingFailurePath();
 bool TestControllerLoggerRotation();
@@ -13,6 +20,10 @@ bool TestUpstreamBlocklistCacheFallback();
 
 int main() {
     int failures = 0;
+    if (!TestBlocklist()) {
+        std::cerr << "TestBlocklist failed\n";
+        failures++;
+    }
     if (!TestCache()) {
         std::cerr << "TestCache failed\n";
         failures++;
@@ -21,10 +32,34 @@ int main() {
         std::cerr << "TestConfig failed\n";
         failures++;
     }
+    if (!TestDecisionCache()) {
+        std::cerr << "TestDecisionCache failed\n";
+        failures++;
+    }
     if (!TestDnsPacket()) {
         std::cerr << "TestDnsPacket failed\n";
         failures++;
     }
+    if (!TestEventLoop()) {
+        std::cerr << "TestEventLoop failed\n";
+        failures++;
+    }
+    if (!TestJobRing()) {
+        std::cerr << "TestJobRing failed\n";
+        failures++;
+    }
+    if (!TestRateLimiter()) {
+        std::cerr << "TestRateLimiter failed\n";
+        failures++;
+    }
+    if (!TestTcpStream()) {
+        std::cerr << "TestTcpStream failed\n";
+        failures++;
+    }
+    if (!TestUpstreamEngine()) {
+        std::cerr << "TestUpstreamEngine failed\n";
+        failures++;
+    }
     if (!TestLoggingRotation()) {
         std::cerr << "TestLoggingRotation failed\n";
         failures++;
@@ -0,0 +1,49 @@
+#include "blocklist.h"
+
+#include <set>
+#include <sstream>
+#include <string>
+
+bool TestBlocklist() {
+    gravastar::Blocklist blocklist;
+    if (blocklist.IsBlocked("ads.example.com")) {
+        return false;
+    }
+    std::set<std::string> domains;
+    domains.insert("ads.example.com");
+    domains.insert("tracker.net");
+    domains.insert("Tracker.net");
+    blocklist.SetDomains(domains);
+    if (blocklist.size() != 2 || blocklist.generation() != 1) {
+        return false;
+    }
+    // The domain itself and anything under it, in any case.
+    if (!blocklist.IsBlocked("ads.example.com") ||
+        !blocklist.IsBlocked("ADS.Example.com.") ||
+        !blocklist.IsBlocked("a.b.tracker.net")) {
+        return false;
+    }
+    // Neither its parents nor names that only end the same way.
+    if (blocklist.IsBlocked("example.com") ||
+        blocklist.IsBlocked("badads.example.com") ||
+        blocklist.IsBlocked("mytracker.net") ||
+        blocklist.IsBlocked("net") || blocklist.IsBlocked("")) {
+        return false;
+    }
+    // Enough domains to grow the table well past its first size.
+    domains.clear();
+    for (int i = 0; i < 5000; ++i) {
+        std::ostringstream name;
+        name << "host" << i << ".example.org";
+        domains.insert(name.str());
+    }
+    blocklist.SetDomains(domains);
+    if (blocklist.size() != 5000 || blocklist.generation() != 2 ||
+        blocklist.IsBlocked("ads.example.com") ||
+        !blocklist.IsBlocked("www.host4999.example.org") ||
+        blocklist.IsBlocked("host5000.example.org")) {
+        return false;
+    }
+    blocklist.SetDomains(std::set<std::string>());
+    return blocklist.size() == 0 && !blocklist.IsBlocked("host1.example.org");
+}
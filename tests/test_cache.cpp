@@ -1,25 +1,226 @@
 #include "cache.h"
 
+#include <cstdio>
+#include <ctime>
 #include <unistd.h>
 
+namespace {
+
+// "a" IN A with one answer of TTL 300; the TTL field starts at byte 25.
+std::vector<unsigned char> AnswerWithTtl300() {
+    const unsigned char packet[] = {
+        0x12, 0x34, 0x81, 0x80, 0, 1, 0, 1, 0, 0, 0, 0,
+        1, 'a', 0, 0, 1, 0, 1,
+        0xC0, 0x0C, 0, 1, 0, 1, 0, 0, 0x01, 0x2C, 0, 4, 1, 2, 3, 4};
+    return std::vector<unsigned char>(packet, packet + sizeof(packet));
+}
+
+// An IN A question for `name`.
+gravastar::WireKey Key(const char *name) {
+    gravastar::WireKey key;
+    gravastar::MakeWireKey(name, 1, 1, &key);
+    return key;
+}
+
+unsigned long TtlOf(const std::vector<unsigned char> &packet) {
+    return (static_cast<unsigned long>(packet[25]) << 24) |
+           (static_cast<unsigned long>(packet[26]) << 16) |
+           (static_cast<unsigned long>(packet[27]) << 8) | packet[28];
+}
+
+} // namespace
+
 bool TestCache() {
+    // Start on a fresh second so the one-second sleep below lands exactly
+    // one tick later.
+    time_t start = std::time(NULL);
+    while (std::time(NULL) == start) {
+        usleep(1000);
+    }
+
     gravastar::DnsCache cache(32, 1);
     std::vector<unsigned char> resp1(20, 0x01);
     std::vector<unsigned char> resp2(20, 0x02);
 
-    cache.Put("a|1", resp1);
-    cache.Put("b|1", resp2);
+    cache.Put(Key("a"), resp1);
+    cache.Put(Key("b"), resp2);
 
     std::vector<unsigned char> out;
-    if (!cache.Get("b|1", &out)) {
+    if (!cache.Get(Key("b"), &out)) {
         return false;
     }
     if (out.size() != resp2.size()) {
         return false;
     }
 
+    gravastar::DnsCache hot(1024, 2);
+    hot.SetPrefetch(50, 2);
+    hot.Put(Key("c"), resp1);
+    gravastar::DnsCache stale(1 << 20, 1);
+    stale.SetStaleWindow(60);
+    stale.SetTtlClamp(0, 86400);
+    stale.Put(Key("d"), resp2);
+
+    // Room for exactly three entries: one slab and their bookkeeping. The
+    // least recently used entry goes first.
+    gravastar::DnsCache probe(1 << 20, 60);
+    probe.Put(Key("x"), resp1);
+    size_t one = probe.size_bytes();
+    probe.Put(Key("y"), resp1);
+    size_t overhead = probe.size_bytes() - one;
+    gravastar::DnsCache lru(one + 2 * overhead, 60);
+    lru.Put(Key("x"), resp1);
+    lru.Put(Key("y"), resp1);
+    lru.Put(Key("z"), resp1);
+    lru.Get(Key("x"), &out);
+    lru.Put(Key("w"), resp1);
+    if (lru.Get(Key("y"), &out) || !lru.Get(Key("x"), &out) ||
+        !lru.Get(Key("z"), &out) || !lru.Get(Key("w"), &out)) {
+        return false;
+    }
+
+    // Plain CLOCK keeps the entry just added even when every older one has
+    // been hit since, and so goes round again first.
+    gravastar::DnsCache clock(one + overhead, 60);
+    clock.SetPolicy(gravastar::CACHE_POLICY_CLOCK);
+    clock.Put(Key("a"), resp1);
+    clock.Put(Key("b"), resp1);
+    clock.Get(Key("a"), &out);
+    clock.Get(Key("b"), &out);
+    clock.Put(Key("c"), resp1);
+    if (!clock.Get(Key("c"), &out) || clock.entries() != 2) {
+        return false;
+    }
+
+    // Enough keys to grow the table several times; shrinking the limit then
+    // evicts the oldest out of the middle of probe runs.
+    gravastar::DnsCache big(64 << 20, 60);
+    char name[32];
+    for (int i = 0; i < 20000; ++i) {
+        std::snprintf(name, sizeof(name), "host%d", i);
+        big.Put(Key(name), resp1);
+    }
+    size_t half = big.size_bytes() / 2;
+    big.SetLimits(half, 60);
+    size_t kept = big.entries();
+    if (kept < 5000 || kept > 15000 || big.size_bytes() > half) {
+        return false;
+    }
+    int first_kept = 20000 - static_cast<int>(kept);
+    for (int i = 0; i < 20000; ++i) {
+        std::snprintf(name, sizeof(name), "host%d", i);
+        if (big.Get(Key(name), NULL) != (i >= first_kept)) {
+            return false;
+        }
+    }
+
+    // Keys spread over shards, each with its share of the budget. Small
+    // entries share 64-byte chunks; a large one gets its own allocation.
+    gravastar::DnsCache sharded(8 << 20, 60, 8);
+    for (int i = 0; i < 1000; ++i) {
+        std::snprintf(name, sizeof(name), "host%d", i);
+        sharded.Put(Key(name), resp1);
+    }
+    sharded.Put(Key("large"), std::vector<unsigned char>(10000, 0x03));
+    gravastar::CacheMemoryStats memory;
+    sharded.GetMemoryStats(&memory);
+    if (sharded.shards() != 8 || sharded.entries() != 1001 ||
+        memory.chunk_bytes != 1000 * 64 || memory.slab_bytes < 8 * 16384 ||
+        memory.oversize_bytes != Key("large").bytes.size() + 10000 ||
+        sharded.size_bytes() != memory.slab_bytes + memory.oversize_bytes +
+                                    memory.overhead_bytes +
+                                    memory.policy_bytes ||
+        !sharded.Get(Key("host999"), NULL) ||
+        !sharded.Get(Key("large"), &out) || out.size() != 10000) {
+        return false;
+    }
+    gravastar::DnsCache tiny(1 << 20, 60, 8);
+    if (tiny.shards() != 2) {
+        return false;
+    }
+
+    // A scan of one-off names only churns the small queue; keys hit before
+    // it stay.
+    for (int policy = gravastar::CACHE_POLICY_S3FIFO;
+         policy <= gravastar::CACHE_POLICY_TINYLFU; ++policy) {
+        gravastar::DnsCache scanned(64 * 1024, 60);
+        scanned.SetPolicy(static_cast<gravastar::CachePolicy>(policy));
+        for (int i = 0; i < 20; ++i) {
+            std::snprintf(name, sizeof(name), "hot%d", i);
+            scanned.Put(Key(name), resp1);
+            scanned.Get(Key(name), NULL);
+        }
+        for (int i = 0; i < 5000; ++i) {
+            std::snprintf(name, sizeof(name), "scan%d.tracker", i);
+            scanned.Put(Key(name), resp1);
+        }
+        for (int i = 0; i < 20; ++i) {
+            std::snprintf(name, sizeof(name), "hot%d", i);
+            if (!scanned.Get(Key(name), NULL)) {
+                return false;
+            }
+        }
+        if (scanned.size_bytes() > 64 * 1024) {
+            return false;
+        }
+    }
+
+    // Record TTLs set the lifetime, within the clamp.
+    gravastar::DnsCache ttls(1024, 120);
+    ttls.SetTtlClamp(0, 86400);
+    ttls.Put(Key("e"), AnswerWithTtl300());
+    gravastar::DnsCache capped(1024, 120);
+    capped.SetTtlClamp(0, 2);
+    capped.Put(Key("f"), AnswerWithTtl300());
+    if (!ttls.Get(Key("e"), &out) || TtlOf(out) != 300 ||
+        !capped.Get(Key("f"), &out) || TtlOf(out) != 2) {
+        return false;
+    }
+
+    bool prefetch = true;
+    if (!hot.Get(Key("c"), &out, &prefetch) || prefetch) {
+        return false;
+    }
+
     usleep(1100000);
-    if (cache.Get("a|1", &out)) {
+    if (cache.Get(Key("a"), &out) || cache.GetStale(Key("a"), 30, &out)) {
+        return false;
+    }
+    // Expired, but kept for the stale window.
+    if (stale.Get(Key("d"), &out) || !stale.GetStale(Key("d"), 30, &out) ||
+        out != resp2) {
+        return false;
+    }
+    // Served with the time it has left.
+    if (!capped.Get(Key("f"), &out) || TtlOf(out) != 1) {
+        return false;
+    }
+    // Second hit, in the last half of the TTL.
+    if (!hot.Get(Key("c"), &out, &prefetch) || !prefetch) {
+        return false;
+    }
+
+    // A snapshot keeps absolute expiries: without a stale window of its
+    // own, the restoring cache drops the expired entry.
+    const char *snapshot = "/tmp/gravastar_test_cache.snapshot";
+    stale.Put(Key("e"), AnswerWithTtl300());
+    gravastar::DnsCache warm(1 << 20, 1);
+    size_t saved = 0;
+    size_t loaded = 0;
+    std::string err;
+    bool restored = stale.Save(snapshot, 7, &saved, &err) &&
+                    warm.Load(snapshot, 7, &loaded, &err);
+    // One saved under another config is not loaded at all.
+    gravastar::DnsCache other(1 << 20, 1);
+    size_t other_loaded = 0;
+    bool mismatched = other.Load(snapshot, 8, &other_loaded, &err);
+    std::remove(snapshot);
+    if (mismatched || other_loaded != 0 || other.Get(Key("e"), &out)) {
+        return false;
+    }
+    if (!restored || saved != 2 || loaded != 1 ||
+        warm.GetStale(Key("d"), 30, &out) || !warm.Get(Key("e"), &out) ||
+        TtlOf(out) < 299 || TtlOf(out) > 300) {
         return false;
     }
     return true;
@@ -27,8 +27,27 @@ bool TestConfig() {
                    "listen_port = 8053\n"
                    "cache_size_mb = 1\n"
                    "cache_ttl_sec = 10\n"
+                   "cache_min_ttl = 5\n"
+                   "cache_shards = 4\n"
+                   "cache_policy = \"TinyLFU\"\n"
+                   "cache_snapshot_file = \"\"\n"
+                   "decision_cache_size = 0\n"
+                   "prefetch_percent = 20\n"
+                   "serve_stale_sec = 0\n"
                    "dot_verify = false\n"
                    "rebind_protection = false\n"
+                   "block_mode = \"NXDOMAIN\"\n"
+                   "block_ipv4 = \"10.0.0.53\"\n"
+                   "udp_batch_size = 16\n"
+                   "listen_shards = 2\n"
+                   "packet_pool_buffers = 256\n"
+                   "tcp_listen = false\n"
+                   "inline_answers = false\n"
+                   "queue_full_policy = \"REFUSED\"\n"
+                   "tcp_pipeline_depth = 8\n"
+                   "ratelimit_qps = 50\n"
+                   "worker_threads = 6\n"
+                   "upstream_timeout_ms = 500\n"
                    "log_level = \"warn\"\n"
                    "blocklist_file = \"blocklist.toml\"\n"
                    "local_records_file = \"local_records.toml\"\n"
@@ -83,9 +102,59 @@ bool TestConfig() {
     if (cfg.rebind_protection) {
         return false;
     }
+    if (cfg.block_mode != "nxdomain" || cfg.block_ttl != 60 ||
+        cfg.block_ipv4 != "10.0.0.53" || cfg.block_ipv6 != "::") {
+        return false;
+    }
     if (cfg.log_level != "warn") {
         return false;
     }
+    if (cfg.udp_batch_size != 16) {
+        return false;
+    }
+    if (cfg.listen_shards != 2) {
+        return false;
+    }
+    if (cfg.packet_pool_buffers != 256 || cfg.packet_buffer_size != 4096) {
+        return false;
+    }
+    if (cfg.inline_answers) {
+        return false;
+    }
+    if (cfg.queue_full_policy != "refused" || cfg.queue_capacity != 4096 ||
+        cfg.queue_target_ms != 1000) {
+        return false;
+    }
+    if (cfg.tcp_listen || cfg.tcp_pipeline_depth != 8 ||
+        cfg.tcp_max_connections != 128 || cfg.tcp_idle_timeout_sec != 10) {
+        return false;
+    }
+    if (cfg.worker_threads != 6 || !cfg.worker_autoscale ||
+        cfg.worker_cpu_affinity) {
+        return false;
+    }
+    if (!cfg.upstream_async || cfg.upstream_sockets != 4 ||
+        cfg.upstream_timeout_ms != 500 || cfg.upstream_max_inflight != 4096) {
+        return false;
+    }
+    if (cfg.cache_shards != 4 || cfg.cache_policy != "tinylfu" ||
+        !cfg.cache_snapshot_file.empty() || cfg.decision_cache_size != 0 ||
+        cfg.cache_min_ttl != 5 || cfg.cache_max_ttl != 86400 ||
+        cfg.cache_max_negative_ttl != 3600) {
+        return false;
+    }
+    if (cfg.prefetch_percent != 20 || cfg.prefetch_min_hits != 3 ||
+        cfg.prefetch_max_inflight != 16) {
+        return false;
+    }
+    if (cfg.serve_stale_sec != 0 || cfg.stale_answer_ttl != 30 ||
+        cfg.stale_answer_timeout_ms != 1800) {
+        return false;
+    }
+    if (cfg.ratelimit_qps != 50 || cfg.ratelimit_burst != 0 ||
+        cfg.rrl_responses_per_sec != 0 || cfg.rrl_slip != 2) {
+        return false;
+    }
 
     std::set<std::string> domains;
     if (!gravastar::ConfigLoader::LoadBlocklist(block_path, &domains, &err)) {
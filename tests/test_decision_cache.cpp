@@ -0,0 +1,46 @@
+#include "decision_cache.h"
+
+#include <string>
+
+namespace {
+
+gravastar::WireKey Key(const std::string &name) {
+    gravastar::WireKey key;
+    gravastar::MakeWireKey(name, gravastar::DNS_TYPE_A, 1, &key);
+    return key;
+}
+
+} // namespace
+
+bool TestDecisionCache() {
+    gravastar::DecisionCache decisions(100);
+    if (decisions.entries() != 128) {
+        return false;
+    }
+    gravastar::ResponseTemplate blocked;
+    const gravastar::ResponseTemplate *answer = NULL;
+    if (decisions.Lookup(Key("ads.example.com"), 1, &answer) !=
+        gravastar::DECISION_NONE) {
+        return false;
+    }
+    decisions.Store(Key("ads.example.com"), 1, gravastar::DECISION_BLOCKED,
+                    &blocked);
+    decisions.Store(Key("www.example.com"), 1, gravastar::DECISION_PASS, NULL);
+    if (decisions.Lookup(Key("ADS.example.com"), 1, &answer) !=
+            gravastar::DECISION_BLOCKED ||
+        answer != &blocked ||
+        decisions.Lookup(Key("www.example.com"), 1, &answer) !=
+            gravastar::DECISION_PASS) {
+        return false;
+    }
+    // A new generation makes every stored outcome stale.
+    if (decisions.Lookup(Key("ads.example.com"), 2, &answer) !=
+        gravastar::DECISION_NONE) {
+        return false;
+    }
+    // Names too long to keep are never stored.
+    std::string long_name = std::string(40, 'a') + "." + std::string(40, 'b');
+    decisions.Store(Key(long_name), 1, gravastar::DECISION_PASS, NULL);
+    return decisions.Lookup(Key(long_name), 1, &answer) ==
+           gravastar::DECISION_NONE;
+}
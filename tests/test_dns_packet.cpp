@@ -111,7 +111,7 @@ std::vector<unsigned char> BuildAResponseWithPrivateAndPublic() {
     buf.push_back(0x0C);
     WriteU16(&buf, gravastar::DNS_TYPE_A);
     WriteU16(&buf, 1);
-    WriteU32(&buf, 60);
+    WriteU32(&buf, 45);
     WriteU16(&buf, 4);
     buf.push_back(8);
     buf.push_back(8);
@@ -161,6 +161,35 @@ bool CollectARecordOffsets(const std::vector<unsigned char> &packet,
     return true;
 }
 
+// NXDOMAIN for nope.example.com/A with an SOA of TTL 900 and MINIMUM 60.
+std::vector<unsigned char> BuildNxDomainResponse() {
+    std::vector<unsigned char> buf;
+    WriteU16(&buf, 0x9999);
+    WriteU16(&buf, 0x8183);
+    WriteU16(&buf, 1);
+    WriteU16(&buf, 0);
+    WriteU16(&buf, 1);
+    WriteU16(&buf, 0);
+    WriteQName(&buf, "nope.example.com");
+    WriteU16(&buf, gravastar::DNS_TYPE_A);
+    WriteU16(&buf, 1);
+    std::vector<unsigned char> rdata;
+    WriteQName(&rdata, "ns.example.com");
+    WriteQName(&rdata, "host.example.com");
+    WriteU32(&rdata, 1);
+    WriteU32(&rdata, 7200);
+    WriteU32(&rdata, 900);
+    WriteU32(&rdata, 1209600);
+    WriteU32(&rdata, 60);
+    WriteQName(&buf, "example.com");
+    WriteU16(&buf, gravastar::DNS_TYPE_SOA);
+    WriteU16(&buf, 1);
+    WriteU32(&buf, 900);
+    WriteU16(&buf, static_cast<unsigned short>(rdata.size()));
+    buf.insert(buf.end(), rdata.begin(), rdata.end());
+    return buf;
+}
+
 std::vector<unsigned char> BuildPtrResponse() {
     std::vector<unsigned char> buf;
     WriteU16(&buf, 0x9999);
@@ -212,6 +241,18 @@ bool TestDnsPacket() {
     if (ptr.size() < query.size()) {
         return false;
     }
+    std::vector<unsigned char> shed = query;
+    shed.push_back(0xAA);
+    size_t shed_len = shed.size();
+    if (!gravastar::RewriteAsErrorResponse(&shed[0], &shed_len,
+                                           gravastar::DNS_RCODE_SERVFAIL)) {
+        return false;
+    }
+    if (shed_len != query.size() || ReadU16(shed, 0) != 0x1234 ||
+        (shed[2] & 0x80) == 0 || (shed[3] & 0x0f) != gravastar::DNS_RCODE_SERVFAIL ||
+        ReadU16(shed, 4) != 1 || ReadU16(shed, 10) != 0) {
+        return false;
+    }
     gravastar::PatchResponseId(&resp, 0xBEEF);
     if (ReadU16(resp, 0) != 0xBEEF) {
         return false;
@@ -259,5 +300,94 @@ bool TestDnsPacket() {
     if (rewritten_again) {
         return false;
     }
+
+    std::vector<size_t> ttl_offsets;
+    uint32_t min_ttl = 0;
+    if (!gravastar::FindResponseTtls(upstream_resp, &ttl_offsets, &min_ttl)) {
+        return false;
+    }
+    if (min_ttl != 45 || ttl_offsets.size() != a_offsets.size()) {
+        return false;
+    }
+    gravastar::SetTtlsAt(&upstream_resp, ttl_offsets, 30);
+    for (size_t i = 0; i < a_offsets.size(); ++i) {
+        size_t ttl = a_offsets[i] - 6;
+        if (ttl_offsets[i] != ttl || ReadU16(upstream_resp, ttl) != 0 ||
+            ReadU16(upstream_resp, ttl + 2) != 30) {
+            return false;
+        }
+    }
+
+    bool nxdomain = false;
+    uint32_t negative_ttl = 0;
+    if (gravastar::IsNegativeResponse(upstream_resp, &nxdomain) ||
+        gravastar::FindNegativeTtl(upstream_resp, &negative_ttl)) {
+        return false;
+    }
+    std::vector<unsigned char> nx = BuildNxDomainResponse();
+    if (!gravastar::IsNegativeResponse(nx, &nxdomain) || !nxdomain ||
+        !gravastar::FindNegativeTtl(nx, &negative_ttl) || negative_ttl != 60) {
+        return false;
+    }
+    // The qname ends at 12 + 18 bytes.
+    if (!gravastar::SetQuestionType(&nx, gravastar::DNS_TYPE_AAAA) ||
+        ReadU16(nx, 30) != gravastar::DNS_TYPE_AAAA) {
+        return false;
+    }
+
+    // Template answers copy the question and parse like any other response.
+    gravastar::ResponseTemplate tmpl;
+    gravastar::MakeNegativeTemplate(gravastar::DNS_RCODE_NXDOMAIN, 300, &tmpl);
+    std::vector<unsigned char> blocked;
+    gravastar::BuildTemplateResponse(&query[0], header, question, tmpl,
+                                     &blocked);
+    if (ReadU16(blocked, 0) != 0x1234 || (blocked[3] & 0x0f) != 3 ||
+        !gravastar::IsNegativeResponse(blocked, &nxdomain) || !nxdomain ||
+        !gravastar::FindNegativeTtl(blocked, &negative_ttl) ||
+        negative_ttl != 300) {
+        return false;
+    }
+    const unsigned char null_ip[4] = {0, 0, 0, 0};
+    gravastar::MakeAddressTemplate(gravastar::DNS_TYPE_A, null_ip, 4, 60,
+                                   &tmpl);
+    gravastar::BuildTemplateResponse(&query[0], header, question, tmpl,
+                                     &blocked);
+    uint32_t answer_ttl = 0;
+    if (blocked.size() != query.size() + 16 || ReadU16(blocked, 6) != 1 ||
+        gravastar::IsNegativeResponse(blocked, NULL) ||
+        !gravastar::FindResponseTtls(blocked, NULL, &answer_ttl) ||
+        answer_ttl != 60) {
+        return false;
+    }
+
+    // Wire keys ignore case and a trailing dot, and keep CD and DO apart.
+    gravastar::WireKey key;
+    gravastar::MakeWireKey("example.com.", gravastar::DNS_TYPE_A, 1, &key);
+    if (question.key.bytes != key.bytes || question.key.hash != key.hash) {
+        return false;
+    }
+    std::vector<unsigned char> secure = BuildQuery("ExAmple.COM", gravastar::DNS_TYPE_A);
+    secure[3] |= 0x10;
+    secure[11] = 1;
+    const unsigned char opt[] = {0, 0, 41, 0x10, 0, 0, 0, 0x80, 0, 0, 0};
+    secure.insert(secure.end(), opt, opt + sizeof(opt));
+    gravastar::DnsQuestion secure_question;
+    if (!gravastar::ParseDnsQuery(secure, &header, &secure_question)) {
+        return false;
+    }
+    key.bytes[key.bytes.size() - 1] = gravastar::WIRE_KEY_CD | gravastar::WIRE_KEY_DO;
+    if (secure_question.key.bytes != key.bytes) {
+        return false;
+    }
+    gravastar::SetWireKeyType(&key, gravastar::DNS_TYPE_AAAA);
+    if (gravastar::WireKeyType(key) != gravastar::DNS_TYPE_AAAA) {
+        return false;
+    }
+    key.bytes[key.bytes.size() - 1] = 0;
+    gravastar::WireKey aaaa;
+    gravastar::MakeWireKey("example.com", gravastar::DNS_TYPE_AAAA, 1, &aaaa);
+    if (key.bytes != aaaa.bytes) {
+        return false;
+    }
     return true;
 }
@@ -0,0 +1,84 @@
+#include "event_loop.h"
+
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+bool CheckBackend(gravastar::EventBackend backend) {
+    gravastar::EventLoop loop(backend);
+    if (!loop.ok()) {
+        return false;
+    }
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return false;
+    }
+    bool ok = true;
+    std::vector<gravastar::LoopEvent> events;
+    if (!loop.Add(fds[0], gravastar::EVENT_READ)) {
+        ok = false;
+    }
+    if (ok && loop.Wait(10, &events) != 0) {
+        ok = false;
+    }
+    if (ok) {
+        loop.Wake();
+        if (loop.Wait(1000, &events) != 0) {
+            ok = false;
+        }
+    }
+    if (ok) {
+        unsigned char byte = 7;
+        if (write(fds[1], &byte, 1) != 1) {
+            ok = false;
+        }
+    }
+    if (ok && (loop.Wait(1000, &events) != 1 || events[0].fd != fds[0] ||
+               !(events[0].events & gravastar::EVENT_READ))) {
+        ok = false;
+    }
+    if (ok && !loop.Remove(fds[0])) {
+        ok = false;
+    }
+    if (ok && loop.Wait(10, &events) != 0) {
+        ok = false;
+    }
+    if (ok && !gravastar::EventLoop::WaitForFd(fds[0], false, 10)) {
+        ok = false;
+    }
+
+    // No interest at all, then some, then none again before removal.
+    if (ok && (!loop.Add(fds[0], 0) || loop.Wait(10, &events) != 0 ||
+               !loop.Modify(fds[0], gravastar::EVENT_READ) ||
+               loop.Wait(1000, &events) != 1 || events[0].fd != fds[0])) {
+        ok = false;
+    }
+    if (ok && (!loop.Modify(fds[0], 0) || loop.Wait(10, &events) != 0 ||
+               !loop.Remove(fds[0]) || loop.Wait(10, &events) != 0)) {
+        ok = false;
+    }
+    close(fds[0]);
+    close(fds[1]);
+    return ok;
+}
+
+} // namespace
+
+bool TestEventLoop() {
+    if (!CheckBackend(gravastar::EVENT_BACKEND_AUTO)) {
+        return false;
+    }
+    if (!CheckBackend(gravastar::EVENT_BACKEND_POLL)) {
+        return false;
+    }
+    gravastar::EventBackend parsed = gravastar::EVENT_BACKEND_AUTO;
+    if (!gravastar::EventLoop::ParseBackend("poll", &parsed) ||
+        parsed != gravastar::EVENT_BACKEND_POLL) {
+        return false;
+    }
+    if (gravastar::EventLoop::ParseBackend("select", &parsed)) {
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,95 @@
+#include "job_ring.h"
+
+#include <pthread.h>
+#include <vector>
+
+namespace {
+
+struct Item {
+    std::vector<unsigned char> payload;
+    unsigned long value;
+
+    void Swap(Item &other) {
+        payload.swap(other.payload);
+        unsigned long tmp = value;
+        value = other.value;
+        other.value = tmp;
+    }
+};
+
+struct ConsumerState {
+    gravastar::JobRing<Item> *ring;
+    unsigned long expected;
+    unsigned long sum;
+    unsigned long count;
+};
+
+void *Consume(void *arg) {
+    ConsumerState *state = static_cast<ConsumerState *>(arg);
+    Item item;
+    item.value = 0;
+    while (state->count < state->expected) {
+        if (state->ring->TryPop(&item)) {
+            state->sum += item.value;
+            state->count += 1;
+        }
+    }
+    return NULL;
+}
+
+} // namespace
+
+bool TestJobRing() {
+    gravastar::JobRing<Item> ring(3);
+    if (ring.capacity() != 4) {
+        return false;
+    }
+    Item item;
+    item.payload.assign(8, 0x5a);
+    for (unsigned long i = 0; i < 4; ++i) {
+        item.value = i;
+        if (!ring.TryPush(&item)) {
+            return false;
+        }
+    }
+    item.value = 99;
+    if (ring.TryPush(&item)) {
+        return false;
+    }
+    if (ring.ApproxSize() != 4) {
+        return false;
+    }
+    Item out;
+    out.value = 0;
+    if (!ring.TryPop(&out) || out.value != 0 || out.payload.size() != 8) {
+        return false;
+    }
+    for (unsigned long i = 1; i < 4; ++i) {
+        if (!ring.TryPop(&out) || out.value != i) {
+            return false;
+        }
+    }
+    if (ring.TryPop(&out)) {
+        return false;
+    }
+
+    gravastar::JobRing<Item> shared(64);
+    ConsumerState state;
+    state.ring = &shared;
+    state.expected = 20000;
+    state.sum = 0;
+    state.count = 0;
+    pthread_t consumer;
+    if (pthread_create(&consumer, NULL, Consume, &state) != 0) {
+        return false;
+    }
+    unsigned long expected_sum = 0;
+    for (unsigned long i = 1; i <= state.expected; ++i) {
+        item.value = i;
+        while (!shared.TryPush(&item)) {
+        }
+        expected_sum += i;
+    }
+    pthread_join(consumer, NULL);
+    return state.sum == expected_sum;
+}
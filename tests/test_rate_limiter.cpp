@@ -0,0 +1,34 @@
+#include "rate_limiter.h"
+
+bool TestRateLimiter() {
+    // 10 per second with a burst of 3.
+    gravastar::RateLimiter limiter(64, 10, 3);
+    uint64_t now = 1000000;
+    for (int i = 0; i < 3; ++i) {
+        if (!limiter.Allow(42, now, NULL)) {
+            return false;
+        }
+    }
+    unsigned long limited = 0;
+    if (limiter.Allow(42, now, &limited) || limited != 1) {
+        return false;
+    }
+    if (limiter.Allow(42, now, &limited) || limited != 2) {
+        return false;
+    }
+    // Other keys have their own bucket.
+    if (!limiter.Allow(7, now, NULL)) {
+        return false;
+    }
+    // 100ms buys back exactly one token.
+    now += 100000;
+    if (!limiter.Allow(42, now, NULL) || limiter.Allow(42, now, NULL)) {
+        return false;
+    }
+    // A flood of distinct keys recycles buckets instead of growing the table.
+    size_t entries = limiter.entries();
+    for (uint64_t key = 1000; key < 5000; ++key) {
+        limiter.Allow(key, now, NULL);
+    }
+    return limiter.entries() == entries;
+}
@@ -0,0 +1,104 @@
+#include "tcp_stream.h"
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+bool WriteAll(int fd, const unsigned char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+bool CheckFraming(int local, int peer) {
+    gravastar::TcpStream stream(local);
+    const unsigned char *data = NULL;
+    size_t len = 0;
+
+    // Two pipelined messages, the second split across reads.
+    const unsigned char first[] = {0x00, 0x03, 'a', 'b', 'c', 0x00, 0x02, 'x'};
+    if (!WriteAll(peer, first, sizeof(first)) || !stream.ReadAvailable()) {
+        return false;
+    }
+    if (!stream.PeekMessage(&data, &len) || len != 3 || data[0] != 'a' ||
+        data[2] != 'c') {
+        return false;
+    }
+    stream.PopMessage();
+    if (stream.PeekMessage(&data, &len)) {
+        return false;
+    }
+    const unsigned char rest[] = {'y'};
+    if (!WriteAll(peer, rest, sizeof(rest)) || !stream.ReadAvailable()) {
+        return false;
+    }
+    if (!stream.PeekMessage(&data, &len) || len != 2 || data[1] != 'y') {
+        return false;
+    }
+    stream.PopMessage();
+
+    const unsigned char reply[] = {'o', 'k'};
+    stream.QueueMessage(reply, sizeof(reply));
+    stream.QueueMessage(reply, 1);
+    if (!stream.write_pending() || !stream.Flush() || stream.write_pending()) {
+        return false;
+    }
+    unsigned char buf[16];
+    ssize_t got = read(peer, buf, sizeof(buf));
+    if (got != 7 || buf[0] != 0x00 || buf[1] != 0x02 || buf[2] != 'o' ||
+        buf[3] != 'k' || buf[5] != 0x01 || buf[6] != 'o') {
+        return false;
+    }
+
+    shutdown(peer, SHUT_WR);
+    return !stream.ReadAvailable();
+}
+
+// Answers a peer leaves unread mark the stream full at 64 KiB, and it
+// stops being full once they have been written out.
+bool CheckOutputCap(int local, int peer) {
+    gravastar::TcpStream stream(local);
+    unsigned char answer[510] = {0};
+    size_t queued = 0;
+    while (!stream.output_full() && queued < 1024) {
+        stream.QueueMessage(answer, sizeof(answer));
+        ++queued;
+    }
+    if (queued != 128) {
+        return false;
+    }
+    unsigned char buf[4096];
+    while (stream.write_pending()) {
+        if (!stream.Flush() || read(peer, buf, sizeof(buf)) <= 0) {
+            return false;
+        }
+    }
+    return !stream.output_full();
+}
+
+bool WithSocketPair(bool (*check)(int, int)) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        return false;
+    }
+    int flags = fcntl(fds[0], F_GETFL, 0);
+    bool ok = flags >= 0 && fcntl(fds[0], F_SETFL, flags | O_NONBLOCK) == 0 &&
+              check(fds[0], fds[1]);
+    close(fds[0]);
+    close(fds[1]);
+    return ok;
+}
+
+} // namespace
+
+bool TestTcpStream() {
+    return WithSocketPair(CheckFraming) && WithSocketPair(CheckOutputCap);
+}
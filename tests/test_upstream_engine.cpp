@@ -0,0 +1,176 @@
+#include "upstream_engine.h"
+
+#include <arpa/inet.h>
+#include <cstring>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+struct Completions {
+    pthread_mutex_t mutex;
+    int done;
+    int ok;
+    int failed;
+    int late;
+    unsigned int ids[8];
+};
+
+void OnAnswer(void *ctx, gravastar::UpstreamStatus status,
+              const unsigned char *response, size_t len, const std::string &) {
+    Completions *c = static_cast<Completions *>(ctx);
+    pthread_mutex_lock(&c->mutex);
+    if (status == gravastar::UPSTREAM_LATE) {
+        c->late++;
+        pthread_mutex_unlock(&c->mutex);
+        return;
+    }
+    if (status == gravastar::UPSTREAM_OK && len >= 12) {
+        c->ids[c->ok++] = (static_cast<unsigned int>(response[0]) << 8) |
+                          response[1];
+    } else if (status == gravastar::UPSTREAM_FAILED) {
+        c->failed++;
+    }
+    c->done++;
+    pthread_mutex_unlock(&c->mutex);
+}
+
+bool WaitDone(Completions *c, int want) {
+    for (int i = 0; i < 300; ++i) {
+        pthread_mutex_lock(&c->mutex);
+        int done = c->done;
+        pthread_mutex_unlock(&c->mutex);
+        if (done >= want) {
+            return true;
+        }
+        usleep(10000);
+    }
+    return false;
+}
+
+int BindLoopback(unsigned short *port) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (sock < 0 ||
+        bind(sock, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0 ||
+        getsockname(sock, reinterpret_cast<struct sockaddr *>(&addr), &len) != 0) {
+        if (sock >= 0) {
+            close(sock);
+        }
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+    return sock;
+}
+
+std::vector<unsigned char> MakeQuery(unsigned int id, const char *label) {
+    std::vector<unsigned char> q;
+    const unsigned char header[] = {0, 0, 0x01, 0x00, 0, 1, 0, 0, 0, 0, 0, 0};
+    q.assign(header, header + sizeof(header));
+    q[0] = static_cast<unsigned char>(id >> 8);
+    q[1] = static_cast<unsigned char>(id & 0xff);
+    size_t len = std::strlen(label);
+    q.push_back(static_cast<unsigned char>(len));
+    q.insert(q.end(), label, label + len);
+    const unsigned char tail[] = {4, 't', 'e', 's', 't', 0, 0, 1, 0, 1};
+    q.insert(q.end(), tail, tail + sizeof(tail));
+    return q;
+}
+
+// `silent_port` is bound but never read, so queries sent there time out
+// without an ICMP error.
+bool CheckEngine(int server, unsigned short port, unsigned short silent_port) {
+    std::vector<std::string> servers;
+    std::ostringstream first;
+    first << "127.0.0.1:" << silent_port;
+    std::ostringstream second;
+    second << "127.0.0.1:" << port;
+    servers.push_back(first.str());
+    servers.push_back(second.str());
+    gravastar::UpstreamEngine engine(servers, 2, 200, 64,
+                                     gravastar::EVENT_BACKEND_AUTO);
+    // Every query below is still unanswered 100 ms in.
+    engine.SetLateNotice(100);
+    if (!engine.Start()) {
+        return false;
+    }
+    Completions c;
+    std::memset(&c, 0, sizeof(c));
+    pthread_mutex_init(&c.mutex, NULL);
+
+    // Both go to the silent server first, time out, and fail over.
+    std::vector<unsigned char> a = MakeQuery(0x1111, "a");
+    std::vector<unsigned char> b = MakeQuery(0x2222, "b");
+    engine.Submit(&a[0], a.size(), OnAnswer, &c);
+    engine.Submit(&b[0], b.size(), OnAnswer, &c);
+
+    unsigned char buf[2][512];
+    ssize_t lens[2];
+    struct sockaddr_in from[2];
+    socklen_t from_len[2];
+    for (int i = 0; i < 2; ++i) {
+        struct pollfd pfd;
+        pfd.fd = server;
+        pfd.events = POLLIN;
+        from_len[i] = sizeof(from[i]);
+        if (poll(&pfd, 1, 2000) != 1 ||
+            (lens[i] = recvfrom(server, buf[i], sizeof(buf[i]), 0,
+                                reinterpret_cast<struct sockaddr *>(&from[i]),
+                                &from_len[i])) < 12) {
+            engine.Stop();
+            return false;
+        }
+    }
+    // A reply with an ID nobody is waiting for is ignored; the real ones are
+    // matched out of order.
+    unsigned char bogus[512];
+    std::memcpy(bogus, buf[0], static_cast<size_t>(lens[0]));
+    bogus[0] ^= 0x5a;
+    bogus[2] |= 0x80;
+    sendto(server, bogus, static_cast<size_t>(lens[0]), 0,
+           reinterpret_cast<struct sockaddr *>(&from[0]), from_len[0]);
+    for (int i = 1; i >= 0; --i) {
+        buf[i][2] |= 0x80;
+        sendto(server, buf[i], static_cast<size_t>(lens[i]), 0,
+               reinterpret_cast<struct sockaddr *>(&from[i]), from_len[i]);
+    }
+    bool ok = WaitDone(&c, 2) && c.ok == 2 && engine.timeouts() >= 2 &&
+              ((c.ids[0] == 0x2222 && c.ids[1] == 0x1111) ||
+               (c.ids[0] == 0x1111 && c.ids[1] == 0x2222));
+
+    // Nobody answers this one: it fails once every server has timed out.
+    std::vector<unsigned char> lost = MakeQuery(0x3333, "c");
+    engine.Submit(&lost[0], lost.size(), OnAnswer, &c);
+    ok = ok && WaitDone(&c, 3) && c.failed == 1 && c.late == 3 &&
+         engine.inflight() == 0;
+
+    engine.Stop();
+    pthread_mutex_destroy(&c.mutex);
+    return ok;
+}
+
+} // namespace
+
+bool TestUpstreamEngine() {
+    unsigned short port = 0;
+    unsigned short silent_port = 0;
+    int server = BindLoopback(&port);
+    int silent = BindLoopback(&silent_port);
+    bool ok = server >= 0 && silent >= 0 &&
+              CheckEngine(server, port, silent_port);
+    if (server >= 0) {
+        close(server);
+    }
+    if (silent >= 0) {
+        close(silent);
+    }
+    return ok;
+}